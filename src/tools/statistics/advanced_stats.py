@@ -1,37 +1,481 @@
+from typing import Callable
+
 import numpy as np
 import graphinglib as gl
 from scipy.optimize import curve_fit
-from copy import deepcopy
 from uncertainties import ufloat
 
-from src.tools.statistics.stats_library.build.stats_library import str_func_cpp
-
+from src.tools.statistics.stats_library.build.stats_library import (
+    CancellationFlag,
+    StructureFunctionAccumulator,
+    StructureFunctionPlan,
+    StructureFunctionTask,
+    autocorrelation_cpp,
+    fit_power_laws_cpp,
+    str_func_2d_cpp,
+    str_func_async_cpp,
+    str_func_cpp,
+    str_func_cube_cpp,
+    str_func_fft_cpp,
+    str_func_multi_cpp,
+    str_func_regions_cpp,
+    str_func_resampled_cpp,
+    str_func_sampled_cpp,
+)
 
-np_sort = lambda arr: arr[np.argsort(arr[:,0])]
 
-def structure_function(data: np.ndarray, order: int) -> np.ndarray:
+def structure_function(
+    data: np.ndarray,
+    order: int,
+    fft: bool=False,
+    min_lag: float=0,
+    max_lag: float=np.inf,
+    bin_width: float=0,
+    bins_per_decade: int=0,
+    bin_edges: list[float] | None=None,
+    profile: bool=False,
+    progress: Callable[[int, int], None] | None=None,
+    cancel_flag: CancellationFlag | None=None,
+    max_memory_bytes: int=0,
+) -> np.ndarray | tuple[np.ndarray, dict]:
     """
     Computes the structure function of a 2D array.
 
     Parameters
     ----------
     data : np.ndarray
-        Data from which to compute the structure function.
+        Data from which to compute the structure function. A C-contiguous float32 array is read without being converted,
+        which halves the memory of large maps, and its pair differences are still accumulated in double precision.
     order : int
         Order of the structure function to compute. This corresponds to the exponent applied on the pair differences.
+    fft : bool, default=False
+        Whether to compute the pair sums with Fourier transforms, which scales as O(N log N) instead of O(N^2) with the
+        number of pixels. This is only available for order=2.
+    min_lag : float, default=0
+        Smallest lag to compute.
+    max_lag : float, default=np.inf
+        Largest lag to compute. The pairs of pixels farther apart are never visited, so a small max_lag greatly reduces
+        the computation time of large arrays. With fft=True, every pair is still used and only the output is limited.
+    bin_width : float, default=0
+        Width of linear lag bins starting at zero. By default, each exact lag has its own bin.
+    bins_per_decade : int, default=0
+        Number of logarithmic lag bins per power of ten, starting at a lag of one. This gives evenly spaced points for
+        log-log fits.
+    bin_edges : list[float], optional
+        Increasing edges of the lag bins. Each bin contains the lags in [low edge, high edge). Only one of bin_width,
+        bins_per_decade and bin_edges can be given. The lag of a bin is the mean lag of its pairs of pixels.
+    profile : bool, default=False
+        Whether to also return the profile of the OpenMP computation, which requires the module to be built with
+        ./build.sh -DSTATS_LIBRARY_PROFILING=ON. It is not available with fft=True.
+    progress : Callable[[int, int], None], optional
+        Function called with the number of pair tiles done and their total number, from the calling thread and at most
+        every half second. The exceptions it raises stop the computation and are raised again.
+    cancel_flag : CancellationFlag, optional
+        Flag that stops the computation, with a StructureFunctionCancelled error, when its cancel() method is called,
+        e.g. from another thread. Ctrl-C also stops the computation, with a KeyboardInterrupt.
+    max_memory_bytes : int, default=0
+        Number of bytes that the buffers of the computation may use, or 0 for no budget. Fewer threads are used if
+        their accumulator tables would not fit, and a RuntimeError is raised if a single one would not.
+        The progress, cancel_flag and max_memory_bytes arguments only apply to the OpenMP pair engine, without fft.
 
     Returns
     -------
     np.ndarray
         Two-dimensional array with every group of three elements representing the lag and its corresponding structure
         function and uncertainty. The returned array is sorted according to the lag value.
+    dict
+        Only returned if profile=True. The "phases" dict gives the "wall_seconds", "cpu_seconds" and "calls" of each
+        phase (e.g. "pair_enumeration", "accumulator_merge", "reduction"), and the other keys give the number of
+        "pairs", the "peak_bytes" of the buffers of the engine, the busy "thread_seconds" of each thread and their
+        "imbalance", the ratio of the largest busy time to the mean one.
+    """
+    binning = dict(bin_width=bin_width, bins_per_decade=bins_per_decade, bin_edges=bin_edges or [])
+    controls = dict(progress=progress, cancel_flag=cancel_flag, max_memory_bytes=max_memory_bytes)
+    if profile:
+        if fft:
+            raise ValueError("The profile is only available for the OpenMP pair engine, without fft.")
+        return str_func_cpp(data, order, min_lag=min_lag, max_lag=max_lag, profile=True, **binning, **controls)
+    if fft:
+        return str_func_fft_cpp(data, order, min_lag=min_lag, max_lag=max_lag, **binning)
+    return str_func_cpp(data, order, min_lag=min_lag, max_lag=max_lag, **binning, **controls)
+
+def structure_function_async(
+    data: np.ndarray,
+    order: int,
+    min_lag: float=0,
+    max_lag: float=np.inf,
+    bin_width: float=0,
+    bins_per_decade: int=0,
+    bin_edges: list[float] | None=None,
+    max_memory_bytes: int=0,
+) -> StructureFunctionTask:
+    """
+    Starts computing the structure function of a 2D array in a background thread and returns immediately, so the
+    loading or plotting of other maps can overlap with the computation.
+
+    Parameters
+    ----------
+    data : np.ndarray
+        Data from which to compute the structure function. It is read in place, so it must not be modified until the
+        computation is done.
+    order, min_lag, max_lag, bin_width, bins_per_decade, bin_edges
+        Order, lag range and binning, as in structure_function.
+    max_memory_bytes : int, default=0
+        Memory budget of the computation, as in structure_function.
+
+    Returns
+    -------
+    StructureFunctionTask
+        Handle of the computation. Its done() method tells whether the structure function is computed, and its
+        result(timeout=None) method waits for it and returns the array that structure_function would return. Its
+        cancel() method stops the computation, after which result() raises a StructureFunctionCancelled error.
+    """
+    binning = dict(bin_width=bin_width, bins_per_decade=bins_per_decade, bin_edges=bin_edges or [])
+    return str_func_async_cpp(data, order, min_lag=min_lag, max_lag=max_lag, **binning,
+                              max_memory_bytes=max_memory_bytes)
+
+def structure_function_2d(
+    data: np.ndarray,
+    order: int,
+    fft: bool=False,
+    min_lag: float=0,
+    max_lag: float=np.inf,
+    progress: Callable[[int, int], None] | None=None,
+    cancel_flag: CancellationFlag | None=None,
+    max_memory_bytes: int=0,
+) -> tuple[np.ndarray, np.ndarray, np.ndarray]:
+    """
+    Computes the structure function of a 2D array as a function of the (dy, dx) offset between the pixels of each pair
+    instead of their distance, which reveals the anisotropy of the data.
+
+    Parameters
+    ----------
+    data : np.ndarray
+        Data of shape (H, W) from which to compute the structure function.
+    order : int
+        Order of the structure function to compute.
+    fft : bool, default=False
+        Whether to compute the pair sums with Fourier transforms. This is only available for order=2.
+    min_lag, max_lag : float
+        Range of the distances of the pairs, as in structure_function. Without fft, a smaller max_lag also shrinks the
+        table of the offsets that each thread keeps.
+    progress, cancel_flag, max_memory_bytes
+        Progress callback, cancellation flag and memory budget, as in structure_function. They are ignored with
+        fft=True.
+
+    Returns
+    -------
+    tuple[np.ndarray, np.ndarray, np.ndarray]
+        Maps of shape (2H - 1, 2W - 1) of the structure function, of its uncertainty and of the number of pairs. The
+        offset (dy, dx) is at [H - 1 + dy, W - 1 + dx], and the offsets without pairs are NaN.
+    """
+    return str_func_2d_cpp(
+        data, order, fft, min_lag=min_lag, max_lag=max_lag, progress=progress, cancel_flag=cancel_flag,
+        max_memory_bytes=max_memory_bytes,
+    )
+
+def structure_functions(
+    data: np.ndarray,
+    orders: list[int],
+    min_lag: float=0,
+    max_lag: float=np.inf,
+    bin_width: float=0,
+    bins_per_decade: int=0,
+    bin_edges: list[float] | None=None,
+) -> np.ndarray:
+    """
+    Computes the structure functions of several orders of a 2D array in a single pass over the pairs of points.
+
+    Parameters
+    ----------
+    data : np.ndarray
+        Data from which to compute the structure functions.
+    orders : list[int]
+        Non-negative orders of the structure functions to compute.
+    min_lag : float, default=0
+        Smallest lag to compute.
+    max_lag : float, default=np.inf
+        Largest lag to compute. The pairs of pixels farther apart are never visited.
+    bin_width : float, default=0
+        Width of linear lag bins starting at zero. By default, each exact lag has its own bin.
+    bins_per_decade : int, default=0
+        Number of logarithmic lag bins per power of ten, starting at a lag of one. This gives evenly spaced points for
+        log-log fits.
+    bin_edges : list[float], optional
+        Increasing edges of the lag bins. Each bin contains the lags in [low edge, high edge). Only one of bin_width,
+        bins_per_decade and bin_edges can be given. The lag of a bin is the mean lag of its pairs of pixels.
+
+    Returns
+    -------
+    np.ndarray
+        Two-dimensional array whose rows are the lag followed by the structure function and its uncertainty for each of
+        the given orders. The returned array is sorted according to the lag value.
+    """
+    binning = dict(bin_width=bin_width, bins_per_decade=bins_per_decade, bin_edges=bin_edges or [])
+    return str_func_multi_cpp(data, orders, min_lag=min_lag, max_lag=max_lag, **binning)
+
+def structure_function_cube(
+    data: np.ndarray,
+    order: int,
+    min_lag: float=0,
+    max_lag: float=np.inf,
+    bin_width: float=0,
+    bins_per_decade: int=0,
+    bin_edges: list[float] | None=None,
+) -> np.ndarray:
+    """
+    Computes the structure function of every slice along the first axis of a 3D array in a single call. The pair
+    geometry is shared by the slices and the pairs of every slice are computed in parallel, which is faster than calling
+    structure_function on each slice.
+
+    Parameters
+    ----------
+    data : np.ndarray
+        3D array, e.g. the data of a Cube, whose slices along the first axis are the maps from which to compute the
+        structure functions. A C-contiguous float32 array is read without being converted, as in structure_function.
+    order : int
+        Order of the structure functions to compute.
+    min_lag, max_lag, bin_width, bins_per_decade, bin_edges
+        Lag range and binning, as in structure_function.
+
+    Returns
+    -------
+    np.ndarray
+        Three-dimensional array of shape (n_slices, n_lags, 3) whose rows are the lag, the structure function and its
+        uncertainty of each slice. Every slice has the same rows, sorted according to the lag value, and the structure
+        function of a lag that a slice does not reach is NaN.
+    """
+    binning = dict(bin_width=bin_width, bins_per_decade=bins_per_decade, bin_edges=bin_edges or [])
+    return str_func_cube_cpp(data, order, min_lag=min_lag, max_lag=max_lag, **binning)
+
+def structure_function_regions(
+    data: np.ndarray,
+    labels: np.ndarray,
+    order: int,
+    cross_regions: bool=False,
+    min_lag: float=0,
+    max_lag: float=np.inf,
+    bin_width: float=0,
+    bins_per_decade: int=0,
+    bin_edges: list[float] | None=None,
+    progress: Callable[[int, int], None] | None=None,
+    cancel_flag: CancellationFlag | None=None,
+    max_memory_bytes: int=2 << 30,
+) -> dict[tuple[int, int], np.ndarray]:
+    """
+    Computes the structure function of every region of a 2D array given by an integer label image, e.g. filaments and
+    background made from masks, in a single pass over the pairs of pixels. This is much faster than computing the
+    structure function of each masked region separately when there are many regions.
+
+    Parameters
+    ----------
+    data : np.ndarray
+        Data from which to compute the structure functions.
+    labels : np.ndarray
+        Integer array of the shape of the data giving the region of each pixel. Each non-negative label is a region,
+        and the pixels of negative label belong to none.
+    order : int
+        Order of the structure functions to compute.
+    cross_regions : bool, default=False
+        Whether to also compute the structure function of the pairs whose pixels belong to two different regions.
+    min_lag, max_lag, bin_width, bins_per_decade, bin_edges
+        Lag range and binning, as in structure_function.
+    progress, cancel_flag
+        Progress callback and cancellation flag, as in structure_function.
+    max_memory_bytes : int, default=2 << 30
+        Number of bytes that the tables of the regions may use, or 0 for no budget. Each thread keeps its own tables,
+        whose size grows with the number of bins and with the number of regions, or with its square if cross_regions
+        is True, so fewer threads are used if they would not fit, and a ValueError is raised if a single one would not.
+
+    Returns
+    -------
+    dict[tuple[int, int], np.ndarray]
+        Structure function of each region, with the key (label, label), and of each couple of regions (a, b) with
+        a < b if cross_regions is True. Each one is a two-dimensional array whose rows are the lag, the structure
+        function and its uncertainty. Every structure function has the same rows, sorted according to the lag value,
+        and the structure function of a lag that a region does not reach is NaN.
+    """
+    binning = dict(bin_width=bin_width, bins_per_decade=bins_per_decade, bin_edges=bin_edges or [])
+    table_labels, structures = str_func_regions_cpp(
+        data, labels, order, cross_regions=cross_regions, min_lag=min_lag, max_lag=max_lag, **binning,
+        progress=progress, cancel_flag=cancel_flag, max_memory_bytes=max_memory_bytes,
+    )
+    return {(int(a), int(b)): structure for (a, b), structure in zip(table_labels, structures)}
+
+def structure_function_sampled(
+    data: np.ndarray,
+    order: int,
+    max_draws: int=1_000_000,
+    target_relative_error: float=0,
+    min_pairs_per_bin: int=10,
+    seed: int=0,
+    min_lag: float=0,
+    max_lag: float=np.inf,
+    bin_width: float=0,
+    bins_per_decade: int=0,
+    bin_edges: list[float] | None=None,
+) -> np.ndarray:
+    """
+    Estimates the structure function of a 2D array from randomly drawn pairs of pixels. This bounds the computation
+    time of large arrays, and the uncertainty of each bin is the standard error of its sampled pairs.
+
+    Parameters
+    ----------
+    data : np.ndarray
+        Data from which to estimate the structure function.
+    order : int
+        Order of the structure function to estimate.
+    max_draws : int, default=1_000_000
+        Largest number of pairs to draw, including the ones that fall outside of the data or of the lag range.
+    target_relative_error : float, default=0
+        Relative standard error at which to stop drawing pairs once every reached bin has min_pairs_per_bin pairs. By
+        default, max_draws pairs are always drawn.
+    min_pairs_per_bin : int, default=10
+        Number of pairs that every reached bin must have before the sampling can stop early.
+    seed : int, default=0
+        Seed of the random generators. The result only depends on the seed and on the number of threads.
+    min_lag, max_lag, bin_width, bins_per_decade, bin_edges
+        Lag range and binning, as in structure_function. Binning the lags is recommended, since each exact lag
+        otherwise needs its own min_pairs_per_bin pairs.
+
+    Returns
+    -------
+    np.ndarray
+        Two-dimensional array whose rows are the lag, the estimated structure function and its uncertainty. The
+        returned array is sorted according to the lag value.
+    """
+    binning = dict(bin_width=bin_width, bins_per_decade=bins_per_decade, bin_edges=bin_edges or [])
+    return str_func_sampled_cpp(
+        data, order, max_draws=max_draws, target_relative_error=target_relative_error,
+        min_pairs_per_bin=min_pairs_per_bin, seed=seed, min_lag=min_lag, max_lag=max_lag, **binning
+    )
+
+def structure_function_resampled(
+    data: np.ndarray,
+    order: int,
+    method: str="jackknife",
+    block_size: int=32,
+    number_of_replicates: int=1000,
+    seed: int=0,
+    min_lag: float=0,
+    max_lag: float=np.inf,
+    bin_width: float=0,
+    bins_per_decade: int=0,
+    bin_edges: list[float] | None=None,
+    max_memory_bytes: int=2 << 30,
+    fit_bounds: tuple[float, float] | None=None,
+) -> tuple[np.ndarray, np.ndarray] | tuple[np.ndarray, np.ndarray, np.ndarray, np.ndarray]:
+    """
+    Computes the structure function of a 2D array along with its spatial block jackknife or bootstrap replicates, all
+    from a single pass over the pairs of pixels. Contrary to the uncertainty of structure_function, which treats the
+    pairs as independent, the spread of the replicates accounts for the pairs sharing their pixels.
+
+    Parameters
+    ----------
+    data : np.ndarray
+        Data from which to compute the structure function.
+    order : int
+        Order of the structure function to compute.
+    method : str, default="jackknife"
+        Either "jackknife", whose replicates each leave out one block, or "bootstrap", whose replicates draw as many
+        blocks as there are with replacement.
+    block_size : int, default=32
+        Size in pixels of the square blocks that are resampled. It should exceed the correlation length of the data.
+    number_of_replicates : int, default=1000
+        Number of bootstrap replicates. The jackknife has one replicate per block that contains valid pixels.
+    seed : int, default=0
+        Seed of the bootstrap draws.
+    min_lag, max_lag, bin_width, bins_per_decade, bin_edges
+        Lag range and binning, as in structure_function. The memory of the jackknife scales with the number of blocks
+        times the number of bins, and that of the bootstrap with the square of the number of blocks times the number of
+        bins, so the lags should be binned for the bootstrap of large arrays.
+    max_memory_bytes : int, default=2 << 30
+        Memory budget of the tables of the pairs, 2 GiB by default, or 0 for no budget. Fewer threads are used if their
+        tables would not fit, and a ValueError is raised if a single one would not.
+    fit_bounds : tuple[float, float], optional
+        Lag interval in which to fit the power law b * x**m to every replicate, as in fit_power_laws. If given, the
+        slopes and the amplitudes of the replicates are also returned.
+
+    Returns
+    -------
+    tuple[np.ndarray, np.ndarray] | tuple[np.ndarray, np.ndarray, np.ndarray, np.ndarray]
+        Two-dimensional array whose rows are the lag, the structure function and its resampling uncertainty, sorted
+        according to the lag value, and the (n_replicates, n_lags) array of the structure functions of the replicates.
+        With fit_bounds, the slope m and the amplitude b of each replicate follow, whose distribution gives the
+        uncertainty of the slope.
+    """
+    binning = dict(bin_width=bin_width, bins_per_decade=bins_per_decade, bin_edges=bin_edges or [])
+    return str_func_resampled_cpp(
+        data, order, method=method, block_size=block_size, number_of_replicates=number_of_replicates, seed=seed,
+        min_lag=min_lag, max_lag=max_lag, **binning, max_memory_bytes=max_memory_bytes, fit_bounds=fit_bounds
+    )
+
+def fit_power_laws(
+    lags: np.ndarray,
+    replicates: np.ndarray,
+    fit_bounds: tuple[float, float],
+) -> tuple[np.ndarray, np.ndarray]:
+    """
+    Fits the power law b * x**m to every replicate of a structure function at once, with a linear fit of the log10 of
+    the data in the given bounds. This is meant for the replicates of structure_function_resampled, which are means of
+    non-negative pair values and are therefore positive. The non-positive values are ignored, which would bias the
+    slope of noisy draws whose values can be negative, such as Gaussian draws with uncertainties comparable to the
+    structure function.
+
+    Parameters
+    ----------
+    lags : np.ndarray
+        Lag of each column of the replicates.
+    replicates : np.ndarray
+        Two-dimensional array whose rows are the structure functions to fit, e.g. the replicates given by
+        structure_function_resampled.
+    fit_bounds : tuple[float, float]
+        x interval in which to execute the fits.
+
+    Returns
+    -------
+    tuple[np.ndarray, np.ndarray]
+        Slope m and amplitude b of each replicate, which are NaN if it has fewer than two positive values in the bounds.
+    """
+    return fit_power_laws_cpp(np.asarray(lags, dtype=float).tolist(), replicates, *fit_bounds)
+
+def autocorrelation(
+    data: np.ndarray,
+    fft: bool=False,
+    min_lag: float=0,
+    max_lag: float=np.inf,
+    bin_width: float=0,
+    bins_per_decade: int=0,
+    bin_edges: list[float] | None=None,
+) -> np.ndarray:
+    """
+    Computes the spatial autocorrelation function of a 2D array, i.e. the mean product of the pairs of pixels of the
+    data minus its mean, normalized by the variance of the data.
+
+    Parameters
+    ----------
+    data : np.ndarray
+        Data from which to compute the autocorrelation function. NaN pixels are ignored.
+    fft : bool, default=False
+        Whether to compute the pair sums with Fourier transforms, which scales as O(N log N) instead of O(N^2) with the
+        number of pixels.
+    min_lag, max_lag, bin_width, bins_per_decade, bin_edges
+        Lag range and binning, as in structure_function.
+
+    Returns
+    -------
+    np.ndarray
+        Two-dimensional array whose rows are the lag, the autocorrelation and its uncertainty. The returned array is
+        sorted according to the lag value and does not contain the zero lag, whose autocorrelation is 1.
     """
-    return np_sort(np.array(str_func_cpp(deepcopy(data), order)))
+    binning = dict(bin_width=bin_width, bins_per_decade=bins_per_decade, bin_edges=bin_edges or [])
+    return autocorrelation_cpp(data, fft, min_lag=min_lag, max_lag=max_lag, **binning)
 
 def get_fitted_structure_function_figure(
     data: np.ndarray,
     fit_bounds: tuple[float, float],
     number_of_iterations: int=10000,
+    replicates: np.ndarray | None=None,
 ) -> gl.SmartFigure:
     """
     Gives the figure of a fitted structure function in the given interval, computing the fit using Monte-Carlo
@@ -46,7 +490,13 @@ def get_fitted_structure_function_figure(
         x interval in which to execute the linear fit. This should exclude the first few points and the points until
         decorrelation, i.e. where the curve is not linear anymore.
     number_of_iterations : int
-        Number of Monte-Carlo iterations to compute the fit uncertainty.
+        Number of Monte-Carlo iterations to compute the fit uncertainty. Each iteration draws the structure function
+        from Gaussians of the given uncertainties and fits b * x**m to it in linear space.
+    replicates : np.ndarray, optional
+        Replicates of the structure function at the lags of the data given by structure_function_resampled. If given,
+        they are fitted instead of the Monte-Carlo draws, with a linear fit of their log10 (see fit_power_laws), so the
+        slope distribution accounts for the spatial correlation of the pairs. The label then reads "Slope (log fit)",
+        as this estimator differs from the Monte-Carlo one.
 
     Returns
     -------
@@ -67,28 +517,36 @@ def get_fitted_structure_function_figure(
     )
 
     # Fit and its uncertainty
-    m = (fit_bounds[0] < data[:,0]) & (data[:, 0] < fit_bounds[1])  # generate the fit mask
-    x_values_fit = data[m, 0]
-    y_values_distributions = np.random.normal(loc=data[m, 1], scale=data[m, 2], size=(number_of_iterations, np.sum(m)))
-    parameters = []
-    for y_values_fit in y_values_distributions:
-        parameters.append(curve_fit(
-            f=lambda x, m, b: b * x**m,
-            xdata=x_values_fit,
-            ydata=y_values_fit,
-            p0=[0.1, 0.1],
-            maxfev=100000
-        )[0])
-
-    parameters = np.array(parameters)
-    m, b = parameters.mean(axis=0)
-    dm, db = parameters.std(axis=0)  # uncertainties on the m and b parameters
+    if replicates is None:
+        m = (fit_bounds[0] < data[:,0]) & (data[:, 0] < fit_bounds[1])  # generate the fit mask
+        x_values_fit = data[m, 0]
+        y_values_distributions = np.random.normal(
+            loc=data[m, 1], scale=data[m, 2], size=(number_of_iterations, np.sum(m))
+        )
+        parameters = []
+        for y_values_fit in y_values_distributions:
+            parameters.append(curve_fit(
+                f=lambda x, m, b: b * x**m,
+                xdata=x_values_fit,
+                ydata=y_values_fit,
+                p0=[0.1, 0.1],
+                maxfev=100000
+            )[0])
+        slopes, amplitudes = np.array(parameters).T
+        label = "Slope"
+    else:
+        # Every replicate is fitted at once in log space
+        slopes, amplitudes = fit_power_laws(data[:, 0], replicates, fit_bounds)
+        label = "Slope (log fit)"
+    valid = np.isfinite(slopes)
+    m, b = slopes[valid].mean(), amplitudes[valid].mean()
+    dm = slopes[valid].std()  # uncertainty on the m parameter
     slope = ufloat(m, dm)
     fit = gl.Curve.from_function(
         lambda x: b * x**m,
         *fit_bounds,
         color="red",
-        label=f"Slope: {slope:.1u}".replace("+/-", " ± "),
+        label=f"{label}: {slope:.1u}".replace("+/-", " ± "),
         line_width=2,
     )
 
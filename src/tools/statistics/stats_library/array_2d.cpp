@@ -0,0 +1,74 @@
+#include <string>
+#include <stdexcept>
+
+#include "array_2d.h"
+
+using namespace std;
+
+/**
+ * \brief Creates an array that owns a new contiguous buffer.
+ * \param height The number of rows of the array.
+ * \param width The number of columns of the array.
+ * \param fill_value The value given to every element.
+ */
+template <typename T>
+BasicArray2D<T>::BasicArray2D(const size_t height, const size_t width, const T fill_value)
+    : height(height), width(width), row_stride(width), column_stride(1),
+      storage(make_shared<vector<T>>(height * width, fill_value)) {
+    data = storage->data();
+}
+
+/**
+ * \brief Creates an array that borrows a contiguous row-major buffer.
+ */
+template <typename T>
+BasicArray2D<T>::BasicArray2D(T* data, const size_t height, const size_t width)
+    : BasicArray2D(data, height, width, width, 1) {}
+
+/**
+ * \brief Creates an array that borrows a strided buffer.
+ * \param data Pointer to the first element of the array.
+ * \param height The number of rows of the array.
+ * \param width The number of columns of the array.
+ * \param row_stride The number of elements between the starts of two consecutive rows.
+ * \param column_stride The number of elements between two consecutive elements of a row.
+ */
+template <typename T>
+BasicArray2D<T>::BasicArray2D(T* data, const size_t height, const size_t width, const ptrdiff_t row_stride,
+                              const ptrdiff_t column_stride)
+    : data(data), height(height), width(width), row_stride(row_stride), column_stride(column_stride) {}
+
+/**
+ * \brief Creates an array that owns a contiguous copy of nested vectors, such as a vector_2d for an Array2D.
+ * \param vals The vector_2d to copy. All its rows must have the same size.
+ */
+template <typename T>
+BasicArray2D<T>::BasicArray2D(const vector<vector<T>>& vals)
+    : BasicArray2D(vals.size(), vals.empty() ? 0 : vals[0].size()) {
+    for (size_t y = 0; y < height; ++y) {
+        if (vals[y].size() != width) {
+            throw invalid_argument("Every row of the array must have the same size, got rows of size "
+                                   + to_string(width) + " and " + to_string(vals[y].size()) + ".");
+        }
+        for (size_t x = 0; x < width; ++x) {
+            (*this)(y, x) = vals[y][x];
+        }
+    }
+}
+
+/**
+ * \brief Copies the array in a vector_2d.
+ */
+template <typename T>
+vector_2d BasicArray2D<T>::to_vector_2d() const {
+    vector_2d vals(height, vector<double>(width));
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            vals[y][x] = (*this)(y, x);
+        }
+    }
+    return vals;
+}
+
+template struct BasicArray2D<double>;
+template struct BasicArray2D<float>;
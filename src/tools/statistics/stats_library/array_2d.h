@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+typedef std::vector<std::vector<double>> vector_2d;
+
+/**
+ * \struct BasicArray2D
+ * \brief Two-dimensional array of values stored in a single buffer and accessed through strides given in number of
+ * elements. The buffer is either owned by the array, in which case its copies share the same buffer, or borrowed from
+ * another object such as a NumPy array, which must then outlive the array. The kernels mostly work on arrays of
+ * doubles, and the pair kernels also accept arrays of floats, whose values are widened to double precision when
+ * they are paired.
+ * \tparam T The type of the values, either double or float.
+ */
+template <typename T>
+struct BasicArray2D
+{
+    T* data = nullptr;
+    size_t height = 0;
+    size_t width = 0;
+    ptrdiff_t row_stride = 0;
+    ptrdiff_t column_stride = 1;
+    std::shared_ptr<std::vector<T>> storage;  // only set if the buffer is owned
+
+    BasicArray2D() = default;
+    BasicArray2D(const size_t height, const size_t width, const T fill_value = 0);
+    BasicArray2D(T* data, const size_t height, const size_t width);
+    BasicArray2D(T* data, const size_t height, const size_t width, const ptrdiff_t row_stride,
+                 const ptrdiff_t column_stride);
+    BasicArray2D(const std::vector<std::vector<T>>& vals);  // a vector_2d for the arrays of doubles
+
+    size_t size() const {return height * width;}
+    bool is_owner() const {return storage != nullptr;}
+    bool is_contiguous() const {return column_stride == 1 && (row_stride == (ptrdiff_t)width || height <= 1);}
+
+    T* row(const size_t y) const {return data + (ptrdiff_t)y * row_stride;}
+    T& operator()(const size_t y, const size_t x) {return row(y)[(ptrdiff_t)x * column_stride];}
+    T operator()(const size_t y, const size_t x) const {return row(y)[(ptrdiff_t)x * column_stride];}
+
+    vector_2d to_vector_2d() const;
+};
+
+typedef BasicArray2D<double> Array2D;
+typedef BasicArray2D<float> FloatArray2D;
@@ -7,8 +7,8 @@ set -e  # Exit immediately if any command fails
 mkdir -p build
 cd build
 
-# Configure with CMake
-cmake ..
+# Configure with CMake, forwarding the options of the script (e.g. -DSTATS_LIBRARY_MPI=ON)
+cmake .. "$@"
 
 # Build
 cmake --build .
@@ -0,0 +1,174 @@
+#include <cmath>
+#include <climits>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include "distributed.h"
+
+using namespace std;
+
+/**
+ * \struct BinTotals
+ * \brief Accumulated pair values and sum of the pair distances of a bin, which are reduced together across the ranks.
+ */
+struct BinTotals
+{
+    MomentAccumulator<> accumulator;
+    double lag_sum = 0;
+};
+
+/**
+ * \brief Merges the bins of a rank in those of another one, as the reduction operation of BinTotals.
+ */
+static void merge_bin_totals(void* input, void* input_output, int* length, MPI_Datatype*) {
+    const BinTotals* bins = static_cast<const BinTotals*>(input);
+    BinTotals* merged_bins = static_cast<BinTotals*>(input_output);
+    for (int bin = 0; bin < *length; ++bin) {
+        merged_bins[bin].accumulator.merge(bins[bin].accumulator);
+        merged_bins[bin].lag_sum += bins[bin].lag_sum;
+    }
+}
+
+/**
+ * \brief Gives the tiles of the pairs of an array cut in blocks of consecutive rows. A block is paired with itself and
+ * with the blocks that follow it whose first row is within the window of its last row.
+ * \param plan The pair geometry of the array, whose window bounds the rows that are paired.
+ * \param block_height The number of rows of each block, the last one having the remaining rows.
+ */
+vector<RowBlockTile> row_block_tiles(const StructureFunctionPlan& plan, const size_t block_height) {
+    if (block_height == 0) {
+        throw invalid_argument("The block height must be positive.");
+    }
+    const size_t number_of_blocks = (plan.height + block_height - 1) / block_height;
+    const size_t max_dy = plan.window.max_offset(plan.height);
+    vector<RowBlockTile> tiles;
+    for (size_t first = 0; first < number_of_blocks; ++first) {
+        const size_t last_row = min((first + 1) * block_height, plan.height) - 1;
+        for (size_t second = first; second < number_of_blocks && second * block_height <= last_row + max_dy; ++second) {
+            tiles.push_back({first, second});
+        }
+    }
+    return tiles;
+}
+
+/**
+ * \brief Calculates the nth order structure function of two-dimensional data with its pairs split across the ranks of
+ * an MPI communicator. The rows of the array are cut in blocks, and the tiles of pairs between two blocks are given to
+ * the ranks in contiguous runs of about the same number of pairs, so that a rank needs few blocks. The root sends each
+ * rank the blocks of its tiles only, the ranks accumulate their tiles with all their OpenMP threads, and the tables of
+ * the bins are merged by a single reduction to the root.
+ * \param plan The pair geometry of the array, along with the range of distances and the bins of the pairs. Every rank
+ * must give the same plan.
+ * \param input_array The input as a two-dimensional array of the shape of the plan. It is only read on the root, i.e.
+ * the rank 0, and the other ranks may give an empty array.
+ * \param order The order of the structure function to compute.
+ * \param block_height The number of rows of each block. Smaller blocks balance the ranks better, while larger blocks
+ * send fewer rows when the window is narrow.
+ * \param communicator The communicator whose ranks share the pairs.
+ * \return On the root, the array of shape (n_lags, 3) whose rows are the lag, the structure function and its
+ * uncertainty, sorted by lag. The other ranks get an empty array.
+ * \note The argument errors are found on every rank before any communication, except for the shape of the array,
+ * which is only checked on the root. A rank that throws should therefore abort the communicator.
+ */
+Array2D distributed_structure_function(const StructureFunctionPlan& plan, const Array2D& input_array, const int order,
+                                       const size_t block_height, MPI_Comm communicator) {
+    int rank, number_of_ranks;
+    MPI_Comm_rank(communicator, &rank);
+    MPI_Comm_size(communicator, &number_of_ranks);
+    const vector<RowBlockTile> tiles = row_block_tiles(plan, block_height);
+    if (block_height * plan.width > INT_MAX) {
+        throw invalid_argument("A block of " + to_string(block_height) + " rows is too large to be sent at once.");
+    }
+    if (rank == 0 && (input_array.height != plan.height || input_array.width != plan.width)) {
+        throw invalid_argument("The array must have the shape of the plan, got (" + to_string(input_array.height) + ", "
+                               + to_string(input_array.width) + ") instead of (" + to_string(plan.height) + ", "
+                               + to_string(plan.width) + ").");
+    }
+
+    // The tiles are given in order, each one to the rank in whose share of the pairs its middle lies
+    const size_t number_of_blocks = (plan.height + block_height - 1) / block_height;
+    auto block_rows = [&](const size_t block) {return min(block_height, plan.height - block * block_height);};
+    vector<double> costs;
+    double total_cost = 0;
+    for (const RowBlockTile& tile : tiles) {
+        const double pairs = (double)block_rows(tile.first_block) * block_rows(tile.second_block);
+        costs.push_back((tile.first_block == tile.second_block) ? pairs / 2 : pairs);
+        total_cost += costs.back();
+    }
+    vector<int> owners(tiles.size());
+    vector<vector<uint8_t>> needed_blocks(number_of_ranks, vector<uint8_t>(number_of_blocks, 0));
+    double cumulative_cost = 0;
+    for (size_t t = 0; t < tiles.size(); ++t) {
+        const double middle = (cumulative_cost + costs[t] / 2) / total_cost;
+        owners[t] = min((int)(middle * number_of_ranks), number_of_ranks - 1);
+        cumulative_cost += costs[t];
+        needed_blocks[owners[t]][tiles[t].first_block] = 1;
+        needed_blocks[owners[t]][tiles[t].second_block] = 1;
+    }
+
+    // The root borrows its blocks from the array and sends a contiguous copy of the others, in the order in which
+    // each rank receives them
+    vector<Array2D> blocks(number_of_blocks);
+    if (rank == 0) {
+        for (size_t block = 0; block < number_of_blocks; ++block) {
+            if (!needed_blocks[0][block]) continue;
+            blocks[block] = Array2D(input_array.row(block * block_height), block_rows(block), plan.width,
+                                    input_array.row_stride, input_array.column_stride);
+        }
+        for (int destination = 1; destination < number_of_ranks; ++destination) {
+            for (size_t block = 0; block < number_of_blocks; ++block) {
+                if (!needed_blocks[destination][block]) continue;
+                Array2D copy(block_rows(block), plan.width);
+                for (size_t y = 0; y < copy.height; ++y) {
+                    for (size_t x = 0; x < copy.width; ++x) {
+                        copy(y, x) = input_array(block * block_height + y, x);
+                    }
+                }
+                MPI_Send(copy.data, (int)copy.size(), MPI_DOUBLE, destination, (int)block, communicator);
+            }
+        }
+    } else {
+        for (size_t block = 0; block < number_of_blocks; ++block) {
+            if (!needed_blocks[rank][block]) continue;
+            blocks[block] = Array2D(block_rows(block), plan.width);
+            MPI_Recv(blocks[block].data, (int)blocks[block].size(), MPI_DOUBLE, 0, (int)block, communicator,
+                     MPI_STATUS_IGNORE);
+        }
+    }
+
+    const bool is_exact = plan.binning.is_exact();
+    vector<BinTotals> bins(plan.number_of_bins);
+    lag_squared_accumulator_table tile_vals;
+    vector<double> tile_lag_sums;
+    for (size_t t = 0; t < tiles.size(); ++t) {
+        if (owners[t] != rank) continue;
+        const RowBlockTile& tile = tiles[t];
+        accumulate_subtracted_block_pairs(plan, blocks[tile.first_block], tile.first_block * block_height,
+                                          blocks[tile.second_block], tile.second_block * block_height, order,
+                                          tile_vals, &tile_lag_sums);
+        for (size_t bin = 0; bin < bins.size(); ++bin) {
+            bins[bin].accumulator.merge(tile_vals[bin]);
+            if (!is_exact) bins[bin].lag_sum += tile_lag_sums[bin];
+        }
+    }
+
+    MPI_Datatype bin_type;
+    MPI_Type_contiguous(sizeof(BinTotals), MPI_BYTE, &bin_type);
+    MPI_Type_commit(&bin_type);
+    MPI_Op merge_operation;
+    MPI_Op_create(merge_bin_totals, 1, &merge_operation);
+    vector<BinTotals> merged_bins(rank == 0 ? bins.size() : 0);
+    MPI_Reduce(bins.data(), merged_bins.data(), (int)bins.size(), bin_type, merge_operation, 0, communicator);
+    MPI_Op_free(&merge_operation);
+    MPI_Type_free(&bin_type);
+    if (rank != 0) return Array2D();
+
+    lag_squared_accumulator_table accumulated_vals(merged_bins.size());
+    vector<double> lag_sums(is_exact ? 0 : merged_bins.size());
+    for (size_t bin = 0; bin < merged_bins.size(); ++bin) {
+        accumulated_vals[bin] = merged_bins[bin].accumulator;
+        if (!is_exact) lag_sums[bin] = merged_bins[bin].lag_sum;
+    }
+    return structure_function_from_table(plan, accumulated_vals, lag_sums);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <mpi.h>
+
+#include "vsf.h"
+
+/**
+ * \struct RowBlockTile
+ * \brief Pairs between two blocks of consecutive rows of an array, the second block being the first one or one of the
+ * blocks that follow it. The tiles of the blocks within the window of each other cover every pair exactly once.
+ */
+struct RowBlockTile
+{
+    size_t first_block;
+    size_t second_block;
+};
+
+std::vector<RowBlockTile> row_block_tiles(const StructureFunctionPlan& plan, const size_t block_height);
+Array2D distributed_structure_function(
+    const StructureFunctionPlan& plan,
+    const Array2D& input_array,
+    const int order,
+    const size_t block_height,
+    MPI_Comm communicator
+);
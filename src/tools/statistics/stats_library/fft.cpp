@@ -0,0 +1,344 @@
+#include <omp.h>
+
+#include "fft.h"
+#include "stats.h"
+
+using namespace std;
+
+/**
+ * \brief Gives the smallest power of two that is larger or equal to the given size.
+ */
+size_t next_power_of_two(const size_t size) {
+    size_t power = 1;
+    while (power < size) {
+        power <<= 1;
+    }
+    return power;
+}
+
+/**
+ * \brief Computes the twiddle factors exp(-2*pi*i*k/size) used by a transform of the given size.
+ */
+static vector<complex_double> get_twiddles(const size_t size) {
+    vector<complex_double> twiddles(size / 2);
+    for (size_t k = 0; k < size / 2; ++k) {
+        double angle = -2 * M_PI * k / size;
+        twiddles[k] = {cos(angle), sin(angle)};
+    }
+    return twiddles;
+}
+
+/**
+ * \brief Computes in place the discrete Fourier transform of contiguous values using the iterative radix-2 Cooley-Tukey
+ * algorithm.
+ * \param vals Pointer to the first value to transform.
+ * \param size The number of values to transform, which must be a power of two.
+ * \param twiddles The twiddle factors of a transform of the given size.
+ * \param inverse Whether to compute the inverse transform. The inverse transform is not normalized.
+ */
+static void fft_in_place(complex_double* vals, const size_t size, const vector<complex_double>& twiddles,
+                         const bool inverse) {
+    // Reorder the values with the bit-reversal permutation
+    for (size_t i = 1, j = 0; i < size; ++i) {
+        size_t bit = size >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) swap(vals[i], vals[j]);
+    }
+
+    for (size_t length = 2; length <= size; length <<= 1) {
+        const size_t half_length = length / 2;
+        const size_t twiddle_step = size / length;
+        for (size_t i = 0; i < size; i += length) {
+            for (size_t k = 0; k < half_length; ++k) {
+                const complex_double& w = twiddles[k * twiddle_step];
+                const double w_imag = inverse ? -w.imag() : w.imag();
+                const complex_double& b = vals[i + k + half_length];
+                // The product is written explicitly to avoid the slow complex multiplication that checks for infinities
+                complex_double v(b.real() * w.real() - b.imag() * w_imag, b.real() * w_imag + b.imag() * w.real());
+                complex_double u = vals[i + k];
+                vals[i + k] = u + v;
+                vals[i + k + half_length] = u - v;
+            }
+        }
+    }
+}
+
+/**
+ * \brief Computes in place the discrete Fourier transform of a vector.
+ * \param vals The vector to transform. Its size must be a power of two.
+ * \param inverse Whether to compute the inverse transform. The inverse transform is normalized by the size of the
+ * vector so that applying both transforms gives back the original vector.
+ */
+void fft(vector<complex_double>& vals, const bool inverse) {
+    fft_in_place(vals.data(), vals.size(), get_twiddles(vals.size()), inverse);
+    if (inverse) {
+        for (auto& val : vals) {
+            val /= (double)vals.size();
+        }
+    }
+}
+
+/**
+ * \brief Computes in place the two-dimensional discrete Fourier transform of a row-major grid.
+ * \param vals The grid to transform, stored row by row.
+ * \param height The number of rows of the grid, which must be a power of two.
+ * \param width The number of columns of the grid, which must be a power of two.
+ * \param inverse Whether to compute the inverse transform. The inverse transform is normalized by the size of the grid.
+ */
+void fft_2d(vector<complex_double>& vals, const size_t height, const size_t width, const bool inverse) {
+    const vector<complex_double> row_twiddles = get_twiddles(width);
+    const vector<complex_double> column_twiddles = get_twiddles(height);
+    const double normalization = inverse ? 1.0 / (height * width) : 1.0;
+
+    #pragma omp parallel
+    {
+        #pragma omp for schedule(static)
+        for (size_t y = 0; y < height; ++y) {
+            fft_in_place(&vals[y * width], width, row_twiddles, inverse);
+        }
+
+        // The columns are copied in a contiguous buffer to avoid strided accesses during the transform
+        vector<complex_double> column(height);
+        #pragma omp for schedule(static)
+        for (size_t x = 0; x < width; ++x) {
+            for (size_t y = 0; y < height; ++y) {
+                column[y] = vals[y * width + x];
+            }
+            fft_in_place(column.data(), height, column_twiddles, inverse);
+            for (size_t y = 0; y < height; ++y) {
+                vals[y * width + x] = column[y] * normalization;
+            }
+        }
+    }
+}
+
+/**
+ * \brief Computes the Fourier transform of a function of the valid values of an array, zero-padded to the given
+ * shape. NaN values are replaced by zeros.
+ * \param input_array The array to transform.
+ * \param padded_height The number of rows of the padded grid.
+ * \param padded_width The number of columns of the padded grid.
+ * \param function Callable of a double that returns the value to transform.
+ */
+template <typename T>
+static vector<complex_double> padded_transform(const Array2D& input_array, const size_t padded_height,
+                                               const size_t padded_width, const T& function) {
+    vector<complex_double> transform(padded_height * padded_width);
+    for (size_t y = 0; y < input_array.height; ++y) {
+        for (size_t x = 0; x < input_array.width; ++x) {
+            double val = input_array(y, x);
+            if (!isnan(val)) transform[y * padded_width + x] = function(val);
+        }
+    }
+    fft_2d(transform, padded_height, padded_width, false);
+    return transform;
+}
+
+/**
+ * \brief Computes the cross-correlation C(r) = sum_x a(x) * b(x + r) of two real grids from their Fourier transforms.
+ * \param a_transform The Fourier transform of the first grid.
+ * \param b_transform The Fourier transform of the second grid.
+ * \param padded_height The number of rows of the transformed grids.
+ * \param padded_width The number of columns of the transformed grids.
+ * \return The row-major cross-correlation grid, where the offset r = (dy, dx) is stored at (dy mod padded_height,
+ * dx mod padded_width).
+ */
+static vector<double> correlate(const vector<complex_double>& a_transform, const vector<complex_double>& b_transform,
+                                const size_t padded_height, const size_t padded_width) {
+    vector<complex_double> product(a_transform.size());
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < product.size(); ++i) {
+        const complex_double& a = a_transform[i];
+        const complex_double& b = b_transform[i];
+        product[i] = {a.real() * b.real() + a.imag() * b.imag(), a.real() * b.imag() - a.imag() * b.real()};
+    }
+    fft_2d(product, padded_height, padded_width, true);
+
+    vector<double> correlation(product.size());
+    for (size_t i = 0; i < product.size(); ++i) {
+        correlation[i] = product[i].real();
+    }
+    return correlation;
+}
+
+/**
+ * \brief Calls a function for every offset r that separates two points of an array, each pair being considered once.
+ * This is the half-plane dy > 0 or dy = 0 and dx >= 0, so the zero lag of each point with itself is included as in
+ * apply_vector_map.
+ * \param correlation The cross-correlation grid, as given by the correlate function.
+ * \param height The number of rows of the original array.
+ * \param width The number of columns of the original array.
+ * \param padded_height The number of rows of the correlation grid.
+ * \param padded_width The number of columns of the correlation grid.
+ * \param function Callable of the squared lag, of the offset (dy, dx) and of the correlation at r and at -r.
+ */
+template <typename T>
+static void for_each_half_plane_lag(const vector<double>& correlation, const size_t height, const size_t width,
+                                    const size_t padded_height, const size_t padded_width, const T& function) {
+    const long signed_width = width;
+    const long signed_padded_width = padded_width;
+    for (size_t dy = 0; dy < height; ++dy) {
+        for (long dx = (dy == 0) ? 0 : 1 - signed_width; dx < signed_width; ++dx) {
+            size_t positive_index = dy * padded_width + (signed_padded_width + dx) % signed_padded_width;
+            size_t negative_index = ((padded_height - dy) % padded_height) * padded_width
+                                  + (signed_padded_width - dx) % signed_padded_width;
+            size_t lag_squared = dy * dy + dx * dx;
+            function(lag_squared, (long)dy, dx, correlation[positive_index], correlation[negative_index]);
+        }
+    }
+}
+
+/**
+ * \struct PowerSums
+ * \brief Sums of the pair values of a squared distance, as they are obtained from the cross-correlations.
+ */
+struct PowerSums
+{
+    size_t count = 0;
+    double sum = 0;
+    double sum_of_squares = 0;
+};
+
+/**
+ * \brief Converts the sums of each squared distance to moment accumulators. The squared distances that are never
+ * reached are left empty, as they would otherwise keep the rounding errors of the transforms.
+ */
+static void to_accumulators(const vector<PowerSums>& summed_vals, lag_squared_accumulator_table& accumulated_vals) {
+    accumulated_vals.resize(summed_vals.size());
+    for (size_t lag_squared = 0; lag_squared < summed_vals.size(); ++lag_squared) {
+        const PowerSums& sums = summed_vals[lag_squared];
+        accumulated_vals[lag_squared] = MomentAccumulator<>::from_power_sums(sums.count, sums.sum, sums.sum_of_squares);
+    }
+}
+
+/**
+ * \brief Computes the sums of the squared differences of the pairs of elements of an array, and of their squares, using
+ * Fourier transforms. The sums of each offset are obtained from cross-correlations of the data, of its powers and of
+ * its validity mask, so the cost is O(N log N) instead of O(N^2).
+ * \param input_array The array for which to sum the pairs. NaN values are ignored.
+ * \param table_size The number of sums to compute.
+ * \param index_of Callable of the squared lag and of the offset (dy, dx) of the half-plane that gives the index of the
+ * sums in which the pairs of the offset are added.
+ */
+template <typename I>
+static vector<PowerSums> subtracted_power_sums(const Array2D& input_array, const size_t table_size,
+                                               const I& index_of) {
+    const size_t height = input_array.height;
+    const size_t width = input_array.width;
+    const size_t padded_height = next_power_of_two(2 * height - 1);
+    const size_t padded_width = next_power_of_two(2 * width - 1);
+    vector<PowerSums> summed_vals(table_size);
+
+    // The differences do not depend on an offset of the data, so the mean is removed to limit the cancellation errors
+    const double mean_val = mean(input_array);
+    const double offset = isnan(mean_val) ? 0 : mean_val;
+
+    auto mask = padded_transform(input_array, padded_height, padded_width, [](double) {return 1.0;});
+    auto data = padded_transform(input_array, padded_height, padded_width,
+                                 [offset](double val) {return val - offset;});
+    auto data_2 = padded_transform(input_array, padded_height, padded_width,
+                                   [offset](double val) {return pow(val - offset, 2);});
+    auto data_3 = padded_transform(input_array, padded_height, padded_width,
+                                   [offset](double val) {return pow(val - offset, 3);});
+    auto data_4 = padded_transform(input_array, padded_height, padded_width,
+                                   [offset](double val) {return pow(val - offset, 4);});
+
+    // With a = f(x) and b = f(x + r), the sums of (b - a)^2 and (b - a)^4 over the valid pairs expand in sums of
+    // a^n b^m
+    auto accumulate = [&](const vector<complex_double>& a_transform, const vector<complex_double>& b_transform,
+                          const auto& function) {
+        vector<double> correlation = correlate(a_transform, b_transform, padded_height, padded_width);
+        for_each_half_plane_lag(correlation, height, width, padded_height, padded_width,
+                                [&](size_t lag_squared, long dy, long dx, double positive, double negative) {
+                                    function(summed_vals[index_of(lag_squared, dy, dx)], positive, negative);
+                                });
+    };
+    accumulate(mask, mask, [](PowerSums& acc, double positive, double) {
+        acc.count += llround(positive);
+    });
+    accumulate(mask, data_2, [](PowerSums& acc, double positive, double negative) {
+        acc.sum += positive + negative;
+    });
+    accumulate(data, data, [](PowerSums& acc, double positive, double) {
+        acc.sum -= 2 * positive;
+    });
+    accumulate(mask, data_4, [](PowerSums& acc, double positive, double negative) {
+        acc.sum_of_squares += positive + negative;
+    });
+    accumulate(data, data_3, [](PowerSums& acc, double positive, double negative) {
+        acc.sum_of_squares -= 4 * (positive + negative);
+    });
+    accumulate(data_2, data_2, [](PowerSums& acc, double positive, double) {
+        acc.sum_of_squares += 6 * positive;
+    });
+    return summed_vals;
+}
+
+
+/**
+ * \brief Accumulates the squared difference between each pair of elements in the input array according to their
+ * squared distances, using Fourier transforms. The results are the same as accumulate_subtracted_pairs with order=2,
+ * up to floating-point rounding.
+ * \param input_array The array for which to accumulate the pairs. NaN values are ignored.
+ * \param accumulated_vals The table indexed by squared distance in which to accumulate the values. It is resized to
+ * fit every possible squared distance of the input_array.
+ */
+void accumulate_subtracted_pairs_fft(const Array2D& input_array, lag_squared_accumulator_table& accumulated_vals) {
+    vector<PowerSums> summed_vals = subtracted_power_sums(
+        input_array, max_lag_squared(input_array.height, input_array.width) + 1,
+        [](size_t lag_squared, long, long) {return lag_squared;}
+    );
+    to_accumulators(summed_vals, accumulated_vals);
+}
+
+/**
+ * \brief Accumulates the squared difference between each pair of elements in the input array according to the offset
+ * (dy, dx) between the two points, using Fourier transforms. The results are the same as
+ * accumulate_subtracted_offsets with order=2, up to floating-point rounding.
+ * \param input_array The array for which to accumulate the pairs. NaN values are ignored.
+ * \param accumulated_vals The table in which to accumulate the values, indexed by half_plane_offset_index. It is
+ * resized to fit every offset of the half-plane dy >= 0 of the input_array.
+ */
+void accumulate_subtracted_offsets_fft(const Array2D& input_array, lag_squared_accumulator_table& accumulated_vals) {
+    const size_t width = input_array.width;
+    vector<PowerSums> summed_vals = subtracted_power_sums(
+        input_array, input_array.height * (2 * width - 1),
+        [width](size_t, long dy, long dx) {return half_plane_offset_index(dy, dx, width);}
+    );
+    to_accumulators(summed_vals, accumulated_vals);
+}
+
+/**
+ * \brief Accumulates the product between each pair of elements in the input array according to their squared
+ * distances, using Fourier transforms. The results are the same as accumulating the values of multiply_pairs, up to
+ * floating-point rounding.
+ * \param input_array The array for which to accumulate the pairs. NaN values are ignored.
+ * \param accumulated_vals The table indexed by squared distance in which to accumulate the values. It is resized to
+ * fit every possible squared distance of the input_array.
+ */
+void accumulate_multiplied_pairs_fft(const Array2D& input_array, lag_squared_accumulator_table& accumulated_vals) {
+    const size_t height = input_array.height;
+    const size_t width = input_array.width;
+    const size_t padded_height = next_power_of_two(2 * height - 1);
+    const size_t padded_width = next_power_of_two(2 * width - 1);
+    vector<PowerSums> summed_vals(max_lag_squared(height, width) + 1);
+
+    auto mask = padded_transform(input_array, padded_height, padded_width, [](double) {return 1.0;});
+    auto data = padded_transform(input_array, padded_height, padded_width, [](double val) {return val;});
+    auto data_2 = padded_transform(input_array, padded_height, padded_width, [](double val) {return val * val;});
+
+    auto accumulate = [&](const vector<complex_double>& transform, const auto& function) {
+        vector<double> correlation = correlate(transform, transform, padded_height, padded_width);
+        for_each_half_plane_lag(correlation, height, width, padded_height, padded_width,
+                                [&](size_t lag_squared, long, long, double positive, double) {
+                                    function(summed_vals[lag_squared], positive);
+                                });
+    };
+    accumulate(mask, [](PowerSums& acc, double positive) {acc.count += llround(positive);});
+    accumulate(data, [](PowerSums& acc, double positive) {acc.sum += positive;});
+    accumulate(data_2, [](PowerSums& acc, double positive) {acc.sum_of_squares += positive;});
+    to_accumulators(summed_vals, accumulated_vals);
+}
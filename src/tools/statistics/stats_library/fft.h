@@ -0,0 +1,15 @@
+#pragma once
+
+#include <complex>
+
+#include "tools.h"
+
+typedef std::complex<double> complex_double;
+
+size_t next_power_of_two(const size_t size);
+void fft(std::vector<complex_double>& vals, const bool inverse);
+void fft_2d(std::vector<complex_double>& vals, const size_t height, const size_t width, const bool inverse);
+
+void accumulate_subtracted_pairs_fft(const Array2D& input_array, lag_squared_accumulator_table& accumulated_vals);
+void accumulate_subtracted_offsets_fft(const Array2D& input_array, lag_squared_accumulator_table& accumulated_vals);
+void accumulate_multiplied_pairs_fft(const Array2D& input_array, lag_squared_accumulator_table& accumulated_vals);
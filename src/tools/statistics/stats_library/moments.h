@@ -0,0 +1,122 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+
+/**
+ * \struct MomentAccumulator
+ * \brief Running moments of a set of values, updated one value at a time with the recurrences of Welford and
+ * Terriberry. Two accumulators can be merged with the pairwise formulas of Chan and Pébay, so each thread can keep its
+ * own. This gives the mean and its uncertainty in a single pass, without storing the values and without the
+ * cancellation errors of the raw sums of powers.
+ * \tparam max_order The highest central moment that is tracked, between 2 and 4. The sum of (x - mean)^k is stored in
+ * central_sums[k - 2].
+ */
+template <int max_order = 2>
+struct MomentAccumulator
+{
+    static_assert(max_order >= 2 && max_order <= 4, "MomentAccumulator tracks the central moments 2 to 4.");
+
+    size_t count = 0;
+    double mean = 0;
+    std::array<double, max_order - 1> central_sums = {};
+
+    /**
+     * \brief Gives the accumulator of a set of values from its number of values, sum and sum of squares, for the
+     * methods that only obtain these sums (e.g. from Fourier transforms).
+     */
+    static MomentAccumulator from_power_sums(size_t count, double sum, double sum_of_squares)
+    {
+        MomentAccumulator accumulator;
+        if (count == 0) return accumulator;
+        accumulator.count = count;
+        accumulator.mean = sum / count;
+        accumulator.central_sums[0] = std::fmax(sum_of_squares - sum * accumulator.mean, 0.0);
+        return accumulator;
+    }
+
+    void add(double val)
+    {
+        double previous_count = count++;
+        double delta = val - mean;
+        double delta_n = delta / count;
+        double term = delta * delta_n * previous_count;
+        mean += delta_n;
+        if constexpr (max_order >= 4) {
+            central_sums[2] += term * delta_n * delta_n * ((double)count * count - 3.0 * count + 3)
+                             + 6 * delta_n * delta_n * central_sums[0] - 4 * delta_n * central_sums[1];
+        }
+        if constexpr (max_order >= 3) {
+            central_sums[1] += term * delta_n * (count - 2.0) - 3 * delta_n * central_sums[0];
+        }
+        central_sums[0] += term;
+    }
+
+    void merge(const MomentAccumulator& other)
+    {
+        if (other.count == 0) return;
+        if (count == 0) {
+            *this = other;
+            return;
+        }
+        double n_a = count;
+        double n_b = other.count;
+        double n = n_a + n_b;
+        double delta = other.mean - mean;
+        double delta_n = delta / n;
+        const auto& a = central_sums;
+        const auto& b = other.central_sums;
+        if constexpr (max_order >= 4) {
+            central_sums[2] += b[2]
+                             + delta * delta_n * delta_n * delta_n * n_a * n_b * (n_a * n_a - n_a * n_b + n_b * n_b)
+                             + 6 * delta_n * delta_n * (n_a * n_a * b[0] + n_b * n_b * a[0])
+                             + 4 * delta_n * (n_a * b[1] - n_b * a[1]);
+        }
+        if constexpr (max_order >= 3) {
+            central_sums[1] += b[1] + delta * delta_n * delta_n * n_a * n_b * (n_a - n_b)
+                             + 3 * delta_n * (n_a * b[0] - n_b * a[0]);
+        }
+        central_sums[0] += b[0] + delta * delta_n * n_a * n_b;
+        mean += delta_n * n_b;
+        count += other.count;
+    }
+
+    /**
+     * \brief Removes a subset of the values, given by its own accumulator, which inverts merge. The rounding errors of
+     * the removals add up, so the sum of squares is kept non-negative.
+     */
+    void remove(const MomentAccumulator& other)
+    {
+        static_assert(max_order == 2, "Only the second central moment can be removed.");
+        if (other.count == 0) return;
+        if (other.count >= count) {
+            *this = MomentAccumulator();
+            return;
+        }
+        double n = count;
+        double n_b = other.count;
+        double n_a = n - n_b;
+        double mean_a = (n * mean - n_b * other.mean) / n_a;
+        double delta = other.mean - mean_a;
+        central_sums[0] = std::fmax(central_sums[0] - other.central_sums[0] - delta * delta * n_a * n_b / n, 0.0);
+        mean = mean_a;
+        count -= other.count;
+    }
+
+    double variance() const {return central_sums[0] / count;}
+    double standard_deviation() const {return std::sqrt(variance());}
+    double standard_error() const {return standard_deviation() / std::sqrt(count - 1.0);}  // sample standard error
+
+    double skewness() const
+    {
+        static_assert(max_order >= 3, "The skewness requires max_order >= 3.");
+        return std::sqrt((double)count) * central_sums[1] / std::pow(central_sums[0], 1.5);
+    }
+
+    double kurtosis() const
+    {
+        static_assert(max_order >= 4, "The kurtosis requires max_order >= 4.");
+        return count * central_sums[2] / (central_sums[0] * central_sums[0]);
+    }
+};
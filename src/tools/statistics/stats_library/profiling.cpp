@@ -0,0 +1,171 @@
+#include <omp.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+
+#include "profiling.h"
+
+using namespace std;
+
+/**
+ * \brief Gives the ratio of the largest busy time of the threads to their mean, which is 1 when the pair tiles were
+ * evenly shared, or 0 if no thread was timed.
+ */
+double ProfileReport::imbalance() const {
+    const double total = accumulate(thread_seconds.begin(), thread_seconds.end(), 0.0);
+    if (total <= 0) return 0;
+    return *max_element(thread_seconds.begin(), thread_seconds.end()) * thread_seconds.size() / total;
+}
+
+/**
+ * \brief Tells whether the instrumentation was compiled in.
+ */
+bool profiling_is_enabled() {
+#ifdef STATS_LIBRARY_PROFILING
+    return true;
+#else
+    return false;
+#endif
+}
+
+#ifdef STATS_LIBRARY_PROFILING
+
+// The busy time of the threads of higher OpenMP number is not measured
+static constexpr size_t MAX_PROFILED_THREADS = 1024;
+
+/**
+ * \struct Profiler
+ * \brief Measures of the current session. The counters are updated by every thread, and the phases under the lock.
+ * Each thread adds its busy time to the slot of its OpenMP thread number, which the threads of the same number of
+ * concurrent computations (e.g. the asynchronous ones) share, so the slots are atomic.
+ */
+struct Profiler
+{
+    atomic<bool> is_active{false};
+    mutex phases_lock;
+    map<string, PhaseProfile> phases;
+    atomic<size_t> pairs{0};
+    atomic<size_t> current_bytes{0};
+    atomic<size_t> peak_bytes{0};
+    array<atomic<double>, MAX_PROFILED_THREADS> thread_seconds;
+    atomic<size_t> number_of_threads{0};  // one more than the highest thread number that was timed
+};
+
+static Profiler profiler;
+
+static double wall_time() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * \brief Gives the CPU time of the calling thread, or of the whole process.
+ */
+static double cpu_time(const bool of_thread) {
+    timespec time;
+    clock_gettime(of_thread ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID, &time);
+    return time.tv_sec + 1e-9 * time.tv_nsec;
+}
+
+ProfileSession::ProfileSession() {
+    if (profiler.is_active.exchange(true)) {
+        throw runtime_error("Only one profile can be taken at a time.");
+    }
+    lock_guard<mutex> guard(profiler.phases_lock);
+    profiler.phases.clear();
+    profiler.pairs = 0;
+    profiler.current_bytes = 0;
+    profiler.peak_bytes = 0;
+    for (atomic<double>& seconds : profiler.thread_seconds) {
+        seconds = 0;
+    }
+    profiler.number_of_threads = min((size_t)omp_get_max_threads(), MAX_PROFILED_THREADS);
+}
+
+ProfileSession::~ProfileSession() {
+    profiler.is_active = false;
+}
+
+ProfileReport ProfileSession::report() const {
+    ProfileReport report;
+    lock_guard<mutex> guard(profiler.phases_lock);
+    report.phases = profiler.phases;
+    report.pairs = profiler.pairs;
+    report.peak_bytes = profiler.peak_bytes;
+    report.thread_seconds.assign(profiler.number_of_threads, 0);
+    for (size_t thread_id = 0; thread_id < report.thread_seconds.size(); ++thread_id) {
+        report.thread_seconds[thread_id] = profiler.thread_seconds[thread_id];
+    }
+    return report;
+}
+
+ProfilePhase::ProfilePhase(const char* name)
+    : name(name), is_active(profiler.is_active), is_in_parallel(omp_in_parallel()) {
+    if (!is_active) return;
+    wall_start = wall_time();
+    cpu_start = cpu_time(is_in_parallel);
+}
+
+ProfilePhase::~ProfilePhase() {
+    if (!is_active) return;
+    const double wall_seconds = wall_time() - wall_start;
+    const double cpu_seconds = cpu_time(is_in_parallel) - cpu_start;
+    lock_guard<mutex> guard(profiler.phases_lock);
+    PhaseProfile& phase = profiler.phases[name];
+    phase.wall_seconds += wall_seconds;
+    phase.cpu_seconds += cpu_seconds;
+    ++phase.calls;
+}
+
+ProfileThreadWork::ProfileThreadWork() : is_active(profiler.is_active) {
+    if (is_active) wall_start = wall_time();
+}
+
+ProfileThreadWork::~ProfileThreadWork() {
+    const size_t thread_id = omp_get_thread_num();
+    if (!is_active || thread_id >= MAX_PROFILED_THREADS) return;
+    const double seconds = wall_time() - wall_start;
+    atomic<double>& thread_seconds = profiler.thread_seconds[thread_id];
+    double previous = thread_seconds;
+    while (!thread_seconds.compare_exchange_weak(previous, previous + seconds)) {}
+    size_t number_of_threads = profiler.number_of_threads;
+    while (thread_id >= number_of_threads
+           && !profiler.number_of_threads.compare_exchange_weak(number_of_threads, thread_id + 1)) {}
+}
+
+ProfileAllocation::ProfileAllocation(const size_t bytes) : bytes(profiler.is_active ? bytes : 0) {
+    if (this->bytes == 0) return;
+    const size_t current_bytes = profiler.current_bytes += this->bytes;
+    size_t peak_bytes = profiler.peak_bytes;
+    while (current_bytes > peak_bytes && !profiler.peak_bytes.compare_exchange_weak(peak_bytes, current_bytes)) {}
+}
+
+ProfileAllocation::~ProfileAllocation() {
+    if (bytes > 0) profiler.current_bytes -= bytes;
+}
+
+bool profile_is_active() {
+    return profiler.is_active;
+}
+
+void profile_add_pairs(const size_t pairs) {
+    profiler.pairs += pairs;
+}
+
+#else
+
+ProfileSession::ProfileSession() {
+    throw runtime_error("The instrumentation is not compiled in, build with -DSTATS_LIBRARY_PROFILING=ON.");
+}
+
+ProfileSession::~ProfileSession() = default;
+
+ProfileReport ProfileSession::report() const {
+    return ProfileReport();
+}
+
+#endif
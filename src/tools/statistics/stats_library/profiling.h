@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+// Instrumentation of the hot paths, which is only compiled in when STATS_LIBRARY_PROFILING is defined (cmake ..
+// -DSTATS_LIBRARY_PROFILING=ON). The PROFILE_* macros expand to nothing otherwise, and their arguments are then never
+// evaluated. The measures are only taken while a ProfileSession exists.
+
+/**
+ * \struct PhaseProfile
+ * \brief Time spent in a phase of a computation. The phases timed outside of the parallel regions give the wall time
+ * of the whole process and its CPU time on every thread, so their ratio is the mean number of busy threads. The phases
+ * timed by each thread inside a parallel region give the sum of the wall and CPU times of the threads. The phases
+ * timed outside of the parallel regions never overlap, while the ones timed inside (combine_vectors and
+ * accumulator_merge) are nested in the pair_enumeration phase of their region.
+ */
+struct PhaseProfile
+{
+    double wall_seconds = 0;
+    double cpu_seconds = 0;
+    size_t calls = 0;
+};
+
+/**
+ * \struct ProfileReport
+ * \brief Measures taken during a ProfileSession: the time spent in each phase, the number of pairs that were
+ * accumulated or materialized, the peak size of the large buffers of the engine (pair vectors, regrouped values and
+ * accumulator tables) that were alive at once, and the time each thread spent on the pair tiles.
+ */
+struct ProfileReport
+{
+    std::map<std::string, PhaseProfile> phases;
+    size_t pairs = 0;
+    size_t peak_bytes = 0;
+    std::vector<double> thread_seconds;
+
+    double imbalance() const;
+};
+
+/**
+ * \struct ProfileSession
+ * \brief Collects the measures of the computations that run while it exists, which start from zero. There can only be
+ * one session at a time, and the computations run by other threads during it are measured as well. Their busy time
+ * is then added to the slots of the threads of the same OpenMP number.
+ */
+struct ProfileSession
+{
+    ProfileSession();
+    ~ProfileSession();
+    ProfileSession(const ProfileSession&) = delete;
+    ProfileSession& operator=(const ProfileSession&) = delete;
+
+    ProfileReport report() const;
+};
+
+bool profiling_is_enabled();
+
+#ifdef STATS_LIBRARY_PROFILING
+
+/**
+ * \struct ProfilePhase
+ * \brief Times the scope in which it is declared and adds it to the phase of the given name.
+ */
+struct ProfilePhase
+{
+    const char* name;
+    bool is_active;
+    bool is_in_parallel;
+    double wall_start;
+    double cpu_start;
+
+    explicit ProfilePhase(const char* name);
+    ~ProfilePhase();
+};
+
+/**
+ * \struct ProfileThreadWork
+ * \brief Times the scope in which it is declared and adds it to the busy time of the calling thread.
+ */
+struct ProfileThreadWork
+{
+    bool is_active;
+    double wall_start;
+
+    ProfileThreadWork();
+    ~ProfileThreadWork();
+};
+
+/**
+ * \struct ProfileAllocation
+ * \brief Counts a buffer of the given size as alive until the end of the scope in which it is declared.
+ */
+struct ProfileAllocation
+{
+    size_t bytes;
+
+    explicit ProfileAllocation(const size_t bytes);
+    ~ProfileAllocation();
+};
+
+bool profile_is_active();
+void profile_add_pairs(const size_t pairs);
+
+#define PROFILE_CONCATENATE_(a, b) a##b
+#define PROFILE_CONCATENATE(a, b) PROFILE_CONCATENATE_(a, b)
+#define PROFILE_PHASE(name) ProfilePhase PROFILE_CONCATENATE(profile_phase_, __LINE__)(name)
+#define PROFILE_THREAD_WORK() ProfileThreadWork PROFILE_CONCATENATE(profile_thread_work_, __LINE__)
+#define PROFILE_ALLOCATION(bytes) ProfileAllocation PROFILE_CONCATENATE(profile_allocation_, __LINE__)(bytes)
+#define PROFILE_PAIRS(pairs) do {if (profile_is_active()) profile_add_pairs(pairs);} while (0)
+
+#else
+
+#define PROFILE_PHASE(name) do {} while (0)
+#define PROFILE_THREAD_WORK() do {} while (0)
+#define PROFILE_ALLOCATION(bytes) do {} while (0)
+#define PROFILE_PAIRS(pairs) do {} while (0)
+
+#endif
@@ -1,21 +1,763 @@
 #include <string>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <cmath>
+#include <cstdint>
+#include <chrono>
+#include <future>
+#include <optional>
 #include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
 #include <pybind11/stl.h>
 #include <pybind11/complex.h>
 #include <pybind11/functional.h>
 #include <pybind11/chrono.h>
 
 #include "vsf.h"
+#include "resampling.h"
+#include "profiling.h"
+#include "run_control.h"
 
 using namespace std;
+namespace py = pybind11;
+
+typedef py::array_t<double, py::array::c_style | py::array::forcecast> numpy_array_2d;
+typedef numpy_array_2d numpy_array_3d;
+typedef py::array_t<float, py::array::c_style> numpy_float_array_2d;  // never cast, so only float32 arrays match it
+typedef numpy_float_array_2d numpy_float_array_3d;
+typedef py::array_t<int64_t, py::array::c_style | py::array::forcecast> numpy_labels;
+typedef numpy_labels numpy_pixels;
+
+/**
+ * \brief Gives an Array2D or a FloatArray2D that borrows the buffer of a two-dimensional NumPy array, without copying
+ * its data.
+ * \note The kernels never modify their input, which allows read-only NumPy arrays to be given.
+ */
+template <typename T, int flags>
+static BasicArray2D<T> borrow_array(const py::array_t<T, flags>& input_array) {
+    if (input_array.ndim() != 2) {
+        throw invalid_argument("The input array must be two-dimensional, got " + to_string(input_array.ndim())
+                               + " dimensions.");
+    }
+    return BasicArray2D<T>(const_cast<T*>(input_array.data()), input_array.shape(0), input_array.shape(1),
+                           input_array.strides(0) / (ptrdiff_t)sizeof(T),
+                           input_array.strides(1) / (ptrdiff_t)sizeof(T));
+}
+
+/**
+ * \brief Gives an Array2D for each slice along the first axis of a three-dimensional NumPy array, each one borrowing
+ * the buffer of the array without copying its data.
+ */
+template <typename T, int flags>
+static vector<BasicArray2D<T>> borrow_slices(const py::array_t<T, flags>& input_cube) {
+    if (input_cube.ndim() != 3) {
+        throw invalid_argument("The input cube must be three-dimensional, got " + to_string(input_cube.ndim())
+                               + " dimensions.");
+    }
+    const ptrdiff_t slice_stride = input_cube.strides(0) / (ptrdiff_t)sizeof(T);
+    vector<BasicArray2D<T>> slices;
+    for (ptrdiff_t slice = 0; slice < input_cube.shape(0); ++slice) {
+        slices.emplace_back(const_cast<T*>(input_cube.data()) + slice * slice_stride, input_cube.shape(1),
+                            input_cube.shape(2), input_cube.strides(1) / (ptrdiff_t)sizeof(T),
+                            input_cube.strides(2) / (ptrdiff_t)sizeof(T));
+    }
+    return slices;
+}
+
+/**
+ * \brief Copies a FloatArray2D in an Array2D, for the kernels that only accept double precision arrays.
+ */
+static Array2D widen_array(const FloatArray2D& input_array) {
+    Array2D output(input_array.height, input_array.width);
+    for (size_t y = 0; y < input_array.height; ++y) {
+        for (size_t x = 0; x < input_array.width; ++x) {
+            output(y, x) = input_array(y, x);
+        }
+    }
+    return output;
+}
+
+/**
+ * \brief Stacks Array2Ds of the same shape in a three-dimensional NumPy array.
+ */
+static py::array_t<double> stack_to_numpy(const vector<Array2D>& arrays, const size_t height, const size_t width) {
+    py::array_t<double> stacked({(ptrdiff_t)arrays.size(), (ptrdiff_t)height, (ptrdiff_t)width});
+    double* stacked_data = stacked.mutable_data();
+    for (const Array2D& array : arrays) {
+        for (size_t y = 0; y < height; ++y) {
+            for (size_t x = 0; x < width; ++x) {
+                *stacked_data++ = array(y, x);
+            }
+        }
+    }
+    return stacked;
+}
+
+/**
+ * \brief Gives the regions of a label image of the same shape as the array whose pairs they regroup.
+ */
+static RegionLabels make_regions(const numpy_labels& label_image, const size_t height, const size_t width,
+                                 const bool cross_regions) {
+    if (label_image.ndim() != 2 || (size_t)label_image.shape(0) != height || (size_t)label_image.shape(1) != width) {
+        throw invalid_argument("The label image must have the shape (" + to_string(height) + ", " + to_string(width)
+                               + ") of the input array.");
+    }
+    vector<int64_t> labels(label_image.data(), label_image.data() + height * width);
+    return RegionLabels(height, width, labels, cross_regions);
+}
+
+/**
+ * \brief Gives the (y, x) coordinates of the rows of a (n_pixels, 2) array of pixels.
+ */
+static vector<array<size_t, 2>> make_pixels(const numpy_pixels& pixels) {
+    if (pixels.ndim() != 2 || pixels.shape(1) != 2) {
+        throw invalid_argument("The pixels must be given as an array of shape (n_pixels, 2).");
+    }
+    vector<array<size_t, 2>> coordinates;
+    const int64_t* pixels_data = pixels.data();
+    for (ptrdiff_t pixel = 0; pixel < pixels.shape(0); ++pixel) {
+        const int64_t y = pixels_data[2 * pixel];
+        const int64_t x = pixels_data[2 * pixel + 1];
+        if (y < 0 || x < 0) {
+            throw invalid_argument("The pixel coordinates must be non-negative, got (" + to_string(y) + ", "
+                                   + to_string(x) + ").");
+        }
+        coordinates.push_back({(size_t)y, (size_t)x});
+    }
+    return coordinates;
+}
+
+/**
+ * \brief Converts the structure functions of the regions to a tuple of the (n_tables, 2) array of the labels of each
+ * structure function and of the (n_tables, n_lags, 3) array of the structure functions.
+ */
+static py::tuple regions_to_numpy(const RegionStructureFunctions& output) {
+    py::array_t<int64_t> labels({(ptrdiff_t)output.labels.size(), (ptrdiff_t)2});
+    int64_t* labels_data = labels.mutable_data();
+    for (const auto& table_labels : output.labels) {
+        *labels_data++ = table_labels[0];
+        *labels_data++ = table_labels[1];
+    }
+    const size_t number_of_lags = output.structures.empty() ? 0 : output.structures[0].height;
+    return py::make_tuple(labels, stack_to_numpy(output.structures, number_of_lags, 3));
+}
+
+/**
+ * \brief Converts an Array2D to a NumPy array. If the Array2D owns its buffer, the NumPy array shares it instead of
+ * copying it.
+ */
+static py::array_t<double> to_numpy(const Array2D& array) {
+    vector<ptrdiff_t> shape = {(ptrdiff_t)array.height, (ptrdiff_t)array.width};
+    vector<ptrdiff_t> strides = {array.row_stride * (ptrdiff_t)sizeof(double),
+                                 array.column_stride * (ptrdiff_t)sizeof(double)};
+    if (!array.is_owner()) {
+        return py::array_t<double>(shape, strides, array.data);  // the data is copied
+    }
+    // The capsule keeps a reference to the storage for as long as the NumPy array lives
+    auto storage = new shared_ptr<vector<double>>(array.storage);
+    py::capsule owner(storage, [](void* pointer) {delete static_cast<shared_ptr<vector<double>>*>(pointer);});
+    return py::array_t<double>(shape, strides, array.data, owner);
+}
+
+/**
+ * \brief Gives the binning specified by the keyword arguments of the bindings, of which at most one may be given.
+ * \param bin_width The width of linear bins, or 0.
+ * \param bins_per_decade The number of logarithmic bins per decade, or 0.
+ * \param bin_edges The edges of the bins, or an empty vector.
+ */
+static LagBinning make_binning(const double bin_width, const int bins_per_decade, const vector<double>& bin_edges) {
+    int number_of_specifications = (bin_width != 0) + (bins_per_decade != 0) + !bin_edges.empty();
+    if (number_of_specifications > 1) {
+        throw invalid_argument("Only one of bin_width, bins_per_decade and bin_edges can be given.");
+    }
+    if (bin_width != 0) return LagBinning::linear(bin_width);
+    if (bins_per_decade != 0) return LagBinning::logarithmic(bins_per_decade);
+    if (!bin_edges.empty()) return LagBinning::from_edges(bin_edges);
+    return LagBinning();
+}
+
+/**
+ * \brief Converts the measures of a profile to a dict of the phases, each one a dict of its wall and CPU times and of
+ * its number of calls, of the number of pairs, of the peak size of the buffers, of the busy time of each thread and of
+ * the imbalance of the threads.
+ */
+static py::dict profile_to_dict(const ProfileReport& report) {
+    py::dict phases;
+    for (const auto& [name, phase] : report.phases) {
+        phases[py::str(name)] = py::dict(py::arg("wall_seconds") = phase.wall_seconds,
+                                         py::arg("cpu_seconds") = phase.cpu_seconds, py::arg("calls") = phase.calls);
+    }
+    return py::dict(py::arg("phases") = phases, py::arg("pairs") = report.pairs,
+                    py::arg("peak_bytes") = report.peak_bytes, py::arg("thread_seconds") = report.thread_seconds,
+                    py::arg("imbalance") = report.imbalance());
+}
+
+/**
+ * \struct CancellationFlag
+ * \brief Flag that cancels the computations it is given to when it is set, e.g. from another Python thread.
+ */
+struct CancellationFlag
+{
+    shared_ptr<atomic<bool>> flag = make_shared<atomic<bool>>(false);
+
+    void cancel() {*flag = true;}
+    bool is_cancelled() const {return *flag;}
+};
+
+/**
+ * \brief Gives the controls of a computation started from the Python thread that holds the GIL. The progress callback
+ * takes the GIL back to check the signals of the interpreter before calling the given one, so Ctrl-C stops the threads
+ * and raises KeyboardInterrupt even without a callback. It must only be used while the GIL is held or released by a
+ * gil_scoped_release of the calling thread.
+ * \param progress Python callable of the number of pair tiles done and of their total number, or None.
+ * \param progress_interval The minimal number of seconds between two calls of the callback.
+ * \param cancel_flag The flag that cancels the computation, or None.
+ * \param max_memory_bytes The memory budget of the computation, or 0 for no budget.
+ */
+static RunControl make_run_control(const optional<py::function>& progress, const double progress_interval,
+                                   const optional<CancellationFlag>& cancel_flag, const size_t max_memory_bytes) {
+    RunControl control;
+    control.progress = [progress](size_t done, size_t total) {
+        py::gil_scoped_acquire acquire;
+        if (PyErr_CheckSignals() != 0) throw py::error_already_set();
+        if (progress.has_value()) (*progress)(done, total);
+    };
+    control.progress_interval = progress_interval;
+    if (cancel_flag.has_value()) control.cancel_flag = cancel_flag->flag;
+    control.max_memory_bytes = max_memory_bytes;
+    return control;
+}
+
+/**
+ * \brief Computes an array without the GIL, and gives it as a NumPy array, or as a tuple of the NumPy array and of
+ * the dict of the profile of the computation if asked.
+ * \param control The controls of the computation, which are installed while it runs.
+ * \param profile Whether to profile the computation, which requires the instrumentation to be compiled in.
+ * \param compute Callable that gives the array.
+ */
+template <typename C>
+static py::object compute_controlled(const RunControl& control, const bool profile, const C& compute) {
+    Array2D output;
+    ProfileReport report;
+    {
+        py::gil_scoped_release release;
+        RunControlScope scope(control);
+        optional<ProfileSession> session;
+        if (profile) session.emplace();
+        output = compute();
+        if (profile) report = session->report();
+    }
+    if (!profile) return to_numpy(output);
+    return py::make_tuple(to_numpy(output), profile_to_dict(report));
+}
+
+/**
+ * \struct StructureFunctionTask
+ * \brief Handle of a structure function computed in a background thread, so the Python threads can keep running (e.g.
+ * to load the next map) while it is computed. The input array is kept alive by the handle and must not be modified
+ * before the computation is done.
+ */
+struct StructureFunctionTask
+{
+    numpy_array_2d input_array;
+    shared_future<Array2D> output;
+    CancellationFlag cancel_flag;
+
+    /**
+     * \brief Asks the computation to stop, after which its result raises StructureFunctionCancelled.
+     */
+    void cancel()
+    {
+        cancel_flag.cancel();
+    }
+
+    bool done() const
+    {
+        return output.wait_for(chrono::seconds(0)) == future_status::ready;
+    }
+
+    /**
+     * \brief Waits for the computation, without holding the GIL, and gives its result. The exceptions of the
+     * computation are raised here.
+     * \param timeout The number of seconds to wait, or None to wait until the computation is done.
+     */
+    py::array_t<double> result(const optional<double> timeout) const
+    {
+        bool is_ready = true;
+        {
+            py::gil_scoped_release release;
+            if (timeout.has_value()) {
+                is_ready = output.wait_for(chrono::duration<double>(*timeout)) == future_status::ready;
+            } else {
+                output.wait();
+            }
+        }
+        if (!is_ready) {
+            PyErr_SetString(PyExc_TimeoutError, "The structure function is not done yet.");
+            throw py::error_already_set();
+        }
+        return to_numpy(output.get());
+    }
+
+    // The computation borrows the input array, so it must end before the handle releases it
+    ~StructureFunctionTask()
+    {
+        if (output.valid() && !done()) {
+            py::gil_scoped_release release;
+            output.wait();
+        }
+    }
+};
 
 PYBIND11_MODULE(stats_library, m) {
     m.doc() = string("Module that regroups the necessary statistic and analysis tools to compute n-th order structure"
                      "functions");
-    m.def("str_func_cpp", &structure_function,
-          "Compute the n-th order structure function of a two-dimensional array.");
+    // The NumPy buffers are read in place and the GIL is released while the kernels run. The outputs are returned as
+    // (n_lags, 3) arrays sorted by lag, (n_lags, 1 + 2 * n_orders) arrays for str_func_multi_cpp, or
+    // (n_slices, n_lags, 3) arrays for str_func_cube_cpp. autocorrelation_cpp also gives (n_lags, 3) arrays,
+    // str_func_2d_cpp gives the (structure, uncertainty, counts) maps of shape (2H - 1, 2W - 1) and
+    // str_func_async_cpp returns a StructureFunctionTask whose result is the output of str_func_cpp and
+    // str_func_regions_cpp gives the (n_tables, 2) labels and the (n_tables, n_lags, 3) arrays of the regions, and
+    // str_func_resampled_cpp gives the (n_lags, 3) array along with the (n_replicates, n_lags) replicates, followed by
+    // the slopes and amplitudes of the power laws fitted to the replicates if fit_bounds=(min_lag, max_lag) is given.
+    // Only the pairs whose distance lies in [min_lag, max_lag] are considered. By default, each exact distance has its
+    // own bin, and at most one of bin_width, bins_per_decade and bin_edges can be given to regroup them.
+    // With profile=True, str_func_cpp gives a tuple of the array and of a dict of the phase times, the number of
+    // pairs, the peak size of the buffers and the busy time of each thread. This raises a RuntimeError unless the
+    // module is built with -DSTATS_LIBRARY_PROFILING=ON.
+    // str_func_cpp calls progress(tiles_done, total_tiles) at most every progress_interval seconds, stops when
+    // cancel_flag is set (raising StructureFunctionCancelled) or on Ctrl-C, and keeps its buffers within
+    // max_memory_bytes, streaming the pairs instead of storing them if needed. The exceptions of progress are raised.
+    m.def("str_func_cpp", [](const numpy_array_2d& input_array, const int order, const bool streaming,
+                             const double min_lag, const double max_lag, const double bin_width,
+                             const int bins_per_decade, const vector<double>& bin_edges, const bool profile,
+                             const optional<py::function>& progress, const double progress_interval,
+                             const optional<CancellationFlag>& cancel_flag, const size_t max_memory_bytes) {
+              Array2D borrowed_array = borrow_array(input_array);
+              LagWindow window(min_lag, max_lag);
+              LagBinning binning = make_binning(bin_width, bins_per_decade, bin_edges);
+              RunControl control = make_run_control(progress, progress_interval, cancel_flag, max_memory_bytes);
+              return compute_controlled(control, profile, [&]() {
+                  return structure_function(borrowed_array, order, streaming, window, binning);
+              });
+          },
+          "Compute the n-th order structure function of a two-dimensional array.",
+          py::arg("input_array"), py::arg("order"), py::arg("streaming") = true, py::arg("min_lag") = 0.0,
+          py::arg("max_lag") = INFINITY, py::arg("bin_width") = 0.0, py::arg("bins_per_decade") = 0,
+          py::arg("bin_edges") = vector<double>(), py::arg("profile") = false, py::arg("progress") = py::none(),
+          py::arg("progress_interval") = 0.5, py::arg("cancel_flag") = py::none(), py::arg("max_memory_bytes") = 0);
+    // The float32 arrays match the overloads below without being cast, so they are paired in single precision storage
+    // with double precision accumulators. The materialized method needs doubles, so their arrays are widened for it.
+    m.def("str_func_cpp", [](const numpy_float_array_2d& input_array, const int order, const bool streaming,
+                             const double min_lag, const double max_lag, const double bin_width,
+                             const int bins_per_decade, const vector<double>& bin_edges, const bool profile,
+                             const optional<py::function>& progress, const double progress_interval,
+                             const optional<CancellationFlag>& cancel_flag, const size_t max_memory_bytes) {
+              FloatArray2D borrowed_array = borrow_array(input_array);
+              LagWindow window(min_lag, max_lag);
+              LagBinning binning = make_binning(bin_width, bins_per_decade, bin_edges);
+              RunControl control = make_run_control(progress, progress_interval, cancel_flag, max_memory_bytes);
+              return compute_controlled(control, profile, [&]() {
+                  if (streaming) {
+                      return structure_function(borrowed_array, order, window, binning);
+                  }
+                  return structure_function(widen_array(borrowed_array), order, false, window, binning);
+              });
+          },
+          "Compute the n-th order structure function of a float32 two-dimensional array.",
+          py::arg("input_array"), py::arg("order"), py::arg("streaming") = true, py::arg("min_lag") = 0.0,
+          py::arg("max_lag") = INFINITY, py::arg("bin_width") = 0.0, py::arg("bins_per_decade") = 0,
+          py::arg("bin_edges") = vector<double>(), py::arg("profile") = false, py::arg("progress") = py::none(),
+          py::arg("progress_interval") = 0.5, py::arg("cancel_flag") = py::none(), py::arg("max_memory_bytes") = 0);
+    m.def("profiling_is_enabled", &profiling_is_enabled,
+          "Tell whether the module was built with the instrumentation that str_func_cpp(..., profile=True) needs.");
+    m.def("str_func_async_cpp", [](const numpy_array_2d& input_array, const int order, const bool streaming,
+                                   const double min_lag, const double max_lag, const double bin_width,
+                                   const int bins_per_decade, const vector<double>& bin_edges,
+                                   const size_t max_memory_bytes) {
+              Array2D borrowed_array = borrow_array(input_array);
+              LagWindow window(min_lag, max_lag);
+              LagBinning binning = make_binning(bin_width, bins_per_decade, bin_edges);
+              auto task = make_unique<StructureFunctionTask>();
+              task->input_array = input_array;
+              RunControl control;
+              control.cancel_flag = task->cancel_flag.flag;
+              control.max_memory_bytes = max_memory_bytes;
+              task->output = async(launch::async, [=]() {
+                  RunControlScope scope(control);
+                  return structure_function(borrowed_array, order, streaming, window, binning);
+              }).share();
+              return task;
+          },
+          "Start computing the n-th order structure function of a two-dimensional array in a background thread.",
+          py::arg("input_array"), py::arg("order"), py::arg("streaming") = true, py::arg("min_lag") = 0.0,
+          py::arg("max_lag") = INFINITY, py::arg("bin_width") = 0.0, py::arg("bins_per_decade") = 0,
+          py::arg("bin_edges") = vector<double>(), py::arg("max_memory_bytes") = 0);
+    m.def("str_func_fft_cpp", [](const numpy_array_2d& input_array, const int order, const double min_lag,
+                                 const double max_lag, const double bin_width, const int bins_per_decade,
+                                 const vector<double>& bin_edges) {
+              Array2D borrowed_array = borrow_array(input_array);
+              LagWindow window(min_lag, max_lag);
+              LagBinning binning = make_binning(bin_width, bins_per_decade, bin_edges);
+              Array2D output;
+              {
+                  py::gil_scoped_release release;
+                  output = structure_function_fft(borrowed_array, order, window, binning);
+              }
+              return to_numpy(output);
+          },
+          "Compute the second order structure function of a two-dimensional array using Fourier transforms.",
+          py::arg("input_array"), py::arg("order") = 2, py::arg("min_lag") = 0.0, py::arg("max_lag") = INFINITY,
+          py::arg("bin_width") = 0.0, py::arg("bins_per_decade") = 0, py::arg("bin_edges") = vector<double>());
+    m.def("str_func_multi_cpp", [](const numpy_array_2d& input_array, const vector<int>& orders, const double min_lag,
+                                   const double max_lag, const double bin_width, const int bins_per_decade,
+                                   const vector<double>& bin_edges) {
+              Array2D borrowed_array = borrow_array(input_array);
+              LagWindow window(min_lag, max_lag);
+              LagBinning binning = make_binning(bin_width, bins_per_decade, bin_edges);
+              Array2D output;
+              {
+                  py::gil_scoped_release release;
+                  output = structure_functions(borrowed_array, orders, window, binning);
+              }
+              return to_numpy(output);
+          },
+          "Compute the structure functions of several orders of a two-dimensional array in a single pass.",
+          py::arg("input_array"), py::arg("orders"), py::arg("min_lag") = 0.0, py::arg("max_lag") = INFINITY,
+          py::arg("bin_width") = 0.0, py::arg("bins_per_decade") = 0, py::arg("bin_edges") = vector<double>());
+    m.def("str_func_cube_cpp", [](const numpy_array_3d& input_cube, const int order, const double min_lag,
+                                  const double max_lag, const double bin_width, const int bins_per_decade,
+                                  const vector<double>& bin_edges) {
+              vector<Array2D> borrowed_slices = borrow_slices(input_cube);
+              LagWindow window(min_lag, max_lag);
+              LagBinning binning = make_binning(bin_width, bins_per_decade, bin_edges);
+              vector<Array2D> outputs;
+              {
+                  py::gil_scoped_release release;
+                  outputs = structure_function_cube(borrowed_slices, order, window, binning);
+              }
+              return stack_to_numpy(outputs, outputs.empty() ? 0 : outputs[0].height, 3);
+          },
+          "Compute the n-th order structure function of every slice along the first axis of a three-dimensional array.",
+          py::arg("input_cube"), py::arg("order"), py::arg("min_lag") = 0.0, py::arg("max_lag") = INFINITY,
+          py::arg("bin_width") = 0.0, py::arg("bins_per_decade") = 0, py::arg("bin_edges") = vector<double>());
+    m.def("str_func_cube_cpp", [](const numpy_float_array_3d& input_cube, const int order, const double min_lag,
+                                  const double max_lag, const double bin_width, const int bins_per_decade,
+                                  const vector<double>& bin_edges) {
+              vector<FloatArray2D> borrowed_slices = borrow_slices(input_cube);
+              LagBinning binning = make_binning(bin_width, bins_per_decade, bin_edges);
+              vector<Array2D> outputs;
+              if (!borrowed_slices.empty()) {
+                  StructureFunctionPlan plan(borrowed_slices[0].height, borrowed_slices[0].width,
+                                             LagWindow(min_lag, max_lag), binning);
+                  py::gil_scoped_release release;
+                  outputs = structure_function_cube(plan, borrowed_slices, order);
+              }
+              return stack_to_numpy(outputs, outputs.empty() ? 0 : outputs[0].height, 3);
+          },
+          "Compute the n-th order structure function of every slice along the first axis of a float32 "
+          "three-dimensional array.",
+          py::arg("input_cube"), py::arg("order"), py::arg("min_lag") = 0.0, py::arg("max_lag") = INFINITY,
+          py::arg("bin_width") = 0.0, py::arg("bins_per_decade") = 0, py::arg("bin_edges") = vector<double>());
+    // str_func_regions_cpp follows progress and cancel_flag as str_func_cpp does, and its tables, whose size grows with
+    // the number of regions, must fit in max_memory_bytes (2 GiB by default), with as many threads as fit.
+    m.def("str_func_regions_cpp", [](const numpy_array_2d& input_array, const numpy_labels& label_image,
+                                     const int order, const bool cross_regions, const double min_lag,
+                                     const double max_lag, const double bin_width, const int bins_per_decade,
+                                     const vector<double>& bin_edges, const optional<py::function>& progress,
+                                     const double progress_interval, const optional<CancellationFlag>& cancel_flag,
+                                     const size_t max_memory_bytes) {
+              Array2D borrowed_array = borrow_array(input_array);
+              RegionLabels regions = make_regions(label_image, borrowed_array.height, borrowed_array.width,
+                                                  cross_regions);
+              StructureFunctionPlan plan(borrowed_array.height, borrowed_array.width, LagWindow(min_lag, max_lag),
+                                         make_binning(bin_width, bins_per_decade, bin_edges));
+              RunControl control = make_run_control(progress, progress_interval, cancel_flag, max_memory_bytes);
+              RegionStructureFunctions output;
+              {
+                  py::gil_scoped_release release;
+                  RunControlScope scope(control);
+                  output = region_structure_functions(plan, borrowed_array, regions, order);
+              }
+              return regions_to_numpy(output);
+          },
+          "Compute the n-th order structure function of every region of a two-dimensional array given by a label "
+          "image, and of every couple of regions if cross_regions is set, in a single pass over the pairs.",
+          py::arg("input_array"), py::arg("label_image"), py::arg("order"), py::arg("cross_regions") = false,
+          py::arg("min_lag") = 0.0, py::arg("max_lag") = INFINITY, py::arg("bin_width") = 0.0,
+          py::arg("bins_per_decade") = 0, py::arg("bin_edges") = vector<double>(), py::arg("progress") = py::none(),
+          py::arg("progress_interval") = 0.5, py::arg("cancel_flag") = py::none(),
+          py::arg("max_memory_bytes") = (size_t)2 << 30);
+    // Without fft, str_func_2d_cpp follows progress, cancel_flag and max_memory_bytes as str_func_cpp does
+    m.def("str_func_2d_cpp", [](const numpy_array_2d& input_array, const int order, const bool fft,
+                                const double min_lag, const double max_lag, const optional<py::function>& progress,
+                                const double progress_interval, const optional<CancellationFlag>& cancel_flag,
+                                const size_t max_memory_bytes) {
+              Array2D borrowed_array = borrow_array(input_array);
+              LagWindow window(min_lag, max_lag);
+              RunControl control = make_run_control(progress, progress_interval, cancel_flag, max_memory_bytes);
+              StructureFunctionMap output;
+              {
+                  py::gil_scoped_release release;
+                  RunControlScope scope(control);
+                  output = structure_function_2d(borrowed_array, order, fft, window);
+              }
+              return py::make_tuple(to_numpy(output.structure), to_numpy(output.uncertainty),
+                                    to_numpy(output.counts));
+          },
+          "Compute the n-th order structure function of a two-dimensional array as a function of the (dy, dx) offset.",
+          py::arg("input_array"), py::arg("order"), py::arg("fft") = false, py::arg("min_lag") = 0.0,
+          py::arg("max_lag") = INFINITY, py::arg("progress") = py::none(), py::arg("progress_interval") = 0.5,
+          py::arg("cancel_flag") = py::none(), py::arg("max_memory_bytes") = 0);
+    m.def("autocorrelation_cpp", [](const numpy_array_2d& input_array, const bool fft, const double min_lag,
+                                    const double max_lag, const double bin_width, const int bins_per_decade,
+                                    const vector<double>& bin_edges) {
+              Array2D borrowed_array = borrow_array(input_array);
+              LagWindow window(min_lag, max_lag);
+              LagBinning binning = make_binning(bin_width, bins_per_decade, bin_edges);
+              Array2D output;
+              {
+                  py::gil_scoped_release release;
+                  output = autocorrelation(borrowed_array, fft, window, binning);
+              }
+              return to_numpy(output);
+          },
+          "Compute the autocorrelation function of a two-dimensional array, normalized by its variance.",
+          py::arg("input_array"), py::arg("fft") = false, py::arg("min_lag") = 0.0, py::arg("max_lag") = INFINITY,
+          py::arg("bin_width") = 0.0, py::arg("bins_per_decade") = 0, py::arg("bin_edges") = vector<double>());
+    m.def("str_func_sampled_cpp", [](const numpy_array_2d& input_array, const int order, const size_t max_draws,
+                                     const double target_relative_error, const size_t min_pairs_per_bin,
+                                     const uint64_t seed, const double min_lag, const double max_lag,
+                                     const double bin_width, const int bins_per_decade,
+                                     const vector<double>& bin_edges) {
+              Array2D borrowed_array = borrow_array(input_array);
+              SamplingOptions options = {max_draws, target_relative_error, min_pairs_per_bin, seed};
+              LagWindow window(min_lag, max_lag);
+              LagBinning binning = make_binning(bin_width, bins_per_decade, bin_edges);
+              Array2D output;
+              {
+                  py::gil_scoped_release release;
+                  output = structure_function_sampled(borrowed_array, order, options, window, binning);
+              }
+              return to_numpy(output);
+          },
+          "Estimate the n-th order structure function of a two-dimensional array from randomly drawn pairs.",
+          py::arg("input_array"), py::arg("order"), py::arg("max_draws") = 1000000,
+          py::arg("target_relative_error") = 0.0, py::arg("min_pairs_per_bin") = 10, py::arg("seed") = 0,
+          py::arg("min_lag") = 0.0, py::arg("max_lag") = INFINITY, py::arg("bin_width") = 0.0,
+          py::arg("bins_per_decade") = 0, py::arg("bin_edges") = vector<double>());
+    m.def("str_func_resampled_cpp", [](const numpy_array_2d& input_array, const int order, const string& method,
+                                       const size_t block_size, const size_t number_of_replicates,
+                                       const uint64_t seed, const double min_lag, const double max_lag,
+                                       const double bin_width, const int bins_per_decade,
+                                       const vector<double>& bin_edges, const size_t max_memory_bytes,
+                                       const optional<array<double, 2>>& fit_bounds) -> py::tuple {
+              if (method != "jackknife" && method != "bootstrap") {
+                  throw invalid_argument("The resampling method must be \"jackknife\" or \"bootstrap\", got \""
+                                         + method + "\".");
+              }
+              Array2D borrowed_array = borrow_array(input_array);
+              ResamplingOptions options = {method == "jackknife" ? ResamplingOptions::Method::jackknife
+                                                                 : ResamplingOptions::Method::bootstrap,
+                                           block_size, number_of_replicates, seed, max_memory_bytes};
+              StructureFunctionPlan plan(borrowed_array.height, borrowed_array.width, LagWindow(min_lag, max_lag),
+                                         make_binning(bin_width, bins_per_decade, bin_edges));
+              ResampledStructureFunction output;
+              PowerLawFits fits;
+              {
+                  py::gil_scoped_release release;
+                  output = resampled_structure_function(plan, borrowed_array, order, options);
+                  if (fit_bounds.has_value()) {
+                      vector<double> lags(output.structure.height);
+                      for (size_t lag = 0; lag < lags.size(); ++lag) lags[lag] = output.structure(lag, 0);
+                      fits = fit_power_laws(lags, output.replicates, (*fit_bounds)[0], (*fit_bounds)[1]);
+                  }
+              }
+              if (!fit_bounds.has_value()) {
+                  return py::make_tuple(to_numpy(output.structure), to_numpy(output.replicates));
+              }
+              return py::make_tuple(to_numpy(output.structure), to_numpy(output.replicates),
+                                    py::array_t<double>(fits.slopes.size(), fits.slopes.data()),
+                                    py::array_t<double>(fits.amplitudes.size(), fits.amplitudes.data()));
+          },
+          "Compute the n-th order structure function of a two-dimensional array along with its spatial block "
+          "jackknife or bootstrap replicates, whose spread gives the uncertainty.",
+          py::arg("input_array"), py::arg("order"), py::arg("method") = "jackknife", py::arg("block_size") = 32,
+          py::arg("number_of_replicates") = 1000, py::arg("seed") = 0, py::arg("min_lag") = 0.0,
+          py::arg("max_lag") = INFINITY, py::arg("bin_width") = 0.0, py::arg("bins_per_decade") = 0,
+          py::arg("bin_edges") = vector<double>(), py::arg("max_memory_bytes") = ResamplingOptions().max_memory_bytes,
+          py::arg("fit_bounds") = py::none());
+    m.def("fit_power_laws_cpp", [](const vector<double>& lags, const numpy_array_2d& replicates, const double min_lag,
+                                   const double max_lag) {
+              Array2D borrowed_replicates = borrow_array(replicates);
+              PowerLawFits fits;
+              {
+                  py::gil_scoped_release release;
+                  fits = fit_power_laws(lags, borrowed_replicates, min_lag, max_lag);
+              }
+              return py::make_tuple(py::array_t<double>(fits.slopes.size(), fits.slopes.data()),
+                                    py::array_t<double>(fits.amplitudes.size(), fits.amplitudes.data()));
+          },
+          "Fit the power law b * r^m to each row of the (n_replicates, n_lags) replicates in log-space over the lags "
+          "in [min_lag, max_lag], and give the slopes and the amplitudes.",
+          py::arg("lags"), py::arg("replicates"), py::arg("min_lag") = 0.0, py::arg("max_lag") = INFINITY);
+
+    py::class_<StructureFunctionTask>(m, "StructureFunctionTask")
+        .def("done", &StructureFunctionTask::done, "Check whether the structure function is computed.")
+        .def("cancel", &StructureFunctionTask::cancel, "Ask the computation of the structure function to stop.")
+        .def("result", &StructureFunctionTask::result,
+             "Wait for the structure function and give it. A TimeoutError is raised if it is not computed after "
+             "timeout seconds.",
+             py::arg("timeout") = py::none());
+
+    py::class_<CancellationFlag>(m, "CancellationFlag")
+        .def(py::init<>())
+        .def("cancel", &CancellationFlag::cancel, "Stop the computations that were given this flag.")
+        .def_property_readonly("is_cancelled", &CancellationFlag::is_cancelled);
+    py::register_exception<RunCancelled>(m, "StructureFunctionCancelled", PyExc_RuntimeError);
+
+    // A plan holds the pair geometry of a shape, window and binning, to be reused on many arrays of that shape
+    py::class_<StructureFunctionPlan>(m, "StructureFunctionPlan")
+        .def(py::init([](const size_t height, const size_t width, const double min_lag, const double max_lag,
+                         const double bin_width, const int bins_per_decade, const vector<double>& bin_edges) {
+                 return StructureFunctionPlan(height, width, LagWindow(min_lag, max_lag),
+                                              make_binning(bin_width, bins_per_decade, bin_edges));
+             }),
+             "Precompute the pair geometry of the two-dimensional arrays of the given shape.",
+             py::arg("height"), py::arg("width"), py::arg("min_lag") = 0.0, py::arg("max_lag") = INFINITY,
+             py::arg("bin_width") = 0.0, py::arg("bins_per_decade") = 0, py::arg("bin_edges") = vector<double>())
+        .def_readonly("height", &StructureFunctionPlan::height)
+        .def_readonly("width", &StructureFunctionPlan::width)
+        .def_readonly("number_of_bins", &StructureFunctionPlan::number_of_bins)
+        .def_property_readonly("bin_edges", &StructureFunctionPlan::bin_edges)
+        .def("str_func", [](const StructureFunctionPlan& plan, const numpy_array_2d& input_array, const int order) {
+                 Array2D borrowed_array = borrow_array(input_array);
+                 Array2D output;
+                 {
+                     py::gil_scoped_release release;
+                     output = structure_function(plan, borrowed_array, order);
+                 }
+                 return to_numpy(output);
+             },
+             "Compute the n-th order structure function of a two-dimensional array of the shape of the plan.",
+             py::arg("input_array"), py::arg("order"))
+        .def("str_func", [](const StructureFunctionPlan& plan, const numpy_float_array_2d& input_array,
+                            const int order) {
+                 FloatArray2D borrowed_array = borrow_array(input_array);
+                 Array2D output;
+                 {
+                     py::gil_scoped_release release;
+                     output = structure_function(plan, borrowed_array, order);
+                 }
+                 return to_numpy(output);
+             },
+             "Compute the n-th order structure function of a float32 two-dimensional array of the shape of the plan.",
+             py::arg("input_array"), py::arg("order"))
+        .def("str_func_multi", [](const StructureFunctionPlan& plan, const numpy_array_2d& input_array,
+                                  const vector<int>& orders) {
+                 Array2D borrowed_array = borrow_array(input_array);
+                 Array2D output;
+                 {
+                     py::gil_scoped_release release;
+                     output = structure_functions(plan, borrowed_array, orders);
+                 }
+                 return to_numpy(output);
+             },
+             "Compute the structure functions of several orders of a two-dimensional array of the shape of the plan.",
+             py::arg("input_array"), py::arg("orders"))
+        .def("autocorrelation", [](const StructureFunctionPlan& plan, const numpy_array_2d& input_array) {
+                 Array2D borrowed_array = borrow_array(input_array);
+                 Array2D output;
+                 {
+                     py::gil_scoped_release release;
+                     output = autocorrelation(plan, borrowed_array);
+                 }
+                 return to_numpy(output);
+             },
+             "Compute the autocorrelation function of a two-dimensional array of the shape of the plan.",
+             py::arg("input_array"))
+        .def("str_func_cube", [](const StructureFunctionPlan& plan, const numpy_array_3d& input_cube, const int order) {
+                 vector<Array2D> borrowed_slices = borrow_slices(input_cube);
+                 vector<Array2D> outputs;
+                 {
+                     py::gil_scoped_release release;
+                     outputs = structure_function_cube(plan, borrowed_slices, order);
+                 }
+                 return stack_to_numpy(outputs, outputs.empty() ? 0 : outputs[0].height, 3);
+             },
+             "Compute the n-th order structure function of every slice of a three-dimensional array, whose slices have "
+             "the shape of the plan.",
+             py::arg("input_cube"), py::arg("order"))
+        .def("str_func_cube", [](const StructureFunctionPlan& plan, const numpy_float_array_3d& input_cube,
+                                 const int order) {
+                 vector<FloatArray2D> borrowed_slices = borrow_slices(input_cube);
+                 vector<Array2D> outputs;
+                 {
+                     py::gil_scoped_release release;
+                     outputs = structure_function_cube(plan, borrowed_slices, order);
+                 }
+                 return stack_to_numpy(outputs, outputs.empty() ? 0 : outputs[0].height, 3);
+             },
+             "Compute the n-th order structure function of every slice of a float32 three-dimensional array, whose "
+             "slices have the shape of the plan.",
+             py::arg("input_cube"), py::arg("order"))
+        .def("str_func_regions", [](const StructureFunctionPlan& plan, const numpy_array_2d& input_array,
+                                    const numpy_labels& label_image, const int order, const bool cross_regions) {
+                 Array2D borrowed_array = borrow_array(input_array);
+                 RegionLabels regions = make_regions(label_image, borrowed_array.height, borrowed_array.width,
+                                                     cross_regions);
+                 RegionStructureFunctions output;
+                 {
+                     py::gil_scoped_release release;
+                     output = region_structure_functions(plan, borrowed_array, regions, order);
+                 }
+                 return regions_to_numpy(output);
+             },
+             "Compute the n-th order structure function of every region of a two-dimensional array of the shape of the "
+             "plan given by a label image.",
+             py::arg("input_array"), py::arg("label_image"), py::arg("order"), py::arg("cross_regions") = false);
+
+    // An accumulator keeps the pairs of the active pixels of an array, which can be added or removed afterwards. The
+    // array is copied, so later changes to the NumPy array are not seen.
+    py::class_<StructureFunctionAccumulator>(m, "StructureFunctionAccumulator")
+        .def(py::init([](const numpy_array_2d& input_array, const int order, const double min_lag,
+                         const double max_lag, const double bin_width, const int bins_per_decade,
+                         const vector<double>& bin_edges) {
+                 Array2D borrowed_array = borrow_array(input_array);
+                 LagWindow window(min_lag, max_lag);
+                 LagBinning binning = make_binning(bin_width, bins_per_decade, bin_edges);
+                 py::gil_scoped_release release;
+                 return make_unique<StructureFunctionAccumulator>(borrowed_array, order, window, binning);
+             }),
+             "Accumulate the pairs of every valid pixel of a two-dimensional array.",
+             py::arg("input_array"), py::arg("order"), py::arg("min_lag") = 0.0, py::arg("max_lag") = INFINITY,
+             py::arg("bin_width") = 0.0, py::arg("bins_per_decade") = 0, py::arg("bin_edges") = vector<double>())
+        .def_readonly("order", &StructureFunctionAccumulator::order)
+        .def_property_readonly("number_of_active_pixels", &StructureFunctionAccumulator::number_of_active_pixels)
+        .def("add_pixels", [](StructureFunctionAccumulator& accumulator, const numpy_pixels& pixels) {
+                 vector<array<size_t, 2>> coordinates = make_pixels(pixels);
+                 py::gil_scoped_release release;
+                 return accumulator.add_pixels(coordinates);
+             },
+             "Add the (n_pixels, 2) array of (y, x) pixels to the pairs and give the number of pixels that were added. "
+             "The active pixels and the pixels whose value is NaN are ignored.",
+             py::arg("pixels"))
+        .def("remove_pixels", [](StructureFunctionAccumulator& accumulator, const numpy_pixels& pixels) {
+                 vector<array<size_t, 2>> coordinates = make_pixels(pixels);
+                 py::gil_scoped_release release;
+                 return accumulator.remove_pixels(coordinates);
+             },
+             "Remove the (n_pixels, 2) array of (y, x) pixels from the pairs and give the number of pixels that were "
+             "removed. The inactive pixels are ignored.",
+             py::arg("pixels"))
+        .def("str_func", [](const StructureFunctionAccumulator& accumulator) {
+                 return to_numpy(accumulator.structure_function());
+             },
+             "Give the structure function of the pairs of the active pixels as an (n_lags, 3) array.");
 }
 
-// MAC :    clang++ -std=c++17 -shared -undefined dynamic_lookup -I./pybind11/include/ `python3.12 -m pybind11 --includes` vsf.cpp stats.cpp tools.cpp pybind11.cpp -o stats_library.so `python3.12-config --ldflags` -Xpreprocessor -fopenmp -I/opt/homebrew/opt/libomp/include -L/opt/homebrew/opt/libomp/lib -lomp
-// LINUX :  g++ -std=c++17 -shared -fPIC -I./pybind11/include/ `python3.12 -m pybind11 --includes` vsf.cpp stats.cpp tools.cpp pybind11.cpp -o stats_library.so `python3.12-config --ldflags` -fopenmp -lm
-// C++:     clang++ -std=c++17 vsf.cpp stats.cpp tools.cpp -o test -I/opt/homebrew/opt/libomp/include -L/opt/homebrew/opt/libomp/lib -lomp
+// The sources are those of STATS_LIBRARY_SOURCES in CMakeLists.txt, and ./build.sh builds the module with them.
+// MAC :    clang++ -std=c++17 -shared -undefined dynamic_lookup -I./pybind11/include/ `python3.12 -m pybind11 --includes` vsf.cpp stats.cpp tools.cpp fft.cpp array_2d.cpp simd.cpp sampling.cpp resampling.cpp profiling.cpp run_control.cpp pybind11.cpp -o stats_library.so `python3.12-config --ldflags` -Xpreprocessor -fopenmp -I/opt/homebrew/opt/libomp/include -L/opt/homebrew/opt/libomp/lib -lomp
+// LINUX :  g++ -std=c++17 -shared -fPIC -I./pybind11/include/ `python3.12 -m pybind11 --includes` vsf.cpp stats.cpp tools.cpp fft.cpp array_2d.cpp simd.cpp sampling.cpp resampling.cpp profiling.cpp run_control.cpp pybind11.cpp -o stats_library.so `python3.12-config --ldflags` -fopenmp -lm
+// C++:     clang++ -std=c++17 vsf.cpp stats.cpp tools.cpp fft.cpp array_2d.cpp simd.cpp sampling.cpp resampling.cpp profiling.cpp run_control.cpp -o test -I/opt/homebrew/opt/libomp/include -L/opt/homebrew/opt/libomp/lib -lomp
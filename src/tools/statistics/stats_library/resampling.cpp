@@ -0,0 +1,211 @@
+#include <omp.h>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include "resampling.h"
+#include "sampling.h"
+
+using namespace std;
+
+/**
+ * \brief Gives the label of the block of every valid point of an array, in row-major order. The invalid points belong
+ * to no block, so the blocks without valid points are left out of the resampling.
+ */
+static vector<int64_t> block_labels(const Array2D& input_array, const size_t block_size) {
+    const size_t blocks_per_row = (input_array.width + block_size - 1) / block_size;
+    vector<int64_t> labels(input_array.size(), -1);
+    for (size_t y = 0; y < input_array.height; ++y) {
+        for (size_t x = 0; x < input_array.width; ++x) {
+            if (isnan(input_array(y, x))) continue;
+            labels[y * input_array.width + x] = (y / block_size) * blocks_per_row + x / block_size;
+        }
+    }
+    return labels;
+}
+
+/**
+ * \brief Gives the standard error of each lag from its valid replicates, whose sum of squared deviations is multiplied
+ * by (n - 1) / n for the jackknife and by 1 / (n - 1) for the bootstrap, for n valid replicates.
+ */
+static vector<double> replicate_uncertainties(const Array2D& replicates, const bool is_jackknife) {
+    vector<double> uncertainties(replicates.width, NAN);
+    for (size_t lag = 0; lag < replicates.width; ++lag) {
+        MomentAccumulator<> accumulator;
+        for (size_t replicate = 0; replicate < replicates.height; ++replicate) {
+            if (!isnan(replicates(replicate, lag))) accumulator.add(replicates(replicate, lag));
+        }
+        if (accumulator.count <= 1) continue;
+        const double n = accumulator.count;
+        const double factor = is_jackknife ? (n - 1) / n : 1 / (n - 1);
+        uncertainties[lag] = sqrt(factor * accumulator.central_sums[0]);
+    }
+    return uncertainties;
+}
+
+/**
+ * \brief Calculates the nth order structure function of two-dimensional data along with its spatial jackknife or
+ * bootstrap replicates, all from a single pass over the pairs. Only the number of pairs and the sum of their values
+ * are kept at each bin. The jackknife keeps them for the pairs that touch each block, and a replicate leaves out those
+ * of one block, so the memory scales with the number of blocks times the number of bins. The bootstrap keeps them for
+ * each couple of blocks, and weights the couple (a, b) by the product of the number of times that a and b are drawn,
+ * or by the number of times that a is drawn if a = b, so its memory scales with the square of the number of blocks
+ * times the number of bins and the lags should be binned for large arrays.
+ * \param plan The pair geometry of the array, along with the range of distances and the bins of the pairs.
+ * \param input_array The input as a two-dimensional array of the shape of the plan.
+ * \param order The order of the structure function to compute.
+ * \param options The method, the size of the blocks, the number of bootstrap replicates, the seed and the memory budget.
+ * \return The (lag, structure function, uncertainty) rows sorted by lag, whose uncertainty is the jackknife or
+ * bootstrap standard error, and the (n_replicates, n_lags) structure functions of the replicates. The structure
+ * function of a replicate without pairs at a lag is NaN.
+ * \throws invalid_argument If the tables of the sums do not fit in the memory budget.
+ */
+ResampledStructureFunction resampled_structure_function(const StructureFunctionPlan& plan,
+                                                        const Array2D& input_array, const int order,
+                                                        const ResamplingOptions& options) {
+    if (options.block_size == 0) {
+        throw invalid_argument("The block size must be positive.");
+    }
+    const bool is_jackknife = options.method == ResamplingOptions::Method::jackknife;
+    if (!is_jackknife && options.number_of_replicates == 0) {
+        throw invalid_argument("The bootstrap requires at least one replicate.");
+    }
+    RegionLabels blocks(input_array.height, input_array.width, block_labels(input_array, options.block_size),
+                        !is_jackknife);
+    // The shared tables and those of a single thread must fit in the budget
+    const size_t table_bytes = region_sums_bytes(plan, blocks, is_jackknife);
+    if (options.max_memory_bytes != 0 && 2 * table_bytes > options.max_memory_bytes) {
+        throw invalid_argument("The resampling tables of " + to_string(blocks.labels.size()) + " blocks and "
+                               + to_string(plan.number_of_bins) + " bins need at least " + to_string(2 * table_bytes)
+                               + " bytes, more than the memory budget of " + to_string(options.max_memory_bytes)
+                               + " bytes. Bin the lags, enlarge the blocks or use the jackknife.");
+    }
+    RegionPairSums pair_sums;
+    accumulate_subtracted_region_sums(plan, input_array, blocks, order, is_jackknife, pair_sums,
+                                      options.max_memory_bytes);
+    const vector<double>& counts = pair_sums.counts;
+    const vector<double>& sums = pair_sums.sums;
+    const size_t number_of_bins = pair_sums.number_of_bins;
+    const size_t number_of_tables = pair_sums.number_of_tables;
+    const size_t number_of_blocks = blocks.labels.size();
+
+    // The sums of every pair, which are those of the last table of the jackknife
+    const bool is_exact = plan.binning.is_exact();
+    vector<double> total_counts(number_of_bins, 0);
+    vector<double> total_sums(number_of_bins, 0);
+    for (size_t table = is_jackknife ? number_of_blocks : 0; table < number_of_tables; ++table) {
+        for (size_t bin = 0; bin < number_of_bins; ++bin) {
+            total_counts[bin] += counts[table * number_of_bins + bin];
+            total_sums[bin] += sums[table * number_of_bins + bin];
+        }
+    }
+
+    // The lags of the output are those of the whole array that have more than one pair
+    vector<size_t> indices;
+    vector<double> lags;
+    for (size_t bin = 0; bin < number_of_bins; ++bin) {
+        if (total_counts[bin] < 1.5 || (is_exact && bin == 0)) continue;  // skip single values and the zero distance
+        indices.push_back(bin);
+        lags.push_back(is_exact ? sqrt((double)bin) : pair_sums.lag_sums[bin] / total_counts[bin]);
+    }
+    const size_t number_of_lags = indices.size();
+
+    const size_t number_of_replicates = is_jackknife ? number_of_blocks : options.number_of_replicates;
+    Array2D replicates(number_of_replicates, number_of_lags, NAN);
+    if (is_jackknife) {
+        // The pairs that touch each block are the ones left out of its replicate
+        for (size_t block = 0; block < number_of_blocks; ++block) {
+            for (size_t lag = 0; lag < number_of_lags; ++lag) {
+                const size_t bin = indices[lag];
+                const double count = total_counts[bin] - counts[block * number_of_bins + bin];
+                if (count < 0.5) continue;  // the counts are exact integers
+                replicates(block, lag) = (total_sums[bin] - sums[block * number_of_bins + bin]) / count;
+            }
+        }
+    } else {
+        // Each replicate has its own generator, so the replicates do not depend on the number of threads
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t replicate = 0; replicate < number_of_replicates; ++replicate) {
+            Xoshiro256 generator(options.seed + replicate);
+            vector<double> draws(number_of_blocks, 0);
+            for (size_t draw = 0; draw < number_of_blocks; ++draw) {
+                draws[generator.below(number_of_blocks)] += 1;
+            }
+            vector<double> replicate_counts(number_of_lags, 0);
+            vector<double> replicate_sums(number_of_lags, 0);
+            for (uint32_t low = 0; low < number_of_blocks; ++low) {
+                if (draws[low] == 0) continue;
+                for (uint32_t high = low; high < number_of_blocks; ++high) {
+                    if (draws[high] == 0) continue;
+                    const double weight = (high == low) ? draws[low] : draws[low] * draws[high];
+                    const size_t offset = blocks.table_index(low, high) * number_of_bins;
+                    for (size_t lag = 0; lag < number_of_lags; ++lag) {
+                        replicate_counts[lag] += weight * counts[offset + indices[lag]];
+                        replicate_sums[lag] += weight * sums[offset + indices[lag]];
+                    }
+                }
+            }
+            for (size_t lag = 0; lag < number_of_lags; ++lag) {
+                if (replicate_counts[lag] > 0) replicates(replicate, lag) = replicate_sums[lag] / replicate_counts[lag];
+            }
+        }
+    }
+
+    const vector<double> uncertainties = replicate_uncertainties(replicates, is_jackknife);
+    Array2D output_array(number_of_lags, 3);
+    for (size_t lag = 0; lag < number_of_lags; ++lag) {
+        output_array(lag, 0) = lags[lag];
+        output_array(lag, 1) = total_sums[indices[lag]] / total_counts[indices[lag]];
+        output_array(lag, 2) = uncertainties[lag];
+    }
+    return {output_array, replicates};
+}
+
+/**
+ * \brief Fits the power law b * r^m to each replicate of a structure function with a linear least-squares fit of
+ * log10(S) against log10(r), which has a closed form and is computed for every replicate in parallel.
+ * \param lags The lag of each column of the replicates.
+ * \param replicates The (n_replicates, n_lags) structure functions to fit.
+ * \param min_lag The smallest lag of the fit. The lags outside of [min_lag, max_lag] are ignored.
+ * \param max_lag The largest lag of the fit.
+ * \return The slope and the amplitude of each replicate, which are NaN if it has fewer than two positive values in
+ * the range. The non-positive and NaN values are ignored.
+ */
+PowerLawFits fit_power_laws(const vector<double>& lags, const Array2D& replicates, const double min_lag,
+                            const double max_lag) {
+    if (lags.size() != replicates.width) {
+        throw invalid_argument("The replicates must have one column for each of the " + to_string(lags.size())
+                               + " lags, got " + to_string(replicates.width) + " columns.");
+    }
+    vector<size_t> fitted_lags;
+    vector<double> log_lags(lags.size(), 0);
+    for (size_t lag = 0; lag < lags.size(); ++lag) {
+        if (!(min_lag <= lags[lag] && lags[lag] <= max_lag && lags[lag] > 0)) continue;
+        fitted_lags.push_back(lag);
+        log_lags[lag] = log10(lags[lag]);
+    }
+
+    PowerLawFits fits = {vector<double>(replicates.height, NAN), vector<double>(replicates.height, NAN)};
+    #pragma omp parallel for schedule(static)
+    for (size_t replicate = 0; replicate < replicates.height; ++replicate) {
+        double n = 0, sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+        for (const size_t lag : fitted_lags) {
+            const double val = replicates(replicate, lag);
+            if (!(val > 0)) continue;
+            const double x = log_lags[lag];
+            const double y = log10(val);
+            n += 1;
+            sum_x += x;
+            sum_y += y;
+            sum_xx += x * x;
+            sum_xy += x * y;
+        }
+        const double denominator = n * sum_xx - sum_x * sum_x;
+        if (n < 2 || denominator <= 0) continue;
+        const double slope = (n * sum_xy - sum_x * sum_y) / denominator;
+        fits.slopes[replicate] = slope;
+        fits.amplitudes[replicate] = pow(10.0, (sum_y - slope * sum_x) / n);
+    }
+    return fits;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+
+#include "tools.h"
+
+/**
+ * \struct ResamplingOptions
+ * \brief Parameters of the spatial resampling of the structure function. The array is cut into square blocks of
+ * block_size pixels, and the replicates either leave out one block at a time (jackknife) or draw as many blocks as
+ * there are with replacement (bootstrap). Neighbouring pairs share their pixels, so resampling blocks instead of pairs
+ * accounts for their correlation.
+ */
+struct ResamplingOptions
+{
+    enum class Method {jackknife, bootstrap};
+
+    Method method = Method::jackknife;
+    size_t block_size = 32;
+    size_t number_of_replicates = 1000;  // only used by the bootstrap, the jackknife has one replicate per block
+    uint64_t seed = 0;
+    size_t max_memory_bytes = (size_t)2 << 30;  // budget of the tables of the pair sums, 0 for no budget
+};
+
+/**
+ * \struct ResampledStructureFunction
+ * \brief Structure function of an array whose uncertainty is the spread of its spatial replicates. The rows of
+ * structure are the lag, the structure function and its uncertainty, and each row of replicates is the structure
+ * function of a replicate at the same lags.
+ */
+struct ResampledStructureFunction
+{
+    Array2D structure;
+    Array2D replicates;
+};
+
+/**
+ * \struct PowerLawFits
+ * \brief Slope m and amplitude b of the power law b * r^m fitted to each replicate of a structure function.
+ */
+struct PowerLawFits
+{
+    std::vector<double> slopes;
+    std::vector<double> amplitudes;
+};
+
+ResampledStructureFunction resampled_structure_function(
+    const StructureFunctionPlan& plan,
+    const Array2D& input_array,
+    const int order,
+    const ResamplingOptions& options
+);
+PowerLawFits fit_power_laws(
+    const std::vector<double>& lags,
+    const Array2D& replicates,
+    const double min_lag,
+    const double max_lag
+);
@@ -0,0 +1,80 @@
+#include <omp.h>
+#include <chrono>
+
+#include "run_control.h"
+
+using namespace std;
+
+// The controls of each thread, so concurrent computations (e.g. the asynchronous ones) each keep their own
+static thread_local const RunControl* installed_control = nullptr;
+
+static double wall_time() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+RunControlScope::RunControlScope(const RunControl& control) : previous(installed_control) {
+    installed_control = &control;
+}
+
+RunControlScope::~RunControlScope() {
+    installed_control = previous;
+}
+
+/**
+ * \brief Gives the controls installed on the calling thread, or nullptr if there are none.
+ */
+const RunControl* current_run_control() {
+    return installed_control;
+}
+
+RunMonitor::RunMonitor(const RunControl* control, const size_t number_of_jobs)
+    : control(control), number_of_jobs(number_of_jobs), last_report(wall_time()) {}
+
+/**
+ * \brief Tells whether the remaining jobs must be skipped, because the computation was cancelled or because the
+ * progress callback failed.
+ */
+bool RunMonitor::stopped() {
+    if (is_stopped.load(memory_order_relaxed)) return true;
+    if (control != nullptr && control->cancel_flag && control->cancel_flag->load(memory_order_relaxed)) {
+        is_stopped = true;
+    }
+    return is_stopped.load(memory_order_relaxed);
+}
+
+/**
+ * \brief Counts a finished job, and reports the progress if it is called by the master thread of the loop and if the
+ * last report is old enough.
+ */
+void RunMonitor::job_done() {
+    const size_t done = ++jobs_done;
+    if (control == nullptr || !control->progress || omp_get_thread_num() != 0) return;
+    if (wall_time() - last_report < control->progress_interval) return;
+    report(done);
+}
+
+/**
+ * \brief Calls the progress callback. Its exceptions are kept to be raised by finish, and stop the other jobs.
+ */
+void RunMonitor::report(const size_t done) {
+    last_report = wall_time();
+    last_reported_jobs = done;
+    try {
+        control->progress(done, number_of_jobs);
+    } catch (...) {
+        error = current_exception();
+        is_stopped = true;
+    }
+}
+
+/**
+ * \brief Ends the monitoring after the loop. The exception of the progress callback is raised again, if there was one,
+ * and RunCancelled is thrown if the computation was cancelled. Otherwise, the progress callback is called a last time
+ * unless the last job was already reported.
+ */
+void RunMonitor::finish() {
+    if (error) rethrow_exception(error);
+    if (is_stopped) throw RunCancelled();
+    if (control == nullptr || !control->progress || last_reported_jobs == jobs_done) return;
+    control->progress(jobs_done, number_of_jobs);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+
+/**
+ * \struct RunControl
+ * \brief Controls of a long computation: a progress callback, a cooperative cancellation flag and a memory budget. The
+ * controls are installed on the calling thread by a RunControlScope, and the pair engines that support them read them
+ * when they start, so they do not have to be passed through every function.
+ */
+struct RunControl
+{
+    // Callable of the number of pair tiles done and of their total number. It is only called by the thread that started
+    // the computation, at most once every progress_interval seconds and once more when every tile is done. The
+    // exceptions it throws cancel the computation and are raised again once the threads have stopped.
+    std::function<void(size_t, size_t)> progress;
+    double progress_interval = 0.5;
+    // Flag that stops the computation when it is set, e.g. from another thread. It is checked before each pair tile.
+    std::shared_ptr<std::atomic<bool>> cancel_flag;
+    // Number of bytes that the buffers of the engine may use, or 0 for no budget. The materialized method is replaced
+    // by the streaming one when its pairs would not fit, and fewer threads keep their own tables when they would not.
+    size_t max_memory_bytes = 0;
+
+    bool has_budget() const {return max_memory_bytes != 0;}
+};
+
+/**
+ * \struct RunCancelled
+ * \brief Exception thrown by a computation that was cancelled with the cancellation flag of its RunControl.
+ */
+struct RunCancelled : std::runtime_error
+{
+    RunCancelled() : std::runtime_error("The computation was cancelled.") {}
+};
+
+/**
+ * \struct RunControlScope
+ * \brief Installs the controls of the computations that the calling thread starts until the end of the scope.
+ */
+struct RunControlScope
+{
+    const RunControl* previous;
+
+    explicit RunControlScope(const RunControl& control);
+    ~RunControlScope();
+    RunControlScope(const RunControlScope&) = delete;
+    RunControlScope& operator=(const RunControlScope&) = delete;
+};
+
+const RunControl* current_run_control();
+
+/**
+ * \struct RunMonitor
+ * \brief Progress and cancellation of the parallel loop of a computation over a number of jobs (e.g. pair tiles). It is
+ * created by the thread that starts the computation, shared by the threads of the loop, and finished after the loop,
+ * as the exceptions cannot leave a parallel region. Without controls, it costs an atomic increment per job.
+ */
+struct RunMonitor
+{
+    const RunControl* control;
+    size_t number_of_jobs;
+    std::atomic<size_t> jobs_done{0};
+    std::atomic<bool> is_stopped{false};
+    double last_report;
+    size_t last_reported_jobs = 0;
+    std::exception_ptr error;
+
+    RunMonitor(const RunControl* control, const size_t number_of_jobs);
+
+    bool stopped();
+    void job_done();
+    void report(const size_t done);
+    void finish();
+};
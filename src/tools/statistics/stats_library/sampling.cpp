@@ -0,0 +1,179 @@
+#include <omp.h>
+#include <cmath>
+#include <algorithm>
+
+#include "sampling.h"
+
+using namespace std;
+
+// Number of pairs drawn by each generator during the first round. Each round then draws twice as many pairs as the
+// previous one, so the convergence is checked a logarithmic number of times.
+const size_t FIRST_ROUND_DRAWS = 4096;
+
+/**
+ * \brief Gives the next value of the splitmix64 sequence, which is used to spread a seed over the whole state of a
+ * generator.
+ */
+static uint64_t splitmix64(uint64_t& seed) {
+    uint64_t z = (seed += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t rotate_left(const uint64_t val, const int shift) {
+    return (val << shift) | (val >> (64 - shift));
+}
+
+Xoshiro256::Xoshiro256(uint64_t seed) {
+    for (uint64_t& word : state) {
+        word = splitmix64(seed);
+    }
+}
+
+uint64_t Xoshiro256::next() {
+    const uint64_t result = rotate_left(state[1] * 5, 7) * 9;
+    const uint64_t shifted = state[1] << 17;
+    state[2] ^= state[0];
+    state[3] ^= state[1];
+    state[1] ^= state[2];
+    state[0] ^= state[3];
+    state[2] ^= shifted;
+    state[3] = rotate_left(state[3], 45);
+    return result;
+}
+
+/**
+ * \brief Gives a random integer in [0, bound) with the multiply-shift method of Lemire, which avoids a division. Its
+ * bias is of order bound / 2^64 and is negligible for array sizes.
+ */
+uint64_t Xoshiro256::below(const uint64_t bound) {
+    return (uint64_t)(((unsigned __int128)next() * bound) >> 64);
+}
+
+/**
+ * \brief Checks whether every bin that was reached has enough pairs and a relative standard error below the target.
+ */
+static bool has_converged(const lag_squared_accumulator_table& accumulated_vals, const SamplingOptions& options) {
+    for (const auto& accumulator : accumulated_vals) {
+        if (accumulator.count == 0) continue;  // the bins that were never reached cannot be evaluated
+        if (accumulator.count < max(options.min_pairs_per_bin, (size_t)2)) return false;
+        if (accumulator.standard_error() > options.target_relative_error * abs(accumulator.mean)) return false;
+    }
+    return true;
+}
+
+/**
+ * \brief Accumulates the absolute difference, raised to the given order, of randomly drawn pairs of elements of the
+ * input array according to their squared distances. Each draw picks a first point uniformly, then an offset uniformly
+ * in the box of the window, so every pair of the window is equally likely and the mean of each bin is an unbiased
+ * estimate of its exact value. Each thread draws its pairs with its own generator, and the results only depend on the
+ * seed and on the number of threads.
+ * \param input_array The array whose pairs are sampled.
+ * \param order The order to which the differences are raised.
+ * \param options The number of draws, the stopping criterion and the seed of the sampling.
+ * \param accumulated_vals The table in which to accumulate the values, laid out as with accumulate_subtracted_pairs.
+ * \param window The range of distances of the pairs to sample.
+ * \param binning The bins in which to regroup the pairs. Unless the binning is exact, the table is indexed by bin.
+ * \param lag_sums The vector that receives the sum of the distances of the pairs of each bin, if it is given and the
+ * binning is not exact.
+ * \return The number of pairs that were drawn, including the ones that were rejected because they fell outside of the
+ * array or of the window, or because one of their values is NaN.
+ */
+size_t accumulate_sampled_pairs(
+    const Array2D& input_array,
+    const int order,
+    const SamplingOptions& options,
+    lag_squared_accumulator_table& accumulated_vals,
+    const LagWindow& window,
+    const LagBinning& binning,
+    vector<double>* lag_sums
+) {
+    const size_t height = input_array.height;
+    const size_t width = input_array.width;
+    const size_t number_of_points = height * width;
+    accumulated_vals.clear();
+    if (lag_sums != nullptr) lag_sums->clear();
+    if (number_of_points == 0) return 0;
+
+    const size_t max_lag_squared_val = min(max_lag_squared(height, width), window.upper_lag_squared);
+    const LagBinLookup lookup(binning, binning.is_exact() ? 0 : max_lag_squared_val);
+    const size_t table_size = binning.is_exact() ? max_lag_squared_val + 1 : lookup.number_of_bins;
+    const ptrdiff_t max_dy = window.max_offset(height);
+    const ptrdiff_t max_dx = window.max_offset(width);
+
+    // Each generator keeps its own table for the whole sampling, so tables and generators are matched by index
+    const size_t number_of_streams = omp_get_max_threads();
+    vector<Xoshiro256> generators;
+    for (size_t stream = 0; stream < number_of_streams; ++stream) {
+        generators.emplace_back(options.seed + stream);
+    }
+    vector<lag_squared_accumulator_table> local_accumulated_vals(number_of_streams,
+                                                                 lag_squared_accumulator_table(table_size));
+    vector<vector<double>> local_lag_sums(number_of_streams, vector<double>(binning.is_exact() ? 0 : table_size, 0));
+
+    auto merge_streams = [&](lag_squared_accumulator_table& merged_vals) {
+        merged_vals.assign(table_size, MomentAccumulator<>());
+        for (const auto& local_table : local_accumulated_vals) {
+            for (size_t index = 0; index < table_size; ++index) {
+                merged_vals[index].merge(local_table[index]);
+            }
+        }
+    };
+
+    size_t draws = 0;
+    for (size_t round_draws = FIRST_ROUND_DRAWS * number_of_streams; draws < options.max_draws; round_draws *= 2) {
+        const size_t round_total = min(round_draws, options.max_draws - draws);
+
+        #pragma omp parallel for schedule(static)
+        for (size_t stream = 0; stream < number_of_streams; ++stream) {
+            Xoshiro256& generator = generators[stream];
+            lag_squared_accumulator_table& stream_accumulated_vals = local_accumulated_vals[stream];
+            vector<double>& stream_lag_sums = local_lag_sums[stream];
+            const size_t stream_draws = round_total / number_of_streams + (stream < round_total % number_of_streams);
+
+            for (size_t draw = 0; draw < stream_draws; ++draw) {
+                size_t p = generator.below(number_of_points);
+                ptrdiff_t y = p / width;
+                ptrdiff_t x = p % width;
+                ptrdiff_t j = y + (ptrdiff_t)generator.below(2 * max_dy + 1) - max_dy;
+                ptrdiff_t i = x + (ptrdiff_t)generator.below(2 * max_dx + 1) - max_dx;
+                if (j < 0 || j >= (ptrdiff_t)height || i < 0 || i >= (ptrdiff_t)width) continue;
+
+                size_t lag_squared = (i - x) * (i - x) + (j - y) * (j - y);
+                if (lag_squared == 0 || !window.contains(lag_squared)) continue;  // reject zero distances
+                double a = input_array(y, x);
+                double b = input_array(j, i);
+                if (isnan(a) || isnan(b)) continue;
+
+                size_t index = lag_squared;
+                if (!binning.is_exact()) {
+                    index = lookup.bins[lag_squared];
+                    if (index == LagBinLookup::NO_BIN) continue;
+                    stream_lag_sums[index] += lookup.lags[lag_squared];
+                }
+                double difference = abs(a - b);
+                double val = (order == 1) ? difference
+                           : (order == 2) ? difference * difference : pow(difference, order);
+                stream_accumulated_vals[index].add(val);
+            }
+        }
+        draws += round_total;
+
+        if (options.target_relative_error > 0 && draws < options.max_draws) {
+            merge_streams(accumulated_vals);
+            if (has_converged(accumulated_vals, options)) break;
+        }
+    }
+
+    merge_streams(accumulated_vals);
+    if (lag_sums != nullptr && !binning.is_exact()) {
+        lag_sums->assign(table_size, 0);
+        for (const auto& stream_lag_sums : local_lag_sums) {
+            for (size_t bin = 0; bin < table_size; ++bin) {
+                (*lag_sums)[bin] += stream_lag_sums[bin];
+            }
+        }
+    }
+    return draws;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+
+#include "tools.h"
+
+/**
+ * \struct SamplingOptions
+ * \brief Parameters of the random pair sampling. The pairs are drawn in rounds of increasing size until max_draws pairs
+ * have been drawn, or until every bin that was reached contains at least min_pairs_per_bin pairs and has a relative
+ * standard error below target_relative_error.
+ */
+struct SamplingOptions
+{
+    size_t max_draws = 1000000;
+    double target_relative_error = 0;  // 0 never stops before max_draws
+    size_t min_pairs_per_bin = 10;
+    uint64_t seed = 0;
+};
+
+/**
+ * \struct Xoshiro256
+ * \brief The xoshiro256** pseudorandom number generator of Blackman and Vigna. It is fast enough to be called for every
+ * sampled pair, and each thread owns its own generator.
+ */
+struct Xoshiro256
+{
+    uint64_t state[4];
+
+    explicit Xoshiro256(uint64_t seed);
+    uint64_t next();
+    uint64_t below(const uint64_t bound);
+};
+
+size_t accumulate_sampled_pairs(
+    const Array2D& input_array,
+    const int order,
+    const SamplingOptions& options,
+    lag_squared_accumulator_table& accumulated_vals,
+    const LagWindow& window = LagWindow(),
+    const LagBinning& binning = LagBinning(),
+    std::vector<double>* lag_sums = nullptr
+);
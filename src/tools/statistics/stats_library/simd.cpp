@@ -0,0 +1,316 @@
+#include <cmath>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SIMD_NEON
+#endif
+
+#include "simd.h"
+
+using namespace std;
+
+// Number of values reduced by a single kernel call before the partial moments are merged pairwise
+const size_t BLOCK_SIZE = 256;
+
+/**
+ * \struct BlockSums
+ * \brief Sums computed by a kernel over a block of values, where the deviations are taken from a shift close to the
+ * values of the block to avoid cancellation errors in the sum of squared deviations.
+ */
+struct BlockSums
+{
+    double count = 0;
+    double deviation_sum = 0;
+    double deviation_sum_of_squares = 0;
+    double sum_of_squares = 0;
+};
+
+// Kernel of a block of values of type T, whose sums are accumulated in double precision
+template <typename T>
+using block_kernel = BlockSums (*)(const T*, const size_t, const double);
+
+/**
+ * \brief Merges the moments of another set of values with the current ones, using the pairwise update of Chan et al.
+ */
+void NanMoments::merge(const NanMoments& other) {
+    if (other.count == 0) return;
+    if (count == 0) {
+        *this = other;
+        return;
+    }
+    double total_count = count + other.count;
+    double delta = other.mean - mean;
+    mean += delta * (other.count / total_count);
+    m2 += other.m2 + delta * delta * ((double)count * other.count / total_count);
+    count += other.count;
+    sum += other.sum;
+    sum_of_squares += other.sum_of_squares;
+}
+
+/**
+ * \brief Computes the sums of a block of values, one value at a time.
+ */
+template <typename T>
+static BlockSums scalar_kernel(const T* vals, const size_t size, const double shift) {
+    BlockSums sums;
+    for (size_t i = 0; i < size; ++i) {
+        double val = vals[i];
+        if (isnan(val)) continue;
+        double deviation = val - shift;
+        sums.count++;
+        sums.deviation_sum += deviation;
+        sums.deviation_sum_of_squares += deviation * deviation;
+        sums.sum_of_squares += val * val;
+    }
+    return sums;
+}
+
+#ifdef SIMD_X86
+/**
+ * \brief Loads four values in the lanes of an AVX2 register. The floats are widened to doubles.
+ */
+__attribute__((target("avx2,fma")))
+static inline __m256d avx2_load(const double* vals) {
+    return _mm256_loadu_pd(vals);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256d avx2_load(const float* vals) {
+    return _mm256_cvtps_pd(_mm_loadu_ps(vals));
+}
+
+/**
+ * \brief Loads eight values in the lanes of an AVX-512 register. The floats are widened to doubles.
+ */
+__attribute__((target("avx512f")))
+static inline __m512d avx512_load(const double* vals) {
+    return _mm512_loadu_pd(vals);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512d avx512_load(const float* vals) {
+    // Same as _mm512_cvtps_pd, whose header gives a false uninitialized warning with GCC 12
+    return _mm512_maskz_cvtps_pd((__mmask8)0xFF, _mm256_loadu_ps(vals));
+}
+
+/**
+ * \brief Computes the sums of a block of values with AVX2 instructions. The NaNs are removed by masking the lanes
+ * instead of branching.
+ */
+template <typename T>
+__attribute__((target("avx2,fma")))
+static BlockSums avx2_kernel(const T* vals, const size_t size, const double shift) {
+    const __m256d shift_vector = _mm256_set1_pd(shift);
+    const __m256d ones = _mm256_set1_pd(1.0);
+    __m256d count = _mm256_setzero_pd();
+    __m256d deviation_sum = _mm256_setzero_pd();
+    __m256d deviation_sum_of_squares = _mm256_setzero_pd();
+    __m256d sum_of_squares = _mm256_setzero_pd();
+
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        __m256d val = avx2_load(vals + i);
+        __m256d is_valid = _mm256_cmp_pd(val, val, _CMP_ORD_Q);
+        __m256d valid_val = _mm256_and_pd(val, is_valid);
+        __m256d deviation = _mm256_and_pd(_mm256_sub_pd(val, shift_vector), is_valid);
+        count = _mm256_add_pd(count, _mm256_and_pd(ones, is_valid));
+        deviation_sum = _mm256_add_pd(deviation_sum, deviation);
+        deviation_sum_of_squares = _mm256_fmadd_pd(deviation, deviation, deviation_sum_of_squares);
+        sum_of_squares = _mm256_fmadd_pd(valid_val, valid_val, sum_of_squares);
+    }
+
+    alignas(32) double lanes[4][4];
+    _mm256_store_pd(lanes[0], count);
+    _mm256_store_pd(lanes[1], deviation_sum);
+    _mm256_store_pd(lanes[2], deviation_sum_of_squares);
+    _mm256_store_pd(lanes[3], sum_of_squares);
+    BlockSums sums = scalar_kernel(vals + i, size - i, shift);  // remaining values
+    for (int lane = 0; lane < 4; ++lane) {
+        sums.count += lanes[0][lane];
+        sums.deviation_sum += lanes[1][lane];
+        sums.deviation_sum_of_squares += lanes[2][lane];
+        sums.sum_of_squares += lanes[3][lane];
+    }
+    return sums;
+}
+
+/**
+ * \brief Computes the sums of a block of values with AVX-512 instructions. The NaNs are removed with mask registers.
+ */
+template <typename T>
+__attribute__((target("avx512f")))
+static BlockSums avx512_kernel(const T* vals, const size_t size, const double shift) {
+    const __m512d shift_vector = _mm512_set1_pd(shift);
+    size_t count = 0;
+    __m512d deviation_sum = _mm512_setzero_pd();
+    __m512d deviation_sum_of_squares = _mm512_setzero_pd();
+    __m512d sum_of_squares = _mm512_setzero_pd();
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        __m512d val = avx512_load(vals + i);
+        __mmask8 is_valid = _mm512_cmp_pd_mask(val, val, _CMP_ORD_Q);
+        __m512d deviation = _mm512_maskz_sub_pd(is_valid, val, shift_vector);
+        count += __builtin_popcount(is_valid);
+        deviation_sum = _mm512_add_pd(deviation_sum, deviation);
+        deviation_sum_of_squares = _mm512_fmadd_pd(deviation, deviation, deviation_sum_of_squares);
+        sum_of_squares = _mm512_mask3_fmadd_pd(val, val, sum_of_squares, is_valid);
+    }
+
+    alignas(64) double lanes[3][8];
+    _mm512_store_pd(lanes[0], deviation_sum);
+    _mm512_store_pd(lanes[1], deviation_sum_of_squares);
+    _mm512_store_pd(lanes[2], sum_of_squares);
+    BlockSums sums = scalar_kernel(vals + i, size - i, shift);  // remaining values
+    sums.count += count;
+    for (int lane = 0; lane < 8; ++lane) {
+        sums.deviation_sum += lanes[0][lane];
+        sums.deviation_sum_of_squares += lanes[1][lane];
+        sums.sum_of_squares += lanes[2][lane];
+    }
+    return sums;
+}
+#endif
+
+#ifdef SIMD_NEON
+/**
+ * \brief Loads two values in the lanes of a NEON register. The floats are widened to doubles.
+ */
+static inline float64x2_t neon_load(const double* vals) {
+    return vld1q_f64(vals);
+}
+
+static inline float64x2_t neon_load(const float* vals) {
+    return vcvt_f64_f32(vld1_f32(vals));
+}
+
+/**
+ * \brief Computes the sums of a block of values with NEON instructions. The NaNs are removed by masking the lanes
+ * instead of branching.
+ */
+template <typename T>
+static BlockSums neon_kernel(const T* vals, const size_t size, const double shift) {
+    const float64x2_t shift_vector = vdupq_n_f64(shift);
+    const float64x2_t ones = vdupq_n_f64(1.0);
+    float64x2_t count = vdupq_n_f64(0);
+    float64x2_t deviation_sum = vdupq_n_f64(0);
+    float64x2_t deviation_sum_of_squares = vdupq_n_f64(0);
+    float64x2_t sum_of_squares = vdupq_n_f64(0);
+
+    size_t i = 0;
+    for (; i + 2 <= size; i += 2) {
+        float64x2_t val = neon_load(vals + i);
+        uint64x2_t is_valid = vceqq_f64(val, val);
+        float64x2_t zeros = vdupq_n_f64(0);
+        float64x2_t valid_val = vbslq_f64(is_valid, val, zeros);
+        float64x2_t deviation = vbslq_f64(is_valid, vsubq_f64(val, shift_vector), zeros);
+        count = vaddq_f64(count, vbslq_f64(is_valid, ones, zeros));
+        deviation_sum = vaddq_f64(deviation_sum, deviation);
+        deviation_sum_of_squares = vfmaq_f64(deviation_sum_of_squares, deviation, deviation);
+        sum_of_squares = vfmaq_f64(sum_of_squares, valid_val, valid_val);
+    }
+
+    BlockSums sums = scalar_kernel(vals + i, size - i, shift);  // remaining values
+    sums.count += vaddvq_f64(count);
+    sums.deviation_sum += vaddvq_f64(deviation_sum);
+    sums.deviation_sum_of_squares += vaddvq_f64(deviation_sum_of_squares);
+    sums.sum_of_squares += vaddvq_f64(sum_of_squares);
+    return sums;
+}
+#endif
+
+/**
+ * \brief Selects the widest kernel supported by the processor for the values of type T. This is only done once.
+ */
+template <typename T>
+static block_kernel<T> get_kernel() {
+    static const block_kernel<T> kernel = []() -> block_kernel<T> {
+#ifdef SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return avx512_kernel<T>;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return avx2_kernel<T>;
+#endif
+#ifdef SIMD_NEON
+        return neon_kernel<T>;
+#endif
+        return scalar_kernel<T>;
+    }();
+    return kernel;
+}
+
+/**
+ * \brief Gives the name of the instruction set used by the reduction kernels on this processor.
+ */
+const char* simd_instruction_set() {
+    block_kernel<double> kernel = get_kernel<double>();
+#ifdef SIMD_X86
+    if (kernel == avx512_kernel<double>) return "avx512";
+    if (kernel == avx2_kernel<double>) return "avx2";
+#endif
+#ifdef SIMD_NEON
+    if (kernel == neon_kernel<double>) return "neon";
+#endif
+    return "scalar";
+}
+
+/**
+ * \brief Computes the moments of a block of values with the given kernel.
+ */
+template <typename T>
+static NanMoments block_moments(const T* vals, const size_t size, const block_kernel<T> kernel) {
+    // The first valid value is used as shift so the deviations stay small compared to the values
+    size_t first_valid = 0;
+    while (first_valid < size && isnan(vals[first_valid])) {
+        first_valid++;
+    }
+    NanMoments moments;
+    if (first_valid == size) return moments;
+
+    const double shift = vals[first_valid];
+    BlockSums sums = kernel(vals + first_valid, size - first_valid, shift);
+    double mean_deviation = sums.deviation_sum / sums.count;
+    moments.count = (size_t)sums.count;
+    moments.mean = shift + mean_deviation;
+    moments.m2 = max(sums.deviation_sum_of_squares - sums.deviation_sum * mean_deviation, 0.0);
+    moments.sum = sums.deviation_sum + sums.count * shift;
+    moments.sum_of_squares = sums.sum_of_squares;
+    return moments;
+}
+
+/**
+ * \brief Reduces the values by splitting them in halves until they fit in a block, then merges the halves.
+ */
+template <typename T>
+static NanMoments pairwise_moments(const T* vals, const size_t size, const block_kernel<T> kernel) {
+    if (size <= BLOCK_SIZE) {
+        return block_moments(vals, size, kernel);
+    }
+    size_t half_size = (size / 2 + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;  // keep the blocks aligned
+    NanMoments moments = pairwise_moments(vals, half_size, kernel);
+    moments.merge(pairwise_moments(vals + half_size, size - half_size, kernel));
+    return moments;
+}
+
+/**
+ * \brief Computes in a single pass the number of valid values, the mean, the sum of squared deviations from the mean,
+ * the sum and the sum of squares of contiguous values, ignoring NaNs. The values are reduced by blocks with the widest
+ * SIMD kernel available (AVX-512, AVX2, NEON or scalar), and the block moments are merged pairwise, which keeps the
+ * variance numerically stable.
+ * \param vals Pointer to the first value.
+ * \param size The number of values.
+ */
+NanMoments nan_moments(const double* vals, const size_t size) {
+    return pairwise_moments(vals, size, get_kernel<double>());
+}
+
+/**
+ * \brief Computes the moments of contiguous floats like those of doubles. Each SIMD lane loads a float and widens it
+ * to a double, so the moments are accumulated in double precision without converting the values beforehand.
+ */
+NanMoments nan_moments(const float* vals, const size_t size) {
+    return pairwise_moments(vals, size, get_kernel<float>());
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <cmath>
+
+/**
+ * \struct NanMoments
+ * \brief Number of valid values, mean, sum of squared deviations from the mean (m2), sum and sum of squares of a set of
+ * values in which NaNs are ignored. The mean is kept separately from the sum so it does not lose precision when
+ * merging sets of values with a large offset.
+ */
+struct NanMoments
+{
+    size_t count = 0;
+    double mean = NAN;
+    double m2 = 0;
+    double sum = 0;
+    double sum_of_squares = 0;
+
+    double variance() const {return m2 / count;}
+    void merge(const NanMoments& other);
+};
+
+NanMoments nan_moments(const double* vals, const size_t size);
+NanMoments nan_moments(const float* vals, const size_t size);
+const char* simd_instruction_set();
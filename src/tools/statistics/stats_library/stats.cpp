@@ -6,35 +6,61 @@
 
 using namespace std;
 
+/**
+ * \brief Computes the number of valid values, the mean, the sum of squared deviations from the mean, the sum and the
+ * sum of squares of an array in a single pass, ignoring NaNs. Contiguous rows are given directly to the SIMD kernels,
+ * while the other rows are first gathered in a contiguous buffer. The kernels of floats widen each value to a double
+ * when it is loaded, so the moments of an array of floats are also accumulated in double precision.
+ */
+template <typename T>
+static NanMoments array_nan_moments(const BasicArray2D<T>& vals) {
+    NanMoments moments;
+    if (vals.is_contiguous()) {
+        return nan_moments(vals.data, vals.size());
+    }
+    if (vals.column_stride == 1) {
+        for (size_t y = 0; y < vals.height; ++y) {
+            moments.merge(nan_moments(vals.row(y), vals.width));
+        }
+        return moments;
+    }
+    vector<T> row_buffer(vals.width);
+    for (size_t y = 0; y < vals.height; ++y) {
+        for (size_t x = 0; x < vals.width; ++x) {
+            row_buffer[x] = vals(y, x);  // gather the row in a contiguous buffer
+        }
+        moments.merge(nan_moments(row_buffer.data(), vals.width));
+    }
+    return moments;
+}
+
+NanMoments nan_moments(const Array2D& vals) {
+    return array_nan_moments(vals);
+}
+
+NanMoments nan_moments(const FloatArray2D& vals) {
+    return array_nan_moments(vals);
+}
+
 /**
  * \brief Computes the mean of a vector.
  */
 double mean(const vector<double>& vals) {
-    double total = std::accumulate(vals.begin(), vals.end(), 0.0, [](double total, double val) {
-        return isnan(val) ? total : total + val;
-    });
-    int size = std::count_if(vals.begin(), vals.end(), [](double val) {
-        return !isnan(val);
-    });
-    return total / size;
-}
-
-/**
- * \brief Computes the mean of a vector_2d.
- */
-double mean(const vector_2d& vals) {
-    int size = 0;
-    double total = 0;
-    for (const auto& val_vector : vals) {
-        pair<double, int> result = accumulate(
-            val_vector.begin(), val_vector.end(), make_pair(0.0, 0), []
-            (pair<double, int> acc, double val)
-            {return isnan(val) ? acc : make_pair(acc.first + val, acc.second + 1);}
-        );
-        total += result.first;
-        size += result.second;
-    }
-    return total / size;
+    return nan_moments(vals.data(), vals.size()).mean;
+}
+
+/**
+ * \brief Computes the mean of an Array2D.
+ */
+double mean(const Array2D& vals) {
+    return nan_moments(vals).mean;
+}
+
+/**
+ * \brief Computes the mean of an array of floats, in double precision.
+ */
+double mean(const FloatArray2D& vals) {
+    return nan_moments(vals).mean;
 }
 
 /**
@@ -50,39 +76,31 @@ double sum(const std::vector<double>& vals) {
 }
 
 /**
- * \brief Computes the sum of a vector_2d.
+ * \brief Computes the sum of an Array2D.
  */
-double sum(const std::vector<std::vector<double>>& vals) {
-    double total = accumulate(
-        vals.begin(), vals.end(), 0.0,
-        [](double acc, const vector<double>& val_vector) {
-            double inner_result = accumulate(
-                val_vector.begin(), val_vector.end(), 0.0,
-                [](double inner_acc, double val)
-                {return isnan(val) ? inner_acc : inner_acc + val;}
-            );
-            return acc + inner_result;
-        }
-    );
-    return total;
+double sum(const Array2D& vals) {
+    return nan_moments(vals).sum;
 }
 
 /**
- * \brief Computes the sum of the squares of a vector_2d.
+ * \brief Computes the sum of an array of floats, in double precision.
  */
-double sum_of_squares(const vector_2d& vals) {
-    double total = accumulate(
-        vals.begin(), vals.end(), 0.0,
-        [](double acc, const vector<double>& val_vector) {
-            double inner_result = accumulate(
-                val_vector.begin(), val_vector.end(), 0.0,
-                [](double inner_acc, double val)
-                {return isnan(val) ? inner_acc : inner_acc + val * val;}
-            );
-            return acc + inner_result;
-        }
-    );
-    return total;
+double sum(const FloatArray2D& vals) {
+    return nan_moments(vals).sum;
+}
+
+/**
+ * \brief Computes the sum of the squares of an Array2D.
+ */
+double sum_of_squares(const Array2D& vals) {
+    return nan_moments(vals).sum_of_squares;
+}
+
+/**
+ * \brief Computes the sum of the squares of an array of floats, in double precision.
+ */
+double sum_of_squares(const FloatArray2D& vals) {
+    return nan_moments(vals).sum_of_squares;
 }
 
 /**
@@ -112,35 +130,24 @@ vector<double> log(const vector<double>& vals) {
  * \note The population variance is the one computed (the denominator is the population size N).
  */
 double variance(const vector<double>& vals) {
-    double mean_val = mean(vals);
-    pair<double, int> result = accumulate(
-        vals.begin(), vals.end(), make_pair(0.0, 0), [mean_val]
-        (pair<double, int> acc, double val)
-        {return isnan(val) ? acc : make_pair(acc.first + (val - mean_val) * (val - mean_val), acc.second + 1);}
-    );
-    return result.first / result.second;
+    return nan_moments(vals.data(), vals.size()).variance();
 }
 
 /**
- * \brief Computes the variance of a vector_2d.
+ * \brief Computes the variance of an Array2D in a single pass.
  * \note For the sake of performance, this function may only be used with real values and not complex ones.
  * \note The population variance is the one computed (the denominator is the population size N).
  */
-double variance(const vector_2d& vals) {
-    double mean_val = mean(vals);
-    pair<double, int> result = accumulate(
-        vals.begin(), vals.end(), make_pair(0.0, 0),
-        [mean_val](pair<double, int> acc, const vector<double>& val_vector) {
-            pair<double, int> inner_result = accumulate(
-                val_vector.begin(), val_vector.end(), make_pair(acc.first, acc.second), [mean_val]
-                (pair<double, int> inner_acc, double val)
-                {return isnan(val) ? inner_acc : make_pair(inner_acc.first + (val - mean_val) * (val - mean_val),
-                                                           inner_acc.second + 1);}
-            );
-            return make_pair(inner_result.first, inner_result.second);
-        }
-    );
-    return result.first / result.second;
+double variance(const Array2D& vals) {
+    return nan_moments(vals).variance();
+}
+
+/**
+ * \brief Computes the variance of an array of floats in a single pass, in double precision.
+ * \note The population variance is the one computed (the denominator is the population size N).
+ */
+double variance(const FloatArray2D& vals) {
+    return nan_moments(vals).variance();
 }
 
 /**
@@ -152,37 +159,49 @@ double standard_deviation(const vector<double>& vals) {
 }
 
 /**
- * \brief Counts the number of non nan elements in a vector_2d.
+ * \brief Counts the number of non nan elements in an Array2D.
  */
-int count_non_nan(const std::vector<std::vector<double>>& vals) {
-    int size = accumulate(
-        vals.begin(), vals.end(), 0,
-        [](int acc, const vector<double>& val_vector) {
-            int inner_result = accumulate(
-                val_vector.begin(), val_vector.end(), 0,
-                [](int inner_acc, double val)
-                {return isnan(val) ? inner_acc : inner_acc + 1;}
-            );
-            return acc + inner_result;
-        }
-    );
-    return size;
+int count_non_nan(const Array2D& vals) {
+    return nan_moments(vals).count;
+}
+
+/**
+ * \brief Counts the number of non nan elements in an array of floats.
+ */
+int count_non_nan(const FloatArray2D& vals) {
+    return nan_moments(vals).count;
 }
 
 /**
- * \brief Subtracts the mean value from a vector_2d.
+ * \brief Subtracts the mean value from an array. The mean is computed in double precision and each value is rounded
+ * back to the type of the array once.
  */
-void subtract_mean(vector_2d& input_array) {
-    const size_t height = input_array.size();
-    const size_t width = input_array[0].size();
-    double mean_value = mean(input_array);
+template <typename T>
+static void subtract_array_mean(BasicArray2D<T>& input_array) {
+    const size_t height = input_array.height;
+    const size_t width = input_array.width;
+    double mean_value = nan_moments(input_array).mean;
     #pragma omp parallel
     {
         #pragma omp for collapse(1) schedule(dynamic)
         for (size_t y = 0; y < height; y++) {
             for (size_t x = 0; x < width; x++) {
-                input_array[y][x] -= mean_value;
+                input_array(y, x) = (T)(input_array(y, x) - mean_value);
             }
         }
     }
 }
+
+/**
+ * \brief Subtracts the mean value from an Array2D.
+ */
+void subtract_mean(Array2D& input_array) {
+    subtract_array_mean(input_array);
+}
+
+/**
+ * \brief Subtracts the mean value from an array of floats.
+ */
+void subtract_mean(FloatArray2D& input_array) {
+    subtract_array_mean(input_array);
+}
@@ -1,14 +1,25 @@
+#pragma once
+
 #include "tools.h"
+#include "simd.h"
 
+NanMoments nan_moments(const Array2D& vals);
+NanMoments nan_moments(const FloatArray2D& vals);
 double mean(const std::vector<double>& vals);
-double mean(const vector_2d& vals);
+double mean(const Array2D& vals);
+double mean(const FloatArray2D& vals);
 double sum(const std::vector<double>& vals);
-double sum(const vector_2d& vals);
-double sum_of_squares(const vector_2d& vals);
+double sum(const Array2D& vals);
+double sum(const FloatArray2D& vals);
+double sum_of_squares(const Array2D& vals);
+double sum_of_squares(const FloatArray2D& vals);
 std::vector<double> pow(const std::vector<double>& vals, double exponent);
 std::vector<double> log(const std::vector<double>& vals);
 double variance(const std::vector<double>& vals);
-double variance(const vector_2d& vals);
+double variance(const Array2D& vals);
+double variance(const FloatArray2D& vals);
 double standard_deviation(const std::vector<double>& vals);
-int count_non_nan(const vector_2d& vals);
-void subtract_mean(vector_2d& input_array);
+int count_non_nan(const Array2D& vals);
+int count_non_nan(const FloatArray2D& vals);
+void subtract_mean(Array2D& input_array);
+void subtract_mean(FloatArray2D& input_array);
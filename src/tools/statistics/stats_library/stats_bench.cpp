@@ -0,0 +1,423 @@
+#include <benchmark/benchmark.h>
+#include <omp.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <random>
+#include <string>
+
+#include "vsf.h"
+
+using namespace std;
+
+// Benchmarks of the structure function, of the materialized pairs and their regrouping, and of the reductions of
+// stats.cpp, across map sizes, fractions of NaNs, orders and numbers of OpenMP threads. Before any benchmark, golden
+// checks compare the kernels with a brute-force reference and the program exits with an error if one differs, e.g.
+//     build/stats_bench --benchmark_filter=StructureFunction
+//     build/stats_bench --golden-only
+// The pair benchmarks report the pairs per second and the bytes of the two values read per pair, the others the bytes
+// of their input. The benchmarks run with more than one thread report their speedup over a single thread.
+
+static const double GOLDEN_TOLERANCE = 1e-9;
+
+/**
+ * \brief Creates a map of Gaussian values in which a fraction of the points, drawn at random, are NaN.
+ * \param nan_percent The percentage of NaN points.
+ */
+static Array2D random_map(const size_t height, const size_t width, const int nan_percent, const unsigned seed = 42) {
+    mt19937_64 generator(seed);
+    normal_distribution<double> values(0.0, 1.0);
+    uniform_int_distribution<int> percents(0, 99);
+    Array2D input_array(height, width);
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            input_array(y, x) = values(generator);
+            if (percents(generator) < nan_percent) input_array(y, x) = NAN;
+        }
+    }
+    return input_array;
+}
+
+/**
+ * \brief Gives the powers of two up to the number of threads of OpenMP, followed by that number if it is not one.
+ */
+static vector<int64_t> thread_counts() {
+    const int max_threads = omp_get_max_threads();
+    vector<int64_t> counts;
+    for (int threads = 1; threads < max_threads; threads *= 2) {
+        counts.push_back(threads);
+    }
+    counts.push_back(max_threads);
+    return counts;
+}
+
+/**
+ * \brief Runs the body of a benchmark with the given number of threads and reports the pairs (or values) processed
+ * per second, the bytes read per second and the speedup over the same benchmark run with a single thread. The single
+ * thread runs come first in the arguments, so their time is known when the others are reported.
+ * \param name The name of the benchmark, which identifies the runs that are compared along with the other arguments.
+ * \param state The state of the benchmark, whose last argument, at the index thread_argument, is the number of threads.
+ * \param items The number of pairs, or values, processed by each run of the body.
+ * \param items_name The name of the rate of the items, e.g. "pairs/s".
+ * \param bytes The number of bytes read by each run of the body.
+ * \param body Callable that runs the benchmarked kernel once.
+ */
+template <typename B>
+static void run_with_threads(const string& name, benchmark::State& state, const int thread_argument,
+                             const double items, const string& items_name, const double bytes, const B& body) {
+    static map<string, double> single_thread_seconds;
+    const int threads = (int)state.range(thread_argument);
+    const int previous_threads = omp_get_max_threads();
+    omp_set_num_threads(threads);
+
+    double seconds = 0;
+    for (auto _ : state) {
+        const auto start = chrono::steady_clock::now();
+        body();
+        seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    omp_set_num_threads(previous_threads);
+
+    string key = name;
+    for (int argument = 0; argument < thread_argument; ++argument) {
+        key += "/" + to_string(state.range(argument));
+    }
+    const double seconds_per_run = seconds / state.iterations();
+    if (threads == 1) single_thread_seconds[key] = seconds_per_run;
+    state.counters["threads"] = threads;
+    state.counters[items_name] = benchmark::Counter(items * state.iterations(), benchmark::Counter::kIsRate);
+    state.SetBytesProcessed((int64_t)(bytes * state.iterations()));
+    if (threads > 1 && single_thread_seconds.count(key) > 0) {
+        state.counters["speedup"] = single_thread_seconds[key] / seconds_per_run;
+    }
+}
+
+/**
+ * \brief Gives the number of pairs of valid points of an array, with no window.
+ */
+static double number_of_pairs(const Array2D& input_array) {
+    const double valid = count_non_nan(input_array);
+    return valid * (valid - 1) / 2;
+}
+
+static void BM_StructureFunction(benchmark::State& state) {
+    const size_t size = state.range(0);
+    const Array2D input_array = random_map(size, size, (int)state.range(1));
+    const int order = (int)state.range(2);
+    const double pairs = number_of_pairs(input_array);
+    run_with_threads("structure_function", state, 3, pairs, "pairs/s", 2 * sizeof(double) * pairs, [&]() {
+        benchmark::DoNotOptimize(structure_function(input_array, order));
+    });
+}
+
+static void BM_ApplyVectorMap(benchmark::State& state) {
+    const size_t size = state.range(0);
+    const Array2D input_array = random_map(size, size, (int)state.range(1));
+    const double pairs = number_of_pairs(input_array);
+    run_with_threads("subtract_pairs", state, 2, pairs, "pairs/s", 2 * sizeof(double) * pairs, [&]() {
+        benchmark::DoNotOptimize(subtract_pairs(input_array));
+    });
+}
+
+static void BM_RegroupDistanceThreadLocal(benchmark::State& state) {
+    const size_t size = state.range(0);
+    const vector<array<double, 2>> dists_and_vals = subtract_pairs(random_map(size, size, (int)state.range(1)));
+    const double pairs = dists_and_vals.size();
+    const double size_of_pairs = sizeof(array<double, 2>) * pairs;
+    run_with_threads("regroup_distance_thread_local", state, 2, pairs, "pairs/s", size_of_pairs, [&]() {
+        double_unordered_map regrouped_vals;
+        regroup_distance_thread_local(dists_and_vals, regrouped_vals);
+        benchmark::DoNotOptimize(regrouped_vals);
+    });
+}
+
+/**
+ * \brief Benchmarks one of the reductions of stats.cpp, which are the same for every number of threads but are run
+ * with each number so their scaling can be compared with the pair kernels.
+ */
+template <typename R>
+static void reduction_benchmark(const string& name, benchmark::State& state, const R& reduction) {
+    const size_t size = state.range(0);
+    const Array2D input_array = random_map(size, size, (int)state.range(1));
+    const double size_of_input = sizeof(double) * input_array.size();
+    run_with_threads(name, state, 2, (double)input_array.size(), "values/s", size_of_input, [&]() {
+        benchmark::DoNotOptimize(reduction(input_array));
+    });
+}
+
+static void BM_NanMoments(benchmark::State& state) {
+    reduction_benchmark("nan_moments", state, [](const Array2D& vals) {return nan_moments(vals);});
+}
+
+static void BM_Sum(benchmark::State& state) {
+    reduction_benchmark("sum", state, [](const Array2D& vals) {return sum(vals);});
+}
+
+static void BM_Variance(benchmark::State& state) {
+    reduction_benchmark("variance", state, [](const Array2D& vals) {return variance(vals);});
+}
+
+static void BM_CountNonNan(benchmark::State& state) {
+    reduction_benchmark("count_non_nan", state, [](const Array2D& vals) {return count_non_nan(vals);});
+}
+
+/**
+ * \brief Registers the benchmarks with the products of their arguments, the number of threads being always the last.
+ */
+static void register_benchmarks() {
+    const vector<int64_t> threads = thread_counts();
+    const vector<int64_t> nan_percents = {0, 25};
+    benchmark::RegisterBenchmark("BM_StructureFunction", BM_StructureFunction)
+        ->ArgNames({"size", "nan_percent", "order", "threads"})
+        ->ArgsProduct({{32, 64, 128}, nan_percents, {1, 2, 3}, threads})
+        ->UseRealTime()->Unit(benchmark::kMillisecond);
+    benchmark::RegisterBenchmark("BM_ApplyVectorMap", BM_ApplyVectorMap)
+        ->ArgNames({"size", "nan_percent", "threads"})
+        ->ArgsProduct({{32, 64}, nan_percents, threads})
+        ->UseRealTime()->Unit(benchmark::kMillisecond);
+    benchmark::RegisterBenchmark("BM_RegroupDistanceThreadLocal", BM_RegroupDistanceThreadLocal)
+        ->ArgNames({"size", "nan_percent", "threads"})
+        ->ArgsProduct({{32, 64}, nan_percents, threads})
+        ->UseRealTime()->Unit(benchmark::kMillisecond);
+    for (const auto& [name, function] : vector<pair<string, void (*)(benchmark::State&)>>{
+             {"BM_NanMoments", BM_NanMoments}, {"BM_Sum", BM_Sum}, {"BM_Variance", BM_Variance},
+             {"BM_CountNonNan", BM_CountNonNan}}) {
+        benchmark::RegisterBenchmark(name.c_str(), function)
+            ->ArgNames({"size", "nan_percent", "threads"})
+            ->ArgsProduct({{256, 1024, 4096}, nan_percents, threads})
+            ->UseRealTime()->Unit(benchmark::kMicrosecond);
+    }
+}
+
+/**
+ * \brief Enumerates every pair of valid points of an array with two nested loops, and gives the squared distance and
+ * the absolute difference of each pair whose distance is within the window. As in the materialized pairs, each point is
+ * also paired with itself when the window contains the zero distance.
+ */
+static vector<array<double, 2>> brute_force_pairs(const Array2D& input_array, const LagWindow& window) {
+    vector<array<double, 2>> pairs;
+    const size_t size = input_array.size();
+    for (size_t i = 0; i < size; ++i) {
+        const double a = input_array(i / input_array.width, i % input_array.width);
+        if (isnan(a)) continue;
+        for (size_t j = i; j < size; ++j) {
+            const double b = input_array(j / input_array.width, j % input_array.width);
+            if (isnan(b)) continue;
+            const double dy = (double)(j / input_array.width) - (double)(i / input_array.width);
+            const double dx = (double)(j % input_array.width) - (double)(i % input_array.width);
+            const double lag_squared = dx * dx + dy * dy;
+            if (window.contains((size_t)lag_squared)) pairs.push_back({lag_squared, abs(a - b)});
+        }
+    }
+    return pairs;
+}
+
+/**
+ * \brief Computes the structure function of an array from its brute-force pairs, in long double, with the rows of the
+ * non-zero distances that have more than one pair.
+ */
+static vector<array<double, 3>> brute_force_structure_function(const Array2D& input_array, const int order,
+                                                               const LagWindow& window) {
+    map<size_t, vector<long double>> regrouped_vals;
+    for (const auto& [lag_squared, difference] : brute_force_pairs(input_array, window)) {
+        regrouped_vals[(size_t)lag_squared].push_back(powl(difference, order));
+    }
+    vector<array<double, 3>> rows;
+    for (const auto& [lag_squared, vals] : regrouped_vals) {
+        if (lag_squared == 0 || vals.size() <= 1) continue;
+        long double mean = 0, m2 = 0;
+        for (long double val : vals) mean += val;
+        mean /= vals.size();
+        for (long double val : vals) m2 += (val - mean) * (val - mean);
+        const long double standard_error = sqrtl(m2 / vals.size()) / sqrtl(vals.size() - 1.0L);
+        rows.push_back({sqrt((double)lag_squared), (double)mean, (double)standard_error});
+    }
+    return rows;
+}
+
+static bool is_close(const double value, const double reference) {
+    return abs(value - reference) <= GOLDEN_TOLERANCE * max(1.0, abs(reference));
+}
+
+/**
+ * \brief Prints the result of a golden check and gives whether it passed.
+ */
+static bool report_check(const string& name, const bool passed, const string& details = "") {
+    printf("golden %-68s %s%s\n", name.c_str(), passed ? "ok" : "FAILED ", details.c_str());
+    return passed;
+}
+
+static bool check_structure_function(const Array2D& input_array, const int order, const bool streaming,
+                                     const LagWindow& window, const string& name) {
+    const vector<array<double, 3>> reference = brute_force_structure_function(input_array, order, window);
+    const Array2D output = structure_function(input_array, order, streaming, window);
+    if (output.height != reference.size() || output.width != 3) {
+        return report_check(name, false, "with " + to_string(output.height) + " rows instead of "
+                                         + to_string(reference.size()));
+    }
+    for (size_t row = 0; row < reference.size(); ++row) {
+        for (size_t column = 0; column < 3; ++column) {
+            if (!is_close(output(row, column), reference[row][column])) {
+                return report_check(name, false, "at row " + to_string(row) + ", column " + to_string(column) + ": "
+                                                 + to_string(output(row, column)) + " instead of "
+                                                 + to_string(reference[row][column]));
+            }
+        }
+    }
+    return report_check(name, true);
+}
+
+/**
+ * \brief Checks that a window whose bounds are lags returned by the structure function, i.e. square roots of squared
+ * distances, keeps these lags, and that the structure function of the window has the rows of these squared distances.
+ */
+static bool check_window_bounds(const Array2D& input_array, const string& name) {
+    for (size_t lag_squared = 0; lag_squared <= max_lag_squared(input_array.height, input_array.width);
+         ++lag_squared) {
+        const LagWindow window(sqrt((double)lag_squared), sqrt((double)lag_squared));
+        if (window.lower_lag_squared != lag_squared || window.upper_lag_squared != lag_squared) {
+            return report_check(name, false, "with the window [" + to_string(window.lower_lag_squared) + ", "
+                                             + to_string(window.upper_lag_squared) + "] of the squared distance "
+                                             + to_string(lag_squared));
+        }
+    }
+    LagWindow reference_window;  // the squared distances of the window, without rounding
+    reference_window.lower_lag_squared = 2;
+    reference_window.upper_lag_squared = 13;
+    const vector<array<double, 3>> reference = brute_force_structure_function(input_array, 2, reference_window);
+    const Array2D output = structure_function(input_array, 2, true, LagWindow(sqrt(2.0), sqrt(13.0)));
+    bool passed = output.height == reference.size();
+    for (size_t row = 0; passed && row < reference.size(); ++row) {
+        passed = is_close(output(row, 0), reference[row][0]) && is_close(output(row, 1), reference[row][1]);
+    }
+    return report_check(name, passed, passed ? "" : "with " + to_string(output.height) + " rows instead of "
+                                                  + to_string(reference.size()));
+}
+
+static bool check_pairs(const Array2D& input_array, const LagWindow& window, const string& name) {
+    vector<array<double, 2>> reference = brute_force_pairs(input_array, window);
+    vector<array<double, 2>> pairs = subtract_pairs(input_array, window);
+    sort(reference.begin(), reference.end());
+    sort(pairs.begin(), pairs.end());
+    if (pairs != reference) {
+        return report_check(name, false, "with " + to_string(pairs.size()) + " pairs instead of "
+                                         + to_string(reference.size()));
+    }
+    return report_check(name, true);
+}
+
+static bool check_regroup(const Array2D& input_array, const string& name) {
+    const vector<array<double, 2>> pairs = brute_force_pairs(input_array, LagWindow());
+    map<double, vector<double>> reference;
+    for (const auto& [lag_squared, val] : pairs) {
+        reference[lag_squared].push_back(val);
+    }
+    double_unordered_map regrouped_vals;
+    regroup_distance_thread_local(pairs, regrouped_vals);
+    bool passed = regrouped_vals.size() == reference.size();
+    for (auto& [lag_squared, vals] : reference) {
+        if (!passed) break;
+        auto regrouped = regrouped_vals.find(lag_squared);
+        if (regrouped == regrouped_vals.end()) {
+            passed = false;
+            break;
+        }
+        vector<double> sorted_vals = regrouped->second;
+        sort(sorted_vals.begin(), sorted_vals.end());
+        sort(vals.begin(), vals.end());
+        passed = sorted_vals == vals;
+    }
+    return report_check(name, passed);
+}
+
+static bool check_reductions(const Array2D& input_array, const string& name) {
+    long double total = 0, total_of_squares = 0;
+    size_t count = 0;
+    for (size_t y = 0; y < input_array.height; ++y) {
+        for (size_t x = 0; x < input_array.width; ++x) {
+            if (isnan(input_array(y, x))) continue;
+            total += input_array(y, x);
+            total_of_squares += (long double)input_array(y, x) * input_array(y, x);
+            ++count;
+        }
+    }
+    const long double reference_mean = total / count;
+    long double m2 = 0;
+    for (size_t y = 0; y < input_array.height; ++y) {
+        for (size_t x = 0; x < input_array.width; ++x) {
+            if (isnan(input_array(y, x))) continue;
+            m2 += (input_array(y, x) - reference_mean) * (input_array(y, x) - reference_mean);
+        }
+    }
+    const NanMoments moments = nan_moments(input_array);
+    const bool passed = moments.count == count && (size_t)count_non_nan(input_array) == count
+                        && is_close(moments.mean, (double)reference_mean)
+                        && is_close(mean(input_array), (double)reference_mean)
+                        && is_close(sum(input_array), (double)total)
+                        && is_close(sum_of_squares(input_array), (double)total_of_squares)
+                        && is_close(variance(input_array), (double)(m2 / count));
+    return report_check(name, passed);
+}
+
+/**
+ * \brief Compares the kernels with the brute-force reference on small maps whose width and height differ, with one
+ * thread and with every thread.
+ * \return Whether every check passed.
+ */
+static bool run_golden_checks() {
+    bool passed = true;
+    const int max_threads = omp_get_max_threads();
+    for (const int threads : {1, max_threads}) {
+        omp_set_num_threads(threads);
+        for (const int nan_percent : {0, 30}) {
+            const Array2D input_array = random_map(17, 23, nan_percent, 7 + nan_percent);
+            const string suffix = " (" + to_string(nan_percent) + "% NaN, " + to_string(threads) + " threads)";
+            for (const int order : {1, 2, 3}) {
+                for (const bool streaming : {true, false}) {
+                    passed &= check_structure_function(input_array, order, streaming, LagWindow(),
+                                                       string(streaming ? "streaming" : "materialized")
+                                                       + " structure_function, order " + to_string(order) + suffix);
+                }
+            }
+            passed &= check_structure_function(input_array, 2, true, LagWindow(2, 6),
+                                               "structure_function, window [2, 6]" + suffix);
+            passed &= check_window_bounds(input_array, "structure_function, window [sqrt(2), sqrt(13)]" + suffix);
+            passed &= check_pairs(input_array, LagWindow(), "subtract_pairs" + suffix);
+            passed &= check_pairs(input_array, LagWindow(1.5, 5), "subtract_pairs, window [1.5, 5]" + suffix);
+            passed &= check_regroup(input_array, "regroup_distance_thread_local" + suffix);
+            passed &= check_reductions(input_array, "stats.cpp reductions" + suffix);
+        }
+    }
+    omp_set_num_threads(max_threads);
+    return passed;
+}
+
+int main(int argc, char** argv) {
+    // The option of the golden checks is removed before the remaining ones are given to Google Benchmark
+    bool golden_only = false;
+    int remaining_argc = 0;
+    for (int k = 0; k < argc; ++k) {
+        if (strcmp(argv[k], "--golden-only") == 0) {
+            golden_only = true;
+        } else {
+            argv[remaining_argc++] = argv[k];
+        }
+    }
+    argc = remaining_argc;
+
+    if (!run_golden_checks()) {
+        fprintf(stderr, "stats_bench: the kernels differ from the brute-force reference.\n");
+        return 1;
+    }
+    if (golden_only) return 0;
+
+    register_benchmarks();
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,151 @@
+#include <mpi.h>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "distributed.h"
+
+using namespace std;
+
+// Computes the structure function of a two-dimensional array with its pairs split across the ranks of an MPI job,
+// each rank using its OpenMP threads. The input and the output are NumPy .npy files, e.g.
+//     mpiexec -n 8 ./stats_mpi map.npy structure.npy 1 --max-lag 200 --bins-per-decade 10
+// writes the (n_lags, 3) array of the lag, the first order structure function and its uncertainty. Running one rank
+// per node with OMP_NUM_THREADS set to the number of cores of a node keeps the blocks sent to each node few.
+
+static const char NPY_MAGIC[] = "\x93NUMPY";
+
+/**
+ * \brief Reads a two-dimensional array of little-endian doubles in C order from a .npy file.
+ */
+static Array2D read_npy(const string& path) {
+    ifstream file(path, ios::binary);
+    if (!file) {
+        throw invalid_argument("Could not open " + path + ".");
+    }
+    char magic[6];
+    uint8_t version[2];
+    file.read(magic, 6);
+    file.read(reinterpret_cast<char*>(version), 2);
+    if (!file || memcmp(magic, NPY_MAGIC, 6) != 0) {
+        throw invalid_argument(path + " is not a .npy file.");
+    }
+    uint32_t header_size = 0;
+    uint8_t size_bytes[4] = {0, 0, 0, 0};
+    file.read(reinterpret_cast<char*>(size_bytes), (version[0] == 1) ? 2 : 4);
+    for (int k = 3; k >= 0; --k) {
+        header_size = (header_size << 8) | size_bytes[k];
+    }
+    string header(header_size, ' ');
+    file.read(&header[0], header_size);
+    if (header.find("'descr': '<f8'") == string::npos || header.find("'fortran_order': False") == string::npos) {
+        throw invalid_argument(path + " must hold float64 values in C order, got the header " + header + ".");
+    }
+    size_t shape_begin = header.find("'shape': (");
+    size_t height = 0, width = 0;
+    if (shape_begin == string::npos
+        || sscanf(header.c_str() + shape_begin, "'shape': (%zu, %zu)", &height, &width) != 2) {
+        throw invalid_argument(path + " must hold a two-dimensional array, got the header " + header + ".");
+    }
+    Array2D input_array(height, width);
+    file.read(reinterpret_cast<char*>(input_array.data), input_array.size() * sizeof(double));
+    if (!file) {
+        throw invalid_argument(path + " is shorter than its (" + to_string(height) + ", " + to_string(width)
+                               + ") shape.");
+    }
+    return input_array;
+}
+
+/**
+ * \brief Writes a two-dimensional array in a .npy file of version 1.0, whose header is padded to 64 bytes.
+ */
+static void write_npy(const string& path, const Array2D& output_array) {
+    string header = "{'descr': '<f8', 'fortran_order': False, 'shape': (" + to_string(output_array.height) + ", "
+                    + to_string(output_array.width) + "), }";
+    header.append(63 - (10 + header.size()) % 64, ' ');
+    header += '\n';
+    ofstream file(path, ios::binary);
+    const uint8_t version[2] = {1, 0};
+    const uint8_t size_bytes[2] = {(uint8_t)(header.size() & 0xff), (uint8_t)(header.size() >> 8)};
+    file.write(NPY_MAGIC, 6);
+    file.write(reinterpret_cast<const char*>(version), 2);
+    file.write(reinterpret_cast<const char*>(size_bytes), 2);
+    file.write(header.data(), header.size());
+    for (size_t y = 0; y < output_array.height; ++y) {
+        for (size_t x = 0; x < output_array.width; ++x) {
+            const double val = output_array(y, x);
+            file.write(reinterpret_cast<const char*>(&val), sizeof(double));
+        }
+    }
+    if (!file) {
+        throw invalid_argument("Could not write " + path + ".");
+    }
+}
+
+int main(int argc, char** argv) {
+    MPI_Init(&argc, &argv);
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    try {
+        if (argc < 4) {
+            throw invalid_argument(string("Usage: ") + argv[0] + " input.npy output.npy order [--min-lag L] "
+                                   "[--max-lag L] [--bin-width W] [--bins-per-decade N] [--block-height H]");
+        }
+        const string input_path = argv[1];
+        const string output_path = argv[2];
+        const int order = stoi(argv[3]);
+        double min_lag = 0, max_lag = INFINITY, bin_width = 0;
+        int bins_per_decade = 0;
+        size_t block_height = 64;
+        for (int k = 4; k < argc; ++k) {
+            const string option = argv[k];
+            if (k + 1 == argc) {
+                throw invalid_argument("The option " + option + " requires a value.");
+            }
+            const string value = argv[++k];
+            if (option == "--min-lag") {
+                min_lag = stod(value);
+            } else if (option == "--max-lag") {
+                max_lag = stod(value);
+            } else if (option == "--bin-width") {
+                bin_width = stod(value);
+            } else if (option == "--bins-per-decade") {
+                bins_per_decade = stoi(value);
+            } else if (option == "--block-height") {
+                block_height = stoul(value);
+            } else {
+                throw invalid_argument("Unknown option " + option + ".");
+            }
+        }
+        if (bin_width > 0 && bins_per_decade > 0) {
+            throw invalid_argument("Only one of --bin-width and --bins-per-decade can be given.");
+        }
+        LagBinning binning;
+        if (bin_width > 0) binning = LagBinning::linear(bin_width);
+        if (bins_per_decade > 0) binning = LagBinning::logarithmic(bins_per_decade);
+
+        // Only the root reads the array, and the other ranks build the plan from its shape
+        Array2D input_array;
+        uint64_t shape[2] = {0, 0};
+        if (rank == 0) {
+            input_array = read_npy(input_path);
+            shape[0] = input_array.height;
+            shape[1] = input_array.width;
+        }
+        MPI_Bcast(shape, 2, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+        StructureFunctionPlan plan(shape[0], shape[1], LagWindow(min_lag, max_lag), binning);
+
+        Array2D output = distributed_structure_function(plan, input_array, order, block_height, MPI_COMM_WORLD);
+        if (rank == 0) write_npy(output_path, output);
+    } catch (const exception& error) {
+        cerr << "stats_mpi (rank " << rank << "): " << error.what() << endl;
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_Finalize();
+    return 0;
+}
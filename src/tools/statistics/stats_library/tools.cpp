@@ -1,9 +1,164 @@
 #include <omp.h>
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <string>
 
 #include "tools.h"
+#include "stats.h"
+#include "profiling.h"
+#include "run_control.h"
 
 using namespace std;
 
+// Number of pair tiles given to each thread, so the dynamic schedule can balance the work between them
+const size_t TILES_PER_THREAD = 8;
+// Number of second points of a tile that are copied together, which keeps them in the L1 cache (16 KiB)
+const size_t CACHE_TILE_SIZE = 2048;
+
+// Fraction of valid points under which the pairs of an array are enumerated over its compacted valid points instead of
+// its whole grid
+const double ACTIVE_FRACTION_THRESHOLD = 0.5;
+
+/**
+ * \brief Gives the largest squared distance that can separate two points of an array with the given shape.
+ */
+size_t max_lag_squared(const size_t height, const size_t width) {
+    return (height - 1) * (height - 1) + (width - 1) * (width - 1);
+}
+
+/**
+ * \brief Creates the window of the pairs whose distance lies between min_lag and max_lag, inclusively.
+ * \note The squared bounds are rounded, so they are corrected by comparing the distances of the squared distances
+ * around them with the bounds. The distance of a squared distance k is sqrt(k), as in the outputs, so a lag that was
+ * returned can be given back as a bound and is kept, e.g. min_lag=sqrt(2) whose square is slightly above 2.
+ * \param min_lag The smallest distance of the pairs to consider.
+ * \param max_lag The largest distance of the pairs to consider. INFINITY does not limit the distances.
+ */
+LagWindow::LagWindow(const double min_lag, const double max_lag) {
+    if (!(min_lag >= 0) || !(max_lag >= min_lag)) {
+        throw invalid_argument("The lags must satisfy 0 <= min_lag <= max_lag, got min_lag=" + to_string(min_lag)
+                               + " and max_lag=" + to_string(max_lag) + ".");
+    }
+    lower_lag_squared = ceil(min_lag * min_lag);
+    while (lower_lag_squared > 0 && sqrt((double)(lower_lag_squared - 1)) >= min_lag) {
+        lower_lag_squared--;
+    }
+    while (sqrt((double)lower_lag_squared) < min_lag) {
+        lower_lag_squared++;
+    }
+    if (max_lag * max_lag < (double)SIZE_MAX) {
+        upper_lag_squared = floor(max_lag * max_lag);
+        while (sqrt((double)(upper_lag_squared + 1)) <= max_lag) {
+            upper_lag_squared++;
+        }
+        while (upper_lag_squared > 0 && sqrt((double)upper_lag_squared) > max_lag) {
+            upper_lag_squared--;
+        }
+    }
+}
+
+/**
+ * \brief Gives the largest difference of coordinates that a pair of the window can have along an axis of the given
+ * size.
+ */
+size_t LagWindow::max_offset(const size_t size) const {
+    if (size == 0) return 0;
+    size_t offset = min((double)(size - 1), floor(sqrt((double)upper_lag_squared)));
+    while (offset * offset > upper_lag_squared) {  // correct the rounding of the square root
+        offset--;
+    }
+    return offset;
+}
+
+/**
+ * \brief Gives linear bins of the given width, starting at zero.
+ */
+LagBinning LagBinning::linear(const double width) {
+    if (!(width > 0)) {
+        throw invalid_argument("The bin width must be positive, got width=" + to_string(width) + ".");
+    }
+    LagBinning binning;
+    binning.kind = Kind::linear;
+    binning.width = width;
+    return binning;
+}
+
+/**
+ * \brief Gives logarithmic bins, with the given number of bins between each power of ten and starting at a distance
+ * of one.
+ */
+LagBinning LagBinning::logarithmic(const int bins_per_decade) {
+    if (bins_per_decade <= 0) {
+        throw invalid_argument("The number of bins per decade must be positive, got bins_per_decade="
+                               + to_string(bins_per_decade) + ".");
+    }
+    LagBinning binning;
+    binning.kind = Kind::logarithmic;
+    binning.bins_per_decade = bins_per_decade;
+    return binning;
+}
+
+/**
+ * \brief Gives the bins delimited by the given edges, which must be non-negative and strictly increasing. The pairs
+ * whose distance is outside of [bin_edges.front(), bin_edges.back()) are ignored.
+ */
+LagBinning LagBinning::from_edges(const vector<double>& bin_edges) {
+    if (bin_edges.size() < 2) {
+        throw invalid_argument("At least two bin edges must be given, got " + to_string(bin_edges.size()) + ".");
+    }
+    if (!(bin_edges.front() >= 0) || adjacent_find(bin_edges.begin(), bin_edges.end(), greater_equal<double>())
+                                     != bin_edges.end()) {
+        throw invalid_argument("The bin edges must be non-negative and strictly increasing.");
+    }
+    LagBinning binning;
+    binning.kind = Kind::edges;
+    binning.bin_edges = bin_edges;
+    return binning;
+}
+
+/**
+ * \brief Gives the edges of the bins that cover the distances up to max_lag. This is empty for the exact binning.
+ */
+vector<double> LagBinning::edges(const double max_lag) const {
+    vector<double> edges;
+    switch (kind) {
+        case Kind::exact:
+            break;
+        case Kind::linear:
+            for (size_t k = 0; edges.empty() || edges.back() <= max_lag; ++k) {
+                edges.push_back(k * width);
+            }
+            break;
+        case Kind::logarithmic:
+            for (int k = 0; edges.empty() || edges.back() <= max_lag; ++k) {
+                edges.push_back(pow(10.0, (double)k / bins_per_decade));
+            }
+            break;
+        case Kind::edges:
+            edges = bin_edges;
+            break;
+    }
+    return edges;
+}
+
+/**
+ * \brief Computes the bin of every squared distance up to max_lag_squared.
+ */
+LagBinLookup::LagBinLookup(const LagBinning& binning, const size_t max_lag_squared) {
+    const vector<double> edges = binning.edges(sqrt((double)max_lag_squared));
+    number_of_bins = max(edges.size(), (size_t)1) - 1;
+    bins.assign(max_lag_squared + 1, NO_BIN);
+    lags.resize(max_lag_squared + 1);
+    for (size_t lag_squared = 0; lag_squared <= max_lag_squared; ++lag_squared) {
+        lags[lag_squared] = sqrt((double)lag_squared);
+        if (lag_squared == 0) continue;  // reject zero distances
+        size_t upper_edge = upper_bound(edges.begin(), edges.end(), lags[lag_squared]) - edges.begin();
+        if (upper_edge == 0 || upper_edge == edges.size()) continue;
+        bins[lag_squared] = upper_edge - 1;
+    }
+}
+
 /**
  * \brief Regroups a vector of distance and value pairs into an unordered map containing each unique distance as key and
  * a vector of corresponding values.
@@ -17,14 +172,18 @@ void regroup_distance_thread_local(
     // Create thread-local storage for the unordered_map
     vector<double_unordered_map> local_regroup_vals(omp_get_max_threads());
 
-    #pragma omp parallel for
-    for (size_t i = 0; i < single_dists_and_vals_1d.size(); ++i) {
-        int thread_id = omp_get_thread_num();
-        const auto& dist_and_val = single_dists_and_vals_1d[i];
-        local_regroup_vals[thread_id][dist_and_val[0]].push_back(dist_and_val[1]);
+    {
+        PROFILE_PHASE("regroup");
+        #pragma omp parallel for
+        for (size_t i = 0; i < single_dists_and_vals_1d.size(); ++i) {
+            int thread_id = omp_get_thread_num();
+            const auto& dist_and_val = single_dists_and_vals_1d[i];
+            local_regroup_vals[thread_id][dist_and_val[0]].push_back(dist_and_val[1]);
+        }
     }
 
     // Merge results from all threads into the final unordered_map
+    PROFILE_PHASE("regroup_merge");
     for (const auto& local_map : local_regroup_vals) {
         for (const auto& pair : local_map) {
             regrouped_vals[pair.first].insert(regrouped_vals[pair.first].end(),
@@ -46,14 +205,18 @@ void regroup_distance_thread_local(
     // Create thread-local storage for the unordered_map
     vector<array_unordered_map> local_regroup_vals(omp_get_max_threads());
 
-    #pragma omp parallel for
-    for (size_t i = 0; i < single_dists_and_vals_2d.size(); ++i) {
-        int thread_id = omp_get_thread_num();
-        const auto& dist_and_val = single_dists_and_vals_2d[i];
-        local_regroup_vals[thread_id][{dist_and_val[0], dist_and_val[1]}].push_back(dist_and_val[2]);
+    {
+        PROFILE_PHASE("regroup");
+        #pragma omp parallel for
+        for (size_t i = 0; i < single_dists_and_vals_2d.size(); ++i) {
+            int thread_id = omp_get_thread_num();
+            const auto& dist_and_val = single_dists_and_vals_2d[i];
+            local_regroup_vals[thread_id][{dist_and_val[0], dist_and_val[1]}].push_back(dist_and_val[2]);
+        }
     }
 
     // Merge results from all threads into the final unordered_map
+    PROFILE_PHASE("regroup_merge");
     for (const auto& local_map : local_regroup_vals) {
         for (const auto& pair : local_map) {
             regrouped_vals[pair.first].insert(regrouped_vals[pair.first].end(),
@@ -62,12 +225,103 @@ void regroup_distance_thread_local(
     }
 }
 
+/**
+ * \brief Regroups a vector of squared distance and value pairs into contiguous bins, one for each squared distance that
+ * is present. As the squared distances on a pixel grid are exact integers, they are used directly as indices in a
+ * counting sort instead of hashing floating-point keys.
+ * \param lags_squared_and_vals The vector of (squared distance, value) pairs to regroup.
+ * \param max_lag_squared The largest squared distance that can be found in lags_squared_and_vals.
+ * \param regrouped_vals The flattened bins in which to store the regrouped values, sorted by squared distance.
+ */
+void regroup_lag_squared_thread_local(
+    const vector<array<double, 2>>& lags_squared_and_vals,
+    const size_t max_lag_squared,
+    FlatBins& regrouped_vals
+) {
+    PROFILE_PHASE("regroup");
+    const size_t table_size = max_lag_squared + 1;
+    const size_t number_of_pairs = lags_squared_and_vals.size();
+    // Each thread always handles the same contiguous chunk of pairs so the counts stay valid for the scattering pass
+    vector<vector<size_t>> local_positions(omp_get_max_threads());
+    vector<size_t> chunk_limits;
+
+    #pragma omp parallel
+    {
+        const int thread_id = omp_get_thread_num();
+        const int number_of_threads = omp_get_num_threads();
+        #pragma omp single
+        {
+            chunk_limits.resize(number_of_threads + 1);
+            for (int t = 0; t <= number_of_threads; ++t) {
+                chunk_limits[t] = (number_of_pairs * t) / number_of_threads;
+            }
+        }
+
+        // Count the number of values of each squared distance
+        vector<size_t>& thread_positions = local_positions[thread_id];
+        thread_positions.assign(table_size, 0);
+        for (size_t i = chunk_limits[thread_id]; i < chunk_limits[thread_id + 1]; ++i) {
+            thread_positions[(size_t)lags_squared_and_vals[i][0]]++;
+        }
+        #pragma omp barrier
+
+        // Convert the counts into the position at which each thread writes its values
+        #pragma omp single
+        {
+            regrouped_vals.keys.clear();
+            regrouped_vals.offsets.assign(1, 0);
+            regrouped_vals.values.resize(number_of_pairs);
+            size_t position = 0;
+            for (size_t lag_squared = 0; lag_squared < table_size; ++lag_squared) {
+                size_t bin_start = position;
+                for (int t = 0; t < number_of_threads; ++t) {
+                    size_t count = local_positions[t][lag_squared];
+                    local_positions[t][lag_squared] = position;
+                    position += count;
+                }
+                if (position == bin_start) continue;  // no pair at this squared distance
+                regrouped_vals.keys.push_back(lag_squared);
+                regrouped_vals.offsets.push_back(position);
+            }
+        }
+
+        // Scatter the values in their bins
+        for (size_t i = chunk_limits[thread_id]; i < chunk_limits[thread_id + 1]; ++i) {
+            const auto& lag_squared_and_val = lags_squared_and_vals[i];
+            regrouped_vals.values[thread_positions[(size_t)lag_squared_and_val[0]]++] = lag_squared_and_val[1];
+        }
+    }
+}
+
+/**
+ * \brief Converts an unordered map of regrouped values into contiguous bins sorted by key.
+ * \param regrouped_vals The unordered map containing each unique key and its vector of corresponding values.
+ * \return The flattened bins.
+ */
+FlatBins flatten_bins(const double_unordered_map& regrouped_vals) {
+    FlatBins flat_bins;
+    flat_bins.keys.reserve(regrouped_vals.size());
+    for (const auto& pair : regrouped_vals) {
+        flat_bins.keys.push_back(pair.first);
+    }
+    sort(flat_bins.keys.begin(), flat_bins.keys.end());
+
+    flat_bins.offsets.reserve(regrouped_vals.size() + 1);
+    for (double key : flat_bins.keys) {
+        const vector<double>& vals = regrouped_vals.at(key);
+        flat_bins.values.insert(flat_bins.values.end(), vals.begin(), vals.end());
+        flat_bins.offsets.push_back(flat_bins.values.size());
+    }
+    return flat_bins;
+}
+
 /**
  * \brief Appends the contents of one vector of arrays of two values to another.
  * \param dest The destination vector to which data will be appended.
  * \param src The source vector from which data will be taken.
  */
 void combine_vectors(vector<array<double,2>>& dest, const vector<array<double,2>>& src) {
+    PROFILE_PHASE("combine_vectors");  // includes the wait for the other threads
     #pragma omp critical
     dest.insert(dest.end(), src.begin(), src.end());
 }
@@ -78,67 +332,1542 @@ void combine_vectors(vector<array<double,2>>& dest, const vector<array<double,2>
  * \param src The source vector from which data will be taken.
  */
 void combine_vectors(vector<array<double,3>>& dest, const vector<array<double,3>>& src) {
+    PROFILE_PHASE("combine_vectors");
     #pragma omp critical
     dest.insert(dest.end(), src.begin(), src.end());
 }
 
 /**
- * \brief Applies an operation between each values of a vector_2d and computes the corresponding distance between each
- * pair of points.
- * \param input_array The vector_2d on which the function must be applied for every pair of points.
+ * \brief Splits the pairs (p, q) with q >= p of a set of points into tiles of similar work, the points being numbered
+ * in row-major order. The points are cut in blocks of consecutive indices and each tile pairs a first block with a
+ * second block that does not come before it, so the tiles cover the upper triangle of the pair space. The off-diagonal
+ * tiles all have the same number of pairs and are given first, followed by the diagonal tiles that have about half as
+ * many, which lets a dynamic schedule over the tiles end with the shortest ones.
+ * \param number_of_points The number of points whose pairs must be enumerated.
+ * \param number_of_threads The number of threads among which the tiles are shared.
+ */
+vector<PairTile> triangular_pair_tiles(const size_t number_of_points, const size_t number_of_threads) {
+    // Enough tiles are made for each thread to get several of them, which evens out the remaining imbalance
+    const size_t number_of_tiles = TILES_PER_THREAD * max(number_of_threads, (size_t)1);
+    size_t number_of_blocks = ceil(sqrt(2.0 * number_of_tiles));
+    number_of_blocks = max(min(number_of_blocks, number_of_points), (size_t)1);
+
+    auto block_begin = [&](size_t block) {return block * number_of_points / number_of_blocks;};
+    vector<PairTile> tiles;
+    tiles.reserve(number_of_blocks * (number_of_blocks + 1) / 2);
+    for (size_t first = 0; first < number_of_blocks; ++first) {
+        for (size_t second = first + 1; second < number_of_blocks; ++second) {
+            tiles.push_back({block_begin(first), block_begin(first + 1), block_begin(second), block_begin(second + 1)});
+        }
+    }
+    for (size_t block = 0; block < number_of_blocks; ++block) {
+        tiles.push_back({block_begin(block), block_begin(block + 1), block_begin(block), block_begin(block + 1)});
+    }
+    return tiles;
+}
+
+/**
+ * \brief Splits the pairs (p, q) with p <= q <= p + max_index_offset of a set of points into tiles of similar work, the
+ * points being numbered in row-major order. The first points are cut in blocks of consecutive indices, each of them
+ * being paired with the band of points that follows it, so the pairs that are too far apart are never visited.
+ * \param number_of_points The number of points whose pairs must be enumerated.
+ * \param max_index_offset The largest difference of row-major indices of the pairs to enumerate.
+ * \param number_of_threads The number of threads among which the tiles are shared.
+ */
+vector<PairTile> banded_pair_tiles(
+    const size_t number_of_points,
+    const size_t max_index_offset,
+    const size_t number_of_threads
+) {
+    const size_t number_of_tiles = TILES_PER_THREAD * max(number_of_threads, (size_t)1);
+    const size_t block_size = max((number_of_points + number_of_tiles - 1) / number_of_tiles, (size_t)1);
+
+    vector<PairTile> tiles;
+    for (size_t first_begin = 0; first_begin < number_of_points; first_begin += block_size) {
+        size_t first_end = min(first_begin + block_size, number_of_points);
+        size_t second_end = min(first_end + max_index_offset, number_of_points);
+        tiles.push_back({first_begin, first_end, first_begin, second_end});
+    }
+    return tiles;
+}
+
+/**
+ * \brief Gives the pair tiles of an array in which the pairs of the window can be found. Only the band of points close
+ * enough to each point is tiled when the window is small compared to the array.
+ */
+static vector<PairTile> window_pair_tiles(const size_t height, const size_t width, const LagWindow& window) {
+    const size_t number_of_points = height * width;
+    const size_t max_index_offset = window.max_offset(height) * width + window.max_offset(width);
+    if (max_index_offset + 1 >= number_of_points) {
+        return triangular_pair_tiles(number_of_points, omp_get_max_threads());
+    }
+    return banded_pair_tiles(number_of_points, max_index_offset + 1, omp_get_max_threads());
+}
+
+/**
+ * \brief Precomputes the pair geometry of the arrays of the given shape.
+ */
+StructureFunctionPlan::StructureFunctionPlan(const size_t height, const size_t width, const LagWindow& window,
+                                             const LagBinning& binning)
+    : height(height), width(width), window(window), binning(binning),
+      lookup(binning, binning.is_exact() ? 0 : min(max_lag_squared(height, width), window.upper_lag_squared)),
+      tiles(window_pair_tiles(height, width, window)) {
+    number_of_bins = binning.is_exact() ? min(max_lag_squared(height, width), window.upper_lag_squared) + 1
+                                        : lookup.number_of_bins;
+}
+
+/**
+ * \brief Gives the edges of the bins of the plan, or no edges if each exact distance has its own bin.
+ */
+vector<double> StructureFunctionPlan::bin_edges() const {
+    if (binning.is_exact()) return {};
+    return binning.edges(sqrt((double)(lookup.bins.size() - 1)));
+}
+
+/**
+ * \brief Calls a function for every pair of valid points of a tile. A pair made of a point with itself is included,
+ * as the zero lag is rejected later on. The second points are copied by chunks that fit in the cache, and each first
+ * point is paired with the chunk one row segment at a time: the pair values of a segment are first evaluated together,
+ * which the compiler vectorizes over the columns, and the squared distances are then updated incrementally along the
+ * segment.
+ * \param input_array The array whose points are paired.
+ * \param tile The ranges of row-major indices of the first and second points of the pairs.
+ * \param window The range of distances of the pairs to visit.
+ * \param evaluate Callable of the values of the two points of a pair that gives the pair value. It must not branch on
+ * its arguments for the segments to be vectorized.
+ * \param visit Callable of the row-major index of the first point of a pair, of its squared distance, of the offset
+ * (dy, dx) from its first point to its second point and of its value.
+ */
+template <typename T, typename E, typename V>
+static void visit_tile_pairs(
+    const BasicArray2D<T>& input_array,
+    const PairTile& tile,
+    const LagWindow& window,
+    const E& evaluate,
+    const V& visit
+) {
+    const size_t width = input_array.width;
+    const size_t max_dy = window.max_offset(input_array.height);
+    const size_t max_dx = window.max_offset(width);
+    vector<T> second_vals(min(CACHE_TILE_SIZE, tile.second_end - tile.second_begin));
+    vector<double> pair_vals(second_vals.size());
+
+    for (size_t chunk_begin = tile.second_begin; chunk_begin < tile.second_end; chunk_begin += CACHE_TILE_SIZE) {
+        const size_t chunk_end = min(chunk_begin + CACHE_TILE_SIZE, tile.second_end);
+        for (size_t q = chunk_begin; q < chunk_end; ++q) {
+            second_vals[q - chunk_begin] = input_array(q / width, q % width);
+        }
+
+        // Only the pairs (p, q) with q >= p are visited, so the first points stop at the end of the chunk
+        for (size_t p = tile.first_begin; p < min(tile.first_end, chunk_end); ++p) {
+            const size_t y = p / width;
+            const size_t x = p % width;
+            const double val = input_array(y, x);
+            if (isnan(val)) continue;
+
+            // The rows and columns farther than the window are skipped
+            const size_t second_begin = max(p, chunk_begin);  // lag=0 is considered here
+            const size_t column_begin = (x > max_dx) ? x - max_dx : 0;
+            const size_t column_end = min(x + max_dx + 1, width);
+            for (size_t j = second_begin / width; j * width < chunk_end && j <= y + max_dy; ++j) {
+                const size_t row_begin = max(max(second_begin, j * width) - j * width, column_begin);
+                const size_t row_end = min(min(chunk_end, (j + 1) * width) - j * width, column_end);
+                if (row_begin >= row_end) continue;
+                const size_t segment_size = row_end - row_begin;
+                const T* segment_vals = &second_vals[j * width + row_begin - chunk_begin];
+
+                #pragma omp simd
+                for (size_t k = 0; k < segment_size; ++k) {
+                    pair_vals[k] = evaluate(val, segment_vals[k]);
+                }
+
+                // (dx + 1)^2 = dx^2 + 2 dx + 1, so the squared distance is updated without multiplications
+                ptrdiff_t dx = (ptrdiff_t)row_begin - (ptrdiff_t)x;
+                ptrdiff_t dy = (ptrdiff_t)j - (ptrdiff_t)y;
+                size_t lag_squared = dx * dx + dy * dy;
+                for (size_t k = 0; k < segment_size; ++k, ++dx) {
+                    if (!isnan(segment_vals[k]) && window.contains(lag_squared)) {
+                        visit(p, lag_squared, dy, dx, pair_vals[k]);
+                    }
+                    lag_squared += 2 * dx + 1;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * \brief Compacts the valid points of an array, whose number is obtained first so the storage is allocated once.
+ */
+template <typename T>
+ActivePixels<T>::ActivePixels(const BasicArray2D<T>& input_array)
+    : height(input_array.height), width(input_array.width) {
+    const size_t number_of_active_pixels = count_non_nan(input_array);
+    ys.reserve(number_of_active_pixels);
+    xs.reserve(number_of_active_pixels);
+    vals.reserve(number_of_active_pixels);
+    row_starts.reserve(height + 1);
+    for (size_t y = 0; y < height; ++y) {
+        row_starts.push_back(vals.size());
+        for (size_t x = 0; x < width; ++x) {
+            T val = input_array(y, x);
+            if (isnan(val)) continue;
+            ys.push_back(y);
+            xs.push_back(x);
+            vals.push_back(val);
+        }
+    }
+    row_starts.push_back(vals.size());
+}
+
+template struct ActivePixels<double>;
+template struct ActivePixels<float>;
+
+/**
+ * \brief Gives the pair tiles of the compacted valid points of an array in which the pairs of the window can be found.
+ * The pairs of a point are in the band of the points that follow it up to the last row of the window.
+ */
+template <typename T>
+static vector<PairTile> active_pair_tiles(const ActivePixels<T>& active_pixels, const LagWindow& window) {
+    const size_t number_of_points = active_pixels.size();
+    const size_t max_dy = window.max_offset(active_pixels.height);
+    size_t max_index_offset = 0;
+    for (size_t p = 0; p < number_of_points; ++p) {
+        size_t band_end = active_pixels.row_starts[min(active_pixels.ys[p] + max_dy + 1, active_pixels.height)];
+        max_index_offset = max(max_index_offset, band_end - p - 1);
+    }
+    if (max_index_offset + 1 >= number_of_points) {
+        return triangular_pair_tiles(number_of_points, omp_get_max_threads());
+    }
+    return banded_pair_tiles(number_of_points, max_index_offset + 1, omp_get_max_threads());
+}
+
+/**
+ * \brief Calls a function for every pair of a tile of the compacted valid points of an array, as visit_tile_pairs does
+ * on the grid. The points are already contiguous, so each first point is paired with the row segments of the chunk of
+ * second points that lie in the window, whose pair values and squared distances are evaluated together.
+ * \param active_pixels The compacted valid points whose pairs are visited.
+ * \param tile The ranges of compacted indices of the first and second points of the pairs.
+ * \param window The range of distances of the pairs to visit.
+ * \param evaluate Callable of the values of the two points of a pair that gives the pair value.
+ * \param visit Callable of the row-major index of the first point of a pair, of its squared distance, of the offset
+ * (dy, dx) from its first point to its second point and of its value.
+ */
+template <typename T, typename E, typename V>
+static void visit_active_tile_pairs(
+    const ActivePixels<T>& active_pixels,
+    const PairTile& tile,
+    const LagWindow& window,
+    const E& evaluate,
+    const V& visit
+) {
+    const int32_t* ys = active_pixels.ys.data();
+    const int32_t* xs = active_pixels.xs.data();
+    const T* vals = active_pixels.vals.data();
+    const size_t max_dy = window.max_offset(active_pixels.height);
+    const size_t max_dx = window.max_offset(active_pixels.width);
+    const bool clip_columns = max_dx + 1 < active_pixels.width;
+    vector<double> pair_vals(min(CACHE_TILE_SIZE, tile.second_end - tile.second_begin));
+    vector<size_t> lags_squared(pair_vals.size());
+
+    for (size_t chunk_begin = tile.second_begin; chunk_begin < tile.second_end; chunk_begin += CACHE_TILE_SIZE) {
+        const size_t chunk_end = min(chunk_begin + CACHE_TILE_SIZE, tile.second_end);
+
+        // Only the pairs (p, q) with q >= p are visited, so the first points stop at the end of the chunk
+        for (size_t p = tile.first_begin; p < min(tile.first_end, chunk_end); ++p) {
+            const ptrdiff_t y = ys[p];
+            const ptrdiff_t x = xs[p];
+            const size_t first = y * active_pixels.width + x;
+            const double val = vals[p];
+            auto visit_segment = [&](const size_t segment_begin, const size_t segment_end) {
+                const size_t segment_size = segment_end - segment_begin;
+                #pragma omp simd
+                for (size_t k = 0; k < segment_size; ++k) {
+                    pair_vals[k] = evaluate(val, vals[segment_begin + k]);
+                    ptrdiff_t dx = xs[segment_begin + k] - x;
+                    ptrdiff_t dy = ys[segment_begin + k] - y;
+                    lags_squared[k] = dx * dx + dy * dy;
+                }
+                for (size_t k = 0; k < segment_size; ++k) {
+                    if (window.contains(lags_squared[k])) {
+                        visit(first, lags_squared[k], ys[segment_begin + k] - y, xs[segment_begin + k] - x,
+                              pair_vals[k]);
+                    }
+                }
+            };
+
+            // The rows farther than the window are skipped, and so are the columns when the window is narrow
+            const size_t band_end = active_pixels.row_starts[min((size_t)y + max_dy + 1, active_pixels.height)];
+            const size_t second_begin = max(p, chunk_begin);  // lag=0 is considered here
+            const size_t second_end = min(chunk_end, band_end);
+            if (second_begin >= second_end) continue;
+            if (!clip_columns) {
+                visit_segment(second_begin, second_end);
+                continue;
+            }
+            for (size_t j = ys[second_begin]; j <= (size_t)ys[second_end - 1]; ++j) {
+                const int32_t* row_begin = xs + max(active_pixels.row_starts[j], second_begin);
+                const int32_t* row_end = xs + min(active_pixels.row_starts[j + 1], second_end);
+                const int32_t* segment_begin = lower_bound(row_begin, row_end, x - (ptrdiff_t)max_dx);
+                const int32_t* segment_end = upper_bound(segment_begin, row_end, x + (ptrdiff_t)max_dx);
+                if (segment_begin < segment_end) visit_segment(segment_begin - xs, segment_end - xs);
+            }
+        }
+    }
+}
+
+/**
+ * \struct PairSource
+ * \brief Points of an array whose pairs are enumerated. The pairs of an array with many NaNs are enumerated over its
+ * compacted valid points, so their cost scales with the square of the number of valid points instead of the square of
+ * the size of the grid. The other arrays are paired directly on their grid.
+ * \tparam T The type of the values of the array.
+ */
+template <typename T>
+struct PairSource
+{
+    const BasicArray2D<T>* input_array;
+    bool is_compact;
+    ActivePixels<T> active_pixels;
+    vector<PairTile> active_tiles;
+
+    PairSource(const BasicArray2D<T>& input_array, const LagWindow& window)
+        : input_array(&input_array),
+          is_compact(count_non_nan(input_array) < ACTIVE_FRACTION_THRESHOLD * input_array.size()) {
+        if (!is_compact) return;
+        active_pixels = ActivePixels<T>(input_array);
+        active_tiles = active_pair_tiles(active_pixels, window);
+    }
+
+    /**
+     * \brief Gives the tiles to visit, which are the given grid tiles unless the points are compacted.
+     */
+    const vector<PairTile>& tiles(const vector<PairTile>& grid_tiles) const
+    {
+        return is_compact ? active_tiles : grid_tiles;
+    }
+
+    template <typename E, typename V>
+    void visit(const PairTile& tile, const LagWindow& window, const E& evaluate, const V& visit) const
+    {
+        if (is_compact) {
+            visit_active_tile_pairs(active_pixels, tile, window, evaluate, visit);
+        } else {
+            visit_tile_pairs(*input_array, tile, window, evaluate, visit);
+        }
+    }
+};
+
+/**
+ * \brief Gives an upper bound of the number of pairs of valid points of an array whose distance lies in the window.
+ */
+size_t max_number_of_pairs(const Array2D& input_array, const LagWindow& window) {
+    size_t number_of_active_pixels = count_non_nan(input_array);
+    size_t max_pairs_per_point = (window.max_offset(input_array.height) + 1)
+                                 * (2 * window.max_offset(input_array.width) + 1);
+    return min(number_of_active_pixels * (number_of_active_pixels + 1) / 2,
+               number_of_active_pixels * max_pairs_per_point);
+}
+
+/**
+ * \brief Applies an operation between each values of an array and computes the corresponding squared distance
+ * between each pair of points.
+ * \param input_array The array on which the function must be applied for every pair of points.
  * \param function Callable of two doubles that returns a float. This function is applied to each pair of elements
  * in the input_array.
- * \return Vector of arrays of two elements: the distance between the two points and the result of the function.
+ * \param window The range of distances of the pairs to consider.
+ * \return Vector of arrays of two elements: the squared distance between the two points and the result of the function.
+ * The squared distance is an exact integer and may be used directly as a key.
+ * \note The progress, cancellation and memory budget of the RunControl of the calling thread are followed. The pairs
+ * are reserved for at once, so a runtime_error is thrown before allocating them if they would not fit in the budget.
  */
 template <typename T>
-vector<array<double, 2>> apply_vector_map(const vector_2d& input_array, const T& function) {
-    const size_t height = input_array.size();
-    const size_t width = input_array[0].size();
+vector<array<double, 2>> apply_vector_map(const Array2D& input_array, const T& function, const LagWindow& window) {
+    const size_t height = input_array.height;
+    const size_t width = input_array.width;
     vector<array<double, 2>> single_dists_and_vals;
 
-    size_t max_possible_size = (height * width * (height * width)) / 2;
+    const PairSource<double> source(input_array, window);
+    const vector<PairTile> grid_tiles = source.is_compact ? vector<PairTile>()
+                                                          : window_pair_tiles(height, width, window);
+    const vector<PairTile>& tiles = source.tiles(grid_tiles);
+    size_t max_possible_size = max_number_of_pairs(input_array, window);
+
+    // The thread-local vectors and the combined one hold every pair at once
+    const RunControl* control = current_run_control();
+    const size_t pair_bytes = 2 * max_possible_size * sizeof(array<double, 2>);
+    if (control != nullptr && control->has_budget() && pair_bytes > control->max_memory_bytes) {
+        throw runtime_error("The pairs need up to " + to_string(pair_bytes) + " bytes, more than the memory budget of "
+                            + to_string(control->max_memory_bytes) + " bytes.");
+    }
+    RunMonitor monitor(control, tiles.size());
+
+    {
+        PROFILE_PHASE("pair_enumeration");  // the combine_vectors phase of each thread is nested in it
+        #pragma omp parallel
+        {
+            vector<array<double, 2>> thread_single_dists_and_vals;
+            // Reserve an approximate size to avoid multiple allocations
+            thread_single_dists_and_vals.reserve(max_possible_size / omp_get_num_threads());
+            PROFILE_ALLOCATION(thread_single_dists_and_vals.capacity() * sizeof(array<double, 2>));
+
+            #pragma omp for schedule(dynamic)
+            for (size_t t = 0; t < tiles.size(); ++t) {
+                if (monitor.stopped()) continue;
+                PROFILE_THREAD_WORK();
+                source.visit(tiles[t], window, function, [&](size_t, size_t lag_squared, ptrdiff_t, ptrdiff_t,
+                                                             double val) {
+                    thread_single_dists_and_vals.push_back({(double)lag_squared, val});
+                });
+                monitor.job_done();
+            }
+
+            // Combine the thread-local results into the global vector
+            combine_vectors(single_dists_and_vals, thread_single_dists_and_vals);
+        }
+    }
+
+    monitor.finish();
+
+    // Optionally shrink to fit if memory usage is a concern
+    single_dists_and_vals.shrink_to_fit();
+    PROFILE_PAIRS(single_dists_and_vals.size());
+
+    return single_dists_and_vals;
+}
+
+/**
+ * \brief Computes the product between each pair of elements in the input array, along with their squared
+ * distances.
+ */
+vector<array<double, 2>> multiply_pairs(const Array2D& input_array, const LagWindow& window) {
+    return apply_vector_map(input_array, [](double a, double b) {return a * b;}, window);
+}
+
+/**
+ * \brief Computes the absolute difference between each pair of elements in the input array, along with their squared
+ * distances.
+ */
+vector<array<double, 2>> subtract_pairs(const Array2D& input_array, const LagWindow& window) {
+    return apply_vector_map(input_array, [](double a, double b) {return abs(a - b);}, window);
+}
+
+/**
+ * \brief Gives the number of threads of a parallel region that can each keep their own table of thread_bytes bytes, on
+ * top of the shared_bytes of the shared tables, within a memory budget.
+ * \param max_memory_bytes The memory budget, or 0 for no budget.
+ * \throws runtime_error If the shared tables and a single thread table do not fit in the budget.
+ */
+static int budgeted_threads(const size_t max_memory_bytes, const size_t shared_bytes, const size_t thread_bytes) {
+    const int max_threads = omp_get_max_threads();
+    if (max_memory_bytes == 0) return max_threads;
+    if (shared_bytes + thread_bytes > max_memory_bytes) {
+        throw runtime_error("The accumulator tables need at least " + to_string(shared_bytes + thread_bytes)
+                            + " bytes, more than the memory budget of " + to_string(max_memory_bytes) + " bytes.");
+    }
+    if (thread_bytes == 0) return max_threads;
+    return (int)min((max_memory_bytes - shared_bytes) / thread_bytes, (size_t)max_threads);
+}
+
+#ifdef STATS_LIBRARY_PROFILING
+/**
+ * \brief Gives the number of pairs accumulated in a table whose squared distances have values_per_lag accumulators.
+ */
+static size_t accumulated_pairs(const lag_squared_accumulator_table& accumulated_vals, const size_t values_per_lag) {
+    size_t pairs = 0;
+    for (size_t index = 0; index < accumulated_vals.size(); index += values_per_lag) {
+        pairs += accumulated_vals[index].count;
+    }
+    return pairs;
+}
+#endif
+
+/**
+ * \brief Enumerates every pair of valid points of several arrays and lets a function accumulate them in the
+ * accumulators of their squared distance, each array having its own table. Each squared distance has values_per_lag
+ * consecutive accumulators, so several quantities can be accumulated in a single pass over the pairs. The pair
+ * geometry (tiles and bin lookup) is taken from the plan, and the threads share the (array, tile) jobs of every array
+ * at once. Each thread fills its own table for the array it is working on and merges it in the table of that array
+ * when it moves on to the next one.
+ * \param plan The pair geometry of the arrays, along with the window and the binning of the pairs. Unless the binning
+ * is exact, the tables are indexed by bin instead of squared distance, each pair finding its bin in the lookup table of
+ * the plan. The tables then only have a few accumulators, which stay in the cache of each thread.
+ * \param input_arrays The arrays whose pairs of points must be accumulated. They must have the shape of the plan.
+ * \param values_per_lag The number of accumulators of each squared distance.
+ * \param evaluate Callable of the values of the two points of a pair that gives the pair value.
+ * \param accumulate Callable of a pair value and of a pointer to the first accumulator of its squared distance.
+ * \param accumulated_vals The tables in which to accumulate the values, one for each array. The accumulators of the
+ * squared distance r^2 start at the index r^2 * values_per_lag. They are resized to fit every bin of the plan.
+ * \param lag_sums The vectors that receive the sum of the distances of the pairs of each bin of each array, if they
+ * are given and the binning is not exact.
+ * \note The progress and cancellation of the RunControl of the calling thread are followed tile by tile, and its
+ * memory budget limits the number of threads, each of which keeps its own table.
+ */
+template <typename T, typename E, typename A>
+static void accumulate_pairs_of_arrays(
+    const StructureFunctionPlan& plan,
+    const vector<BasicArray2D<T>>& input_arrays,
+    const size_t values_per_lag,
+    const E& evaluate,
+    const A& accumulate,
+    vector<lag_squared_accumulator_table>& accumulated_vals,
+    vector<vector<double>>* lag_sums
+) {
+    const LagWindow& window = plan.window;
+    const LagBinLookup& lookup = plan.lookup;
+    const vector<PairTile>& tiles = plan.tiles;
+    const bool is_exact = plan.binning.is_exact();
+    const size_t number_of_arrays = input_arrays.size();
+    for (const BasicArray2D<T>& input_array : input_arrays) {
+        if (input_array.height != plan.height || input_array.width != plan.width) {
+            throw invalid_argument("Every array must have the shape of the plan, got (" + to_string(input_array.height)
+                                   + ", " + to_string(input_array.width) + ") instead of (" + to_string(plan.height)
+                                   + ", " + to_string(plan.width) + ").");
+        }
+    }
+
+    const size_t number_of_bins = plan.number_of_bins;
+    const size_t table_size = number_of_bins * values_per_lag;
+    accumulated_vals.assign(number_of_arrays, lag_squared_accumulator_table(table_size));
+    if (lag_sums != nullptr) lag_sums->assign(is_exact ? 0 : number_of_arrays, vector<double>(number_of_bins, 0));
+
+    // The jobs of each array are its tiles, which differ from the tiles of the plan when its points are compacted
+    vector<PairSource<T>> sources;
+    sources.reserve(number_of_arrays);
+    vector<size_t> job_starts(1, 0);
+    for (const BasicArray2D<T>& input_array : input_arrays) {
+        sources.emplace_back(input_array, window);
+        job_starts.push_back(job_starts.back() + sources.back().tiles(tiles).size());
+    }
+    const size_t number_of_jobs = job_starts.back();
+    if (number_of_jobs == 0) return;
+
+    const RunControl* control = current_run_control();
+    const size_t thread_bytes = table_size * sizeof(MomentAccumulator<>) + (is_exact ? 0 : number_of_bins)
+                                * sizeof(double);
+    const int number_of_threads = budgeted_threads(control != nullptr ? control->max_memory_bytes : 0,
+                                                   number_of_arrays * thread_bytes, thread_bytes);
+    RunMonitor monitor(control, number_of_jobs);
+
+    {
+        PROFILE_PHASE("pair_enumeration");  // the accumulator_merge phase of each thread is nested in it
+        PROFILE_ALLOCATION(number_of_arrays * table_size * sizeof(MomentAccumulator<>));
+        #pragma omp parallel num_threads(number_of_threads)
+        {
+            // Create thread-local storage for the accumulators of the array being worked on
+            lag_squared_accumulator_table thread_accumulated_vals(table_size);
+            vector<double> thread_lag_sums(is_exact ? 0 : number_of_bins, 0);
+            size_t current_array = number_of_arrays;
+            PROFILE_ALLOCATION(table_size * sizeof(MomentAccumulator<>));
+
+            // Merge the thread-local results in the tables of their array and start over
+            auto flush = [&]() {
+                if (current_array == number_of_arrays) return;
+                PROFILE_PHASE("accumulator_merge");  // includes the wait for the other threads
+                PROFILE_PAIRS(accumulated_pairs(thread_accumulated_vals, values_per_lag));
+                #pragma omp critical
+                {
+                    lag_squared_accumulator_table& array_accumulated_vals = accumulated_vals[current_array];
+                    for (size_t index = 0; index < table_size; ++index) {
+                        array_accumulated_vals[index].merge(thread_accumulated_vals[index]);
+                    }
+                    if (lag_sums != nullptr && !is_exact) {
+                        vector<double>& array_lag_sums = (*lag_sums)[current_array];
+                        for (size_t bin = 0; bin < number_of_bins; ++bin) {
+                            array_lag_sums[bin] += thread_lag_sums[bin];
+                        }
+                    }
+                }
+                thread_accumulated_vals.assign(table_size, MomentAccumulator<>());
+                fill(thread_lag_sums.begin(), thread_lag_sums.end(), 0);
+            };
+
+            #pragma omp for schedule(dynamic)
+            for (size_t job = 0; job < number_of_jobs; ++job) {
+                if (monitor.stopped()) continue;
+                const size_t array_index = upper_bound(job_starts.begin(), job_starts.end(), job) - job_starts.begin()
+                                           - 1;
+                if (array_index != current_array) {
+                    flush();
+                    current_array = array_index;
+                }
+                PROFILE_THREAD_WORK();
+                const PairSource<T>& source = sources[array_index];
+                const PairTile& tile = source.tiles(tiles)[job - job_starts[array_index]];
+                if (is_exact) {
+                    source.visit(tile, window, evaluate, [&](size_t, size_t lag_squared, ptrdiff_t, ptrdiff_t,
+                                                             double val) {
+                        accumulate(val, &thread_accumulated_vals[lag_squared * values_per_lag]);
+                    });
+                } else {
+                    source.visit(tile, window, evaluate, [&](size_t, size_t lag_squared, ptrdiff_t, ptrdiff_t,
+                                                             double val) {
+                        uint32_t bin = lookup.bins[lag_squared];
+                        if (bin == LagBinLookup::NO_BIN) return;
+                        thread_lag_sums[bin] += lookup.lags[lag_squared];
+                        accumulate(val, &thread_accumulated_vals[bin * values_per_lag]);
+                    });
+                }
+                monitor.job_done();
+            }
+            flush();
+        }
+    }
+    monitor.finish();
+}
+
+/**
+ * \brief Keeps the accumulated values of the single array given to accumulate_pairs_of_arrays.
+ */
+static void keep_single_array(vector<lag_squared_accumulator_table>& tables, vector<vector<double>>& sums,
+                              lag_squared_accumulator_table& accumulated_vals, vector<double>* lag_sums) {
+    accumulated_vals = move(tables[0]);
+    if (lag_sums != nullptr && !sums.empty()) *lag_sums = move(sums[0]);
+}
+
+/**
+ * \brief Enumerates every pair of valid points of an array and lets a function accumulate them in the accumulators of
+ * their squared distance. This is accumulate_pairs_of_arrays for a single array, with a plan made for it.
+ * \param accumulated_vals The table in which to accumulate the values. The accumulators of the squared distance r^2
+ * start at the index r^2 * values_per_lag. It is resized to fit every possible squared distance of the input_array.
+ * \param lag_sums The vector that receives the sum of the distances of the pairs of each bin, if it is given and the
+ * binning is not exact.
+ */
+template <typename E, typename A>
+static void accumulate_pairs(
+    const Array2D& input_array,
+    const size_t values_per_lag,
+    const E& evaluate,
+    const A& accumulate,
+    lag_squared_accumulator_table& accumulated_vals,
+    const LagWindow& window,
+    const LagBinning& binning,
+    vector<double>* lag_sums
+) {
+    vector<lag_squared_accumulator_table> tables;
+    vector<vector<double>> sums;
+    accumulate_pairs_of_arrays(StructureFunctionPlan(input_array.height, input_array.width, window, binning),
+                               vector<Array2D>{input_array}, values_per_lag, evaluate, accumulate, tables, &sums);
+    keep_single_array(tables, sums, accumulated_vals, lag_sums);
+}
+
+/**
+ * \brief Applies an operation between each values of an array and accumulates the results according to the squared
+ * distance between each pair of points. Contrary to apply_vector_map, the individual pair values are never stored, so
+ * the memory usage only scales with the number of possible distances.
+ * \param input_array The array on which the function must be applied for every pair of points.
+ * \param function Callable of two doubles that returns a float. This function is applied to each pair of elements
+ * in the input_array.
+ * \param accumulated_vals The table indexed by squared distance in which to accumulate the values. It is resized to
+ * fit every possible squared distance of the input_array.
+ * \param window The range of distances of the pairs to accumulate.
+ * \param binning The bins in which to regroup the pairs. Unless the binning is exact, the table is indexed by bin.
+ * \param lag_sums The vector that receives the sum of the distances of the pairs of each bin, if it is given and the
+ * binning is not exact.
+ */
+template <typename T>
+void accumulate_vector_map(
+    const Array2D& input_array,
+    const T& function,
+    lag_squared_accumulator_table& accumulated_vals,
+    const LagWindow& window,
+    const LagBinning& binning,
+    vector<double>* lag_sums
+) {
+    accumulate_pairs(input_array, 1, function, [](double val, MomentAccumulator<>* accumulators) {
+        accumulators->add(val);
+    }, accumulated_vals, window, binning, lag_sums);
+}
+
+/**
+ * \brief Accumulates the absolute difference between each pair of elements in the input array, raised to the given
+ * order, according to their squared distances.
+ */
+void accumulate_subtracted_pairs(
+    const Array2D& input_array,
+    const int order,
+    lag_squared_accumulator_table& accumulated_vals,
+    const LagWindow& window,
+    const LagBinning& binning,
+    vector<double>* lag_sums
+) {
+    if (order == 1) {
+        accumulate_vector_map(input_array, [](double a, double b) {return abs(a - b);}, accumulated_vals, window,
+                              binning, lag_sums);
+    } else if (order == 2) {
+        accumulate_vector_map(input_array, [](double a, double b) {return (a - b) * (a - b);}, accumulated_vals,
+                              window, binning, lag_sums);
+    } else {
+        accumulate_vector_map(input_array, [order](double a, double b) {return pow(abs(a - b), order);},
+                              accumulated_vals, window, binning, lag_sums);
+    }
+}
+
+/**
+ * \brief Accumulates the absolute difference between each pair of elements of each of several arrays, raised to the
+ * given order, according to their squared distances. The arrays share the pair geometry of the plan and are processed
+ * by the threads together, which suits the slices of a cube or a series of maps of the same shape.
+ * \param plan The pair geometry of the arrays, along with the window and the binning of the pairs. Unless the binning
+ * is exact, the tables are indexed by bin.
+ * \param input_arrays The arrays for which to accumulate the pairs. They must have the shape of the plan.
+ * \param order The order to which the differences are raised.
+ * \param accumulated_vals The tables in which to accumulate the values, one for each array.
+ * \param lag_sums The vectors that receive the sum of the distances of the pairs of each bin of each array, if they
+ * are given and the binning is not exact.
+ * \tparam T The type of the values of the arrays, the pairs being accumulated in double precision either way.
+ */
+template <typename T>
+static void accumulate_subtracted_pairs_of_arrays(
+    const StructureFunctionPlan& plan,
+    const vector<BasicArray2D<T>>& input_arrays,
+    const int order,
+    vector<lag_squared_accumulator_table>& accumulated_vals,
+    vector<vector<double>>* lag_sums
+) {
+    auto add = [](double val, MomentAccumulator<>* accumulators) {accumulators->add(val);};
+    if (order == 1) {
+        accumulate_pairs_of_arrays(plan, input_arrays, 1, [](double a, double b) {return abs(a - b);}, add,
+                                   accumulated_vals, lag_sums);
+    } else if (order == 2) {
+        accumulate_pairs_of_arrays(plan, input_arrays, 1, [](double a, double b) {return (a - b) * (a - b);}, add,
+                                   accumulated_vals, lag_sums);
+    } else {
+        accumulate_pairs_of_arrays(plan, input_arrays, 1, [order](double a, double b) {return pow(abs(a - b), order);},
+                                   add, accumulated_vals, lag_sums);
+    }
+}
+
+/**
+ * \brief Accumulates the pairs of double precision arrays with accumulate_subtracted_pairs_of_arrays.
+ */
+void accumulate_subtracted_pairs(
+    const StructureFunctionPlan& plan,
+    const vector<Array2D>& input_arrays,
+    const int order,
+    vector<lag_squared_accumulator_table>& accumulated_vals,
+    vector<vector<double>>* lag_sums
+) {
+    accumulate_subtracted_pairs_of_arrays(plan, input_arrays, order, accumulated_vals, lag_sums);
+}
+
+/**
+ * \brief Accumulates the pairs of single precision arrays as the double precision overload does. The values are kept
+ * in single precision, which halves the memory traffic of the chunks of second points, but each difference is taken in
+ * double precision once its two values are converted, and the accumulators are the same double precision ones.
+ */
+void accumulate_subtracted_pairs(
+    const StructureFunctionPlan& plan,
+    const vector<FloatArray2D>& input_arrays,
+    const int order,
+    vector<lag_squared_accumulator_table>& accumulated_vals,
+    vector<vector<double>>* lag_sums
+) {
+    accumulate_subtracted_pairs_of_arrays(plan, input_arrays, order, accumulated_vals, lag_sums);
+}
+
+/**
+ * \brief Accumulates the product between each pair of elements of each of several arrays according to their squared
+ * distances, with the pair geometry of the plan.
+ * \param plan The pair geometry of the arrays, along with the window and the binning of the pairs. Unless the binning
+ * is exact, the tables are indexed by bin.
+ * \param input_arrays The arrays for which to accumulate the pairs. They must have the shape of the plan.
+ * \param accumulated_vals The tables in which to accumulate the values, one for each array.
+ * \param lag_sums The vectors that receive the sum of the distances of the pairs of each bin of each array, if they
+ * are given and the binning is not exact.
+ */
+void accumulate_multiplied_pairs(
+    const StructureFunctionPlan& plan,
+    const vector<Array2D>& input_arrays,
+    vector<lag_squared_accumulator_table>& accumulated_vals,
+    vector<vector<double>>* lag_sums
+) {
+    accumulate_pairs_of_arrays(plan, input_arrays, 1, [](double a, double b) {return a * b;},
+                               [](double val, MomentAccumulator<>* accumulators) {accumulators->add(val);},
+                               accumulated_vals, lag_sums);
+}
+
+/**
+ * \brief Gives the region of every point of the label image, the regions being numbered in the order of their labels.
+ */
+RegionLabels::RegionLabels(const size_t height, const size_t width, const vector<int64_t>& label_image,
+                           const bool cross_regions)
+    : height(height), width(width), cross_regions(cross_regions), regions(label_image.size(), NO_REGION) {
+    if (label_image.size() != height * width) {
+        throw invalid_argument("The label image must have " + to_string(height * width) + " labels, got "
+                               + to_string(label_image.size()) + ".");
+    }
+    for (const int64_t label : label_image) {
+        if (label >= 0) labels.push_back(label);
+    }
+    sort(labels.begin(), labels.end());
+    labels.erase(unique(labels.begin(), labels.end()), labels.end());
+    for (size_t p = 0; p < label_image.size(); ++p) {
+        if (label_image[p] < 0) continue;
+        regions[p] = lower_bound(labels.begin(), labels.end(), label_image[p]) - labels.begin();
+    }
+}
+
+size_t RegionLabels::number_of_tables() const {
+    const size_t number_of_regions = labels.size();
+    return cross_regions ? number_of_regions * (number_of_regions + 1) / 2 : number_of_regions;
+}
+
+/**
+ * \brief Gives the labels (a, b) of the regions of the points of the pairs accumulated in each table, which are (a, a)
+ * for the table of a single region.
+ */
+vector<array<int64_t, 2>> RegionLabels::table_labels() const {
+    vector<array<int64_t, 2>> labels_of_tables;
+    for (const int64_t label : labels) {
+        labels_of_tables.push_back({label, label});
+    }
+    if (!cross_regions) return labels_of_tables;
+    for (size_t low = 0; low < labels.size(); ++low) {
+        for (size_t high = low + 1; high < labels.size(); ++high) {
+            labels_of_tables.push_back({labels[low], labels[high]});
+        }
+    }
+    return labels_of_tables;
+}
+
+/**
+ * \brief Enumerates every pair of valid points of an array in a single pass and accumulates each pair in the table of
+ * the regions of its points. The points that belong to no region are made NaN beforehand, so they are skipped by the
+ * pair enumeration and an array with small regions is compacted. Each thread fills its own tables, which are merged
+ * at the end, so the number of threads is limited by the memory budget of the RunControl installed on the calling
+ * thread, if there is one, whose progress and cancellation are also followed tile by tile.
+ * \param plan The pair geometry of the array, along with the window and the binning of the pairs. Unless the binning
+ * is exact, the tables are indexed by bin.
+ * \param input_array The array whose pairs of points must be accumulated. It must have the shape of the plan.
+ * \param regions The regions of the points of the array. They must have the shape of the plan.
+ * \param evaluate Callable of the values of the two points of a pair that gives the pair value.
+ * \param accumulated_vals The tables in which to accumulate the values, in the order of the tables of the regions.
+ * \param lag_sums The vectors that receive the sum of the distances of the pairs of each bin of each table, if they
+ * are given and the binning is not exact.
+ * \throws invalid_argument If the shared tables and those of a single thread do not fit in the memory budget.
+ * \throws RunCancelled If the computation is cancelled.
+ */
+template <typename E>
+static void accumulate_region_pairs(
+    const StructureFunctionPlan& plan,
+    const Array2D& input_array,
+    const RegionLabels& regions,
+    const E& evaluate,
+    vector<lag_squared_accumulator_table>& accumulated_vals,
+    vector<vector<double>>* lag_sums
+) {
+    const size_t height = plan.height;
+    const size_t width = plan.width;
+    auto check_shape = [&](const size_t shape_height, const size_t shape_width) {
+        if (shape_height != height || shape_width != width) {
+            throw invalid_argument("Every array must have the shape of the plan, got (" + to_string(shape_height)
+                                   + ", " + to_string(shape_width) + ") instead of (" + to_string(height) + ", "
+                                   + to_string(width) + ").");
+        }
+    };
+    check_shape(input_array.height, input_array.width);
+    check_shape(regions.height, regions.width);
+    const LagWindow& window = plan.window;
+    const LagBinLookup& lookup = plan.lookup;
+    const bool is_exact = plan.binning.is_exact();
+    const size_t number_of_bins = plan.number_of_bins;
+    const size_t number_of_tables = regions.number_of_tables();
+    // The shared tables and those of each thread, which must fit in the budget before anything is allocated
+    const RunControl* control = current_run_control();
+    const size_t max_memory_bytes = (control != nullptr) ? control->max_memory_bytes : 0;
+    const size_t thread_bytes = number_of_tables * number_of_bins
+                                * (sizeof(MomentAccumulator<>) + (is_exact ? 0 : sizeof(double)));
+    if (max_memory_bytes != 0 && 2 * thread_bytes > max_memory_bytes) {
+        throw invalid_argument("The tables of " + to_string(regions.labels.size()) + " regions ("
+                               + to_string(number_of_tables) + " tables) and " + to_string(number_of_bins)
+                               + " bins need at least " + to_string(2 * thread_bytes) + " bytes, more than the memory "
+                               + "budget of " + to_string(max_memory_bytes) + " bytes. Bin the lags, lower max_lag or "
+                               + "do not cross the regions.");
+    }
+    accumulated_vals.assign(number_of_tables, lag_squared_accumulator_table(number_of_bins));
+    if (lag_sums != nullptr) lag_sums->assign(is_exact ? 0 : number_of_tables, vector<double>(number_of_bins, 0));
+    if (number_of_tables == 0) return;
+
+    Array2D region_array(height, width);
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            region_array(y, x) = (regions.regions[y * width + x] == RegionLabels::NO_REGION) ? NAN : input_array(y, x);
+        }
+    }
+    const PairSource<double> source(region_array, window);
+    const vector<PairTile>& tiles = source.tiles(plan.tiles);
+    const uint32_t* point_regions = regions.regions.data();
+    const int number_of_threads = budgeted_threads(max_memory_bytes, thread_bytes, thread_bytes);
+    RunMonitor monitor(control, tiles.size());
+
+    #pragma omp parallel num_threads(number_of_threads)
+    {
+        // The tables of a thread are laid out one after the other
+        lag_squared_accumulator_table thread_accumulated_vals(number_of_tables * number_of_bins);
+        vector<double> thread_lag_sums(is_exact ? 0 : number_of_tables * number_of_bins, 0);
+
+        #pragma omp for schedule(dynamic)
+        for (size_t t = 0; t < tiles.size(); ++t) {
+            if (monitor.stopped()) continue;
+            source.visit(tiles[t], window, evaluate, [&](size_t first, size_t lag_squared, ptrdiff_t dy, ptrdiff_t dx,
+                                                         double val) {
+                size_t table = regions.table_index(point_regions[first], point_regions[first + dy * width + dx]);
+                if (table == RegionLabels::NO_TABLE) return;
+                if (is_exact) {
+                    thread_accumulated_vals[table * number_of_bins + lag_squared].add(val);
+                    return;
+                }
+                uint32_t bin = lookup.bins[lag_squared];
+                if (bin == LagBinLookup::NO_BIN) return;
+                thread_lag_sums[table * number_of_bins + bin] += lookup.lags[lag_squared];
+                thread_accumulated_vals[table * number_of_bins + bin].add(val);
+            });
+            monitor.job_done();
+        }
+
+        // Merge the thread-local results into the tables of the regions
+        #pragma omp critical
+        {
+            for (size_t table = 0; table < number_of_tables; ++table) {
+                for (size_t index = 0; index < number_of_bins; ++index) {
+                    accumulated_vals[table][index].merge(thread_accumulated_vals[table * number_of_bins + index]);
+                }
+                if (lag_sums == nullptr || is_exact) continue;
+                for (size_t bin = 0; bin < number_of_bins; ++bin) {
+                    (*lag_sums)[table][bin] += thread_lag_sums[table * number_of_bins + bin];
+                }
+            }
+        }
+    }
+    monitor.finish();
+}
+
+/**
+ * \brief Accumulates the absolute difference between each pair of elements of an array, raised to the given order,
+ * in the tables of the regions of their points according to their squared distances. Every region, and every couple
+ * of regions if asked, is computed in the same pass over the pairs instead of one pass for each region.
+ * \param plan The pair geometry of the array, along with the window and the binning of the pairs. Unless the binning
+ * is exact, the tables are indexed by bin.
+ * \param input_array The array for which to accumulate the pairs. It must have the shape of the plan.
+ * \param regions The regions of the points of the array, which give the tables of the pairs.
+ * \param order The order to which the differences are raised.
+ * \param accumulated_vals The tables in which to accumulate the values, in the order of the tables of the regions.
+ * \param lag_sums The vectors that receive the sum of the distances of the pairs of each bin of each table, if they
+ * are given and the binning is not exact.
+ */
+void accumulate_subtracted_region_pairs(
+    const StructureFunctionPlan& plan,
+    const Array2D& input_array,
+    const RegionLabels& regions,
+    const int order,
+    vector<lag_squared_accumulator_table>& accumulated_vals,
+    vector<vector<double>>* lag_sums
+) {
+    if (order == 1) {
+        accumulate_region_pairs(plan, input_array, regions, [](double a, double b) {return abs(a - b);},
+                                accumulated_vals, lag_sums);
+    } else if (order == 2) {
+        accumulate_region_pairs(plan, input_array, regions, [](double a, double b) {return (a - b) * (a - b);},
+                                accumulated_vals, lag_sums);
+    } else {
+        accumulate_region_pairs(plan, input_array, regions,
+                                [order](double a, double b) {return pow(abs(a - b), order);}, accumulated_vals,
+                                lag_sums);
+    }
+}
+
+/**
+ * \brief Gives the number of tables of the pair sums of the given regions: one per region and one of every pair if
+ * per_region is set, or one per table of the regions otherwise.
+ */
+static size_t number_of_sum_tables(const RegionLabels& regions, const bool per_region) {
+    return per_region ? regions.labels.size() + 1 : regions.number_of_tables();
+}
+
+/**
+ * \brief Gives the number of bytes of the tables of pair sums of the given regions, of which the accumulation keeps
+ * one copy per thread on top of the shared one.
+ */
+size_t region_sums_bytes(const StructureFunctionPlan& plan, const RegionLabels& regions, const bool per_region) {
+    return (2 * number_of_sum_tables(regions, per_region) + 1) * plan.number_of_bins * sizeof(double);
+}
+
+/**
+ * \brief Enumerates every pair of valid points of an array in a single pass and adds each pair to the number of pairs
+ * and to the sum of the pair values of the tables of the regions of its points. Only these two sums are kept, so the
+ * tables take two doubles per bin. Each thread fills its own tables, which are merged at the end.
+ * \param plan The pair geometry of the array, along with the window and the binning of the pairs. Unless the binning
+ * is exact, the tables are indexed by bin.
+ * \param input_array The array whose pairs of points must be accumulated. It must have the shape of the plan.
+ * \param regions The regions of the points of the array. They must have the shape of the plan.
+ * \param evaluate Callable of the values of the two points of a pair that gives the pair value.
+ * \param per_region Whether each region has the table of the pairs that have at least one point in it, followed by the
+ * table of every pair, instead of the tables of the regions, whose number grows as the square of that of the regions.
+ * \param pair_sums The tables that receive the sums.
+ * \param max_memory_bytes The memory budget of the tables, which limits the number of threads, or 0 for no budget.
+ */
+template <typename E>
+static void accumulate_region_sums(
+    const StructureFunctionPlan& plan,
+    const Array2D& input_array,
+    const RegionLabels& regions,
+    const E& evaluate,
+    const bool per_region,
+    RegionPairSums& pair_sums,
+    const size_t max_memory_bytes
+) {
+    const size_t height = plan.height;
+    const size_t width = plan.width;
+    if (input_array.height != height || input_array.width != width || regions.height != height
+        || regions.width != width) {
+        throw invalid_argument("The array and the regions must have the shape of the plan, (" + to_string(height)
+                               + ", " + to_string(width) + ").");
+    }
+    const LagWindow& window = plan.window;
+    const LagBinLookup& lookup = plan.lookup;
+    const bool is_exact = plan.binning.is_exact();
+    const size_t number_of_bins = plan.number_of_bins;
+    const size_t number_of_tables = number_of_sum_tables(regions, per_region);
+    const size_t table_size = number_of_tables * number_of_bins;
+    const size_t total_table = regions.labels.size();  // only used per region
+    pair_sums.number_of_tables = number_of_tables;
+    pair_sums.number_of_bins = number_of_bins;
+    pair_sums.counts.assign(table_size, 0);
+    pair_sums.sums.assign(table_size, 0);
+    pair_sums.lag_sums.assign(is_exact ? 0 : number_of_bins, 0);
+    if (regions.labels.empty()) return;
+
+    const size_t bytes = region_sums_bytes(plan, regions, per_region);
+    const int number_of_threads = budgeted_threads(max_memory_bytes, bytes, bytes);
+
+    Array2D region_array(height, width);
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            region_array(y, x) = (regions.regions[y * width + x] == RegionLabels::NO_REGION) ? NAN : input_array(y, x);
+        }
+    }
+    const PairSource<double> source(region_array, window);
+    const vector<PairTile>& tiles = source.tiles(plan.tiles);
+    const uint32_t* point_regions = regions.regions.data();
+
+    #pragma omp parallel num_threads(number_of_threads)
+    {
+        vector<double> thread_counts(table_size, 0);
+        vector<double> thread_sums(table_size, 0);
+        vector<double> thread_lag_sums(is_exact ? 0 : number_of_bins, 0);
+
+        #pragma omp for schedule(dynamic)
+        for (size_t t = 0; t < tiles.size(); ++t) {
+            source.visit(tiles[t], window, evaluate, [&](size_t first, size_t lag_squared, ptrdiff_t dy, ptrdiff_t dx,
+                                                         double val) {
+                size_t bin = lag_squared;
+                if (!is_exact) {
+                    bin = lookup.bins[lag_squared];
+                    if (bin == LagBinLookup::NO_BIN) return;
+                }
+                const uint32_t first_region = point_regions[first];
+                const uint32_t second_region = point_regions[first + dy * width + dx];
+                auto add = [&](const size_t table) {
+                    thread_counts[table * number_of_bins + bin] += 1;
+                    thread_sums[table * number_of_bins + bin] += val;
+                };
+                if (per_region) {
+                    add(first_region);
+                    if (second_region != first_region) add(second_region);
+                    add(total_table);
+                } else {
+                    const size_t table = regions.table_index(first_region, second_region);
+                    if (table == RegionLabels::NO_TABLE) return;
+                    add(table);
+                }
+                if (!is_exact) thread_lag_sums[bin] += lookup.lags[lag_squared];
+            });
+        }
+
+        // Merge the thread-local results into the shared tables
+        #pragma omp critical
+        {
+            for (size_t index = 0; index < table_size; ++index) {
+                pair_sums.counts[index] += thread_counts[index];
+                pair_sums.sums[index] += thread_sums[index];
+            }
+            for (size_t bin = 0; bin < thread_lag_sums.size(); ++bin) {
+                pair_sums.lag_sums[bin] += thread_lag_sums[bin];
+            }
+        }
+    }
+}
+
+/**
+ * \brief Adds the absolute difference between each pair of elements of an array, raised to the given order, to the
+ * number of pairs and to the sum of the pair values of the tables of the regions of its points.
+ * \param plan The pair geometry of the array, along with the window and the binning of the pairs. Unless the binning
+ * is exact, the tables are indexed by bin.
+ * \param input_array The array for which to accumulate the pairs. It must have the shape of the plan.
+ * \param regions The regions of the points of the array, which give the tables of the pairs.
+ * \param order The order to which the differences are raised.
+ * \param per_region Whether each region has the table of the pairs that touch it, followed by the table of every pair,
+ * instead of the tables of the regions (see accumulate_region_sums).
+ * \param pair_sums The tables that receive the sums.
+ * \param max_memory_bytes The memory budget of the tables, which limits the number of threads, or 0 for no budget.
+ */
+void accumulate_subtracted_region_sums(
+    const StructureFunctionPlan& plan,
+    const Array2D& input_array,
+    const RegionLabels& regions,
+    const int order,
+    const bool per_region,
+    RegionPairSums& pair_sums,
+    const size_t max_memory_bytes
+) {
+    if (order == 1) {
+        accumulate_region_sums(plan, input_array, regions, [](double a, double b) {return abs(a - b);}, per_region,
+                               pair_sums, max_memory_bytes);
+    } else if (order == 2) {
+        accumulate_region_sums(plan, input_array, regions, [](double a, double b) {return (a - b) * (a - b);},
+                               per_region, pair_sums, max_memory_bytes);
+    } else {
+        accumulate_region_sums(plan, input_array, regions,
+                               [order](double a, double b) {return pow(abs(a - b), order);}, per_region, pair_sums,
+                               max_memory_bytes);
+    }
+}
+
+/**
+ * \brief Accumulates the pairs that a set of changed points makes with the active points and with each other, which
+ * are the pairs gained or lost when these points are added or removed. Each changed point is paired with the active
+ * points in the box of the window around it, so the cost is O(k L^2) for k changed points and L = max_lag, or O(k N)
+ * without a window. Each thread fills its own table, and the tables are merged at the end.
+ * \param plan The pair geometry of the array, along with the window and the binning of the pairs. Unless the binning
+ * is exact, the table is indexed by bin.
+ * \param input_array The array whose pairs of points must be accumulated. It must have the shape of the plan.
+ * \param is_active Whether each point of the array is in the pairs, in row-major order. The changed points are paired
+ * with the active points that are not changed, whether they are active themselves or not.
+ * \param changed_points The distinct row-major indices of the changed points, sorted. Their values must be valid.
+ * \param evaluate Callable of the values of the two points of a pair that gives the pair value.
+ * \param accumulated_vals The table in which to accumulate the values. It is resized to fit every bin of the plan.
+ * \param lag_sums The vector that receives the sum of the distances of the pairs of each bin, if it is given and the
+ * binning is not exact.
+ */
+template <typename E>
+static void accumulate_changed_pairs(
+    const StructureFunctionPlan& plan,
+    const Array2D& input_array,
+    const vector<uint8_t>& is_active,
+    const vector<size_t>& changed_points,
+    const E& evaluate,
+    lag_squared_accumulator_table& accumulated_vals,
+    vector<double>* lag_sums
+) {
+    const size_t height = plan.height;
+    const size_t width = plan.width;
+    const LagWindow& window = plan.window;
+    const LagBinLookup& lookup = plan.lookup;
+    const bool is_exact = plan.binning.is_exact();
+    const size_t number_of_bins = plan.number_of_bins;
+    accumulated_vals.assign(number_of_bins, MomentAccumulator<>());
+    if (lag_sums != nullptr) lag_sums->assign(is_exact ? 0 : number_of_bins, 0);
+    const ptrdiff_t max_dy = window.max_offset(height);
+    const ptrdiff_t max_dx = window.max_offset(width);
+    vector<uint8_t> is_changed(height * width, 0);
+    for (const size_t point : changed_points) {
+        is_changed[point] = 1;
+    }
 
     #pragma omp parallel
     {
-        vector<array<double, 2>> thread_single_dists_and_vals;
-        // Reserve an approximate size to avoid multiple allocations
-        thread_single_dists_and_vals.reserve(max_possible_size / omp_get_num_threads());
-
-        #pragma omp for collapse(2) schedule(dynamic)
-        for (size_t y = 0; y < height; ++y) {
-            for (size_t x = 0; x < width; ++x) {
-                if (isnan(input_array[y][x])) continue;
-                for (size_t j = y; j < height; ++j) {
-                    for (size_t i = (j == y) ? x : 0; i < width; ++i) {  // lag=0 is considered here
-                        if (isnan(input_array[j][i])) continue;
-                        double dist = sqrt((i - x) * (i - x) + (j - y) * (j - y));
-                        double val = function(input_array[y][x], input_array[j][i]);
-                        thread_single_dists_and_vals.push_back({dist, val});
+        lag_squared_accumulator_table thread_accumulated_vals(number_of_bins);
+        vector<double> thread_lag_sums(is_exact ? 0 : number_of_bins, 0);
+
+        #pragma omp for schedule(dynamic)
+        for (size_t c = 0; c < changed_points.size(); ++c) {
+            const size_t p = changed_points[c];
+            const ptrdiff_t y = p / width;
+            const ptrdiff_t x = p % width;
+            const double val = input_array(y, x);
+            for (ptrdiff_t j = max(y - max_dy, (ptrdiff_t)0); j <= min(y + max_dy, (ptrdiff_t)height - 1); ++j) {
+                for (ptrdiff_t i = max(x - max_dx, (ptrdiff_t)0); i <= min(x + max_dx, (ptrdiff_t)width - 1); ++i) {
+                    const size_t q = j * width + i;
+                    // The pairs of two changed points are only counted once, from the first of them
+                    if (is_changed[q] ? q <= p : !is_active[q]) continue;
+                    const size_t lag_squared = (i - x) * (i - x) + (j - y) * (j - y);
+                    if (!window.contains(lag_squared)) continue;
+                    size_t index = lag_squared;
+                    if (!is_exact) {
+                        index = lookup.bins[lag_squared];
+                        if (index == LagBinLookup::NO_BIN) continue;
+                        thread_lag_sums[index] += lookup.lags[lag_squared];
                     }
+                    thread_accumulated_vals[index].add(evaluate(val, input_array(j, i)));
                 }
             }
         }
 
-        // Combine the thread-local results into the global vector
-        combine_vectors(single_dists_and_vals, thread_single_dists_and_vals);
+        // Merge the thread-local results into the final table
+        #pragma omp critical
+        {
+            for (size_t index = 0; index < number_of_bins; ++index) {
+                accumulated_vals[index].merge(thread_accumulated_vals[index]);
+            }
+            if (lag_sums != nullptr && !is_exact) {
+                for (size_t bin = 0; bin < number_of_bins; ++bin) {
+                    (*lag_sums)[bin] += thread_lag_sums[bin];
+                }
+            }
+        }
     }
+}
 
-    // Optionally shrink to fit if memory usage is a concern
-    single_dists_and_vals.shrink_to_fit();
+/**
+ * \brief Accumulates the absolute difference, raised to the given order, of the pairs that a set of changed points
+ * makes with the active points and with each other, according to their squared distances.
+ */
+void accumulate_subtracted_changed_pairs(
+    const StructureFunctionPlan& plan,
+    const Array2D& input_array,
+    const vector<uint8_t>& is_active,
+    const vector<size_t>& changed_points,
+    const int order,
+    lag_squared_accumulator_table& accumulated_vals,
+    vector<double>* lag_sums
+) {
+    if (order == 1) {
+        accumulate_changed_pairs(plan, input_array, is_active, changed_points, [](double a, double b) {
+            return abs(a - b);
+        }, accumulated_vals, lag_sums);
+    } else if (order == 2) {
+        accumulate_changed_pairs(plan, input_array, is_active, changed_points, [](double a, double b) {
+            return (a - b) * (a - b);
+        }, accumulated_vals, lag_sums);
+    } else {
+        accumulate_changed_pairs(plan, input_array, is_active, changed_points, [order](double a, double b) {
+            return pow(abs(a - b), order);
+        }, accumulated_vals, lag_sums);
+    }
+}
 
-    return single_dists_and_vals;
+/**
+ * \brief Enumerates the pairs between two blocks of consecutive rows of an array and accumulates them according to
+ * their squared distances, as if the pairs were enumerated on the whole array. Only the rows of the two blocks are
+ * needed, which lets the pairs of an array be split in tiles of row blocks that are computed apart, e.g. on the ranks
+ * of a cluster. The rows of the first block are shared between the threads, each one filling its own table, and the
+ * rows and columns farther than the window are skipped.
+ * \param plan The pair geometry of the whole array, along with the window and the binning of the pairs. Unless the
+ * binning is exact, the table is indexed by bin.
+ * \param first_block The rows of the first points of the pairs, which must have the width of the plan.
+ * \param first_row The row of the whole array at which the first block starts.
+ * \param second_block The rows of the second points of the pairs, which must have the width of the plan.
+ * \param second_row The row of the whole array at which the second block starts. The blocks are either the same, in
+ * which case each pair of the block is counted once, or the second block starts after the end of the first one.
+ * \param evaluate Callable of the values of the two points of a pair that gives the pair value.
+ * \param accumulated_vals The table in which to accumulate the values. It is resized to fit every bin of the plan.
+ * \param lag_sums The vector that receives the sum of the distances of the pairs of each bin, if it is given and the
+ * binning is not exact.
+ */
+template <typename E>
+static void accumulate_block_pairs(
+    const StructureFunctionPlan& plan,
+    const Array2D& first_block,
+    const size_t first_row,
+    const Array2D& second_block,
+    const size_t second_row,
+    const E& evaluate,
+    lag_squared_accumulator_table& accumulated_vals,
+    vector<double>* lag_sums
+) {
+    const size_t width = plan.width;
+    const bool is_same_block = first_row == second_row;
+    if (first_block.width != width || second_block.width != width) {
+        throw invalid_argument("The blocks must have the width of the plan, got " + to_string(first_block.width)
+                               + " and " + to_string(second_block.width) + " instead of " + to_string(width) + ".");
+    }
+    if (first_row + first_block.height > plan.height || second_row + second_block.height > plan.height
+        || (is_same_block ? first_block.height != second_block.height : second_row < first_row + first_block.height)) {
+        throw invalid_argument("The second block must be the first one or start after it, within the "
+                               + to_string(plan.height) + " rows of the plan.");
+    }
+    const LagWindow& window = plan.window;
+    const LagBinLookup& lookup = plan.lookup;
+    const bool is_exact = plan.binning.is_exact();
+    const size_t number_of_bins = plan.number_of_bins;
+    accumulated_vals.assign(number_of_bins, MomentAccumulator<>());
+    if (lag_sums != nullptr) lag_sums->assign(is_exact ? 0 : number_of_bins, 0);
+    const size_t max_dy = window.max_offset(plan.height);
+    const size_t max_dx = window.max_offset(width);
+
+    #pragma omp parallel
+    {
+        lag_squared_accumulator_table thread_accumulated_vals(number_of_bins);
+        vector<double> thread_lag_sums(is_exact ? 0 : number_of_bins, 0);
+        vector<double> second_vals(width);
+        vector<double> pair_vals(width);
+
+        #pragma omp for schedule(dynamic)
+        for (size_t y = 0; y < first_block.height; ++y) {
+            const size_t first_y = first_row + y;
+            for (size_t j = is_same_block ? y : 0; j < second_block.height && second_row + j <= first_y + max_dy; ++j) {
+                const size_t dy = second_row + j - first_y;
+                for (size_t i = 0; i < width; ++i) {
+                    second_vals[i] = second_block(j, i);
+                }
+                for (size_t x = 0; x < width; ++x) {
+                    const double val = first_block(y, x);
+                    if (isnan(val)) continue;
+
+                    // The pairs of a row with itself are only counted from their first point
+                    const size_t row_begin = (dy == 0) ? x + 1 : ((x > max_dx) ? x - max_dx : 0);
+                    const size_t row_end = min(x + max_dx + 1, width);
+                    if (row_begin >= row_end) continue;
+                    const size_t segment_size = row_end - row_begin;
+                    const double* segment_vals = &second_vals[row_begin];
+
+                    #pragma omp simd
+                    for (size_t k = 0; k < segment_size; ++k) {
+                        pair_vals[k] = evaluate(val, segment_vals[k]);
+                    }
+
+                    ptrdiff_t dx = (ptrdiff_t)row_begin - (ptrdiff_t)x;
+                    size_t lag_squared = dx * dx + dy * dy;
+                    for (size_t k = 0; k < segment_size; ++k, ++dx) {
+                        if (!isnan(segment_vals[k]) && window.contains(lag_squared)) {
+                            const size_t index = is_exact ? lag_squared : lookup.bins[lag_squared];
+                            if (index != LagBinLookup::NO_BIN) {
+                                if (!is_exact) thread_lag_sums[index] += lookup.lags[lag_squared];
+                                thread_accumulated_vals[index].add(pair_vals[k]);
+                            }
+                        }
+                        lag_squared += 2 * dx + 1;
+                    }
+                }
+            }
+        }
+
+        // Merge the thread-local results into the final table
+        #pragma omp critical
+        {
+            for (size_t index = 0; index < number_of_bins; ++index) {
+                accumulated_vals[index].merge(thread_accumulated_vals[index]);
+            }
+            if (lag_sums != nullptr && !is_exact) {
+                for (size_t bin = 0; bin < number_of_bins; ++bin) {
+                    (*lag_sums)[bin] += thread_lag_sums[bin];
+                }
+            }
+        }
+    }
+}
+
+/**
+ * \brief Accumulates the absolute difference, raised to the given order, of the pairs between two row blocks of an
+ * array according to their squared distances.
+ */
+void accumulate_subtracted_block_pairs(
+    const StructureFunctionPlan& plan,
+    const Array2D& first_block,
+    const size_t first_row,
+    const Array2D& second_block,
+    const size_t second_row,
+    const int order,
+    lag_squared_accumulator_table& accumulated_vals,
+    vector<double>* lag_sums
+) {
+    if (order == 1) {
+        accumulate_block_pairs(plan, first_block, first_row, second_block, second_row, [](double a, double b) {
+            return abs(a - b);
+        }, accumulated_vals, lag_sums);
+    } else if (order == 2) {
+        accumulate_block_pairs(plan, first_block, first_row, second_block, second_row, [](double a, double b) {
+            return (a - b) * (a - b);
+        }, accumulated_vals, lag_sums);
+    } else {
+        accumulate_block_pairs(plan, first_block, first_row, second_block, second_row, [order](double a, double b) {
+            return pow(abs(a - b), order);
+        }, accumulated_vals, lag_sums);
+    }
+}
+
+/**
+ * \brief Enumerates every pair of valid points of an array and accumulates the pair values according to the offset
+ * (dy, dx) from the first point of each pair to its second point. Each thread fills its own table of the offsets of
+ * the window, (max_dy + 1) x (2 max_dx + 1), and the tables are merged in the table of every offset at the end, so a
+ * small max_lag also keeps the tables of the threads small. The number of threads is limited by the memory budget of
+ * the RunControl installed on the calling thread, if there is one, whose progress and cancellation are also followed
+ * tile by tile.
+ * \param input_array The array whose pairs of points must be accumulated.
+ * \param evaluate Callable of the values of the two points of a pair that gives the pair value.
+ * \param accumulated_vals The table in which to accumulate the values, indexed by half_plane_offset_index. It is
+ * resized to fit every offset of the half-plane dy >= 0 of the input_array.
+ * \param window The range of distances of the pairs to accumulate.
+ * \throws runtime_error If the shared table and a single thread table do not fit in the memory budget.
+ * \throws RunCancelled If the computation is cancelled.
+ */
+template <typename E>
+static void accumulate_offsets(
+    const Array2D& input_array,
+    const E& evaluate,
+    lag_squared_accumulator_table& accumulated_vals,
+    const LagWindow& window
+) {
+    const size_t height = input_array.height;
+    const size_t width = input_array.width;
+    const size_t table_size = (height * width == 0) ? 0 : height * (2 * width - 1);
+    const size_t max_dy = window.max_offset(height);
+    const size_t max_dx = window.max_offset(width);
+    const size_t window_width = 2 * max_dx + 1;
+    const size_t window_table_size = (max_dy + 1) * window_width;
+    const RunControl* control = current_run_control();
+    const int number_of_threads = budgeted_threads(control != nullptr ? control->max_memory_bytes : 0,
+                                                   table_size * sizeof(MomentAccumulator<>),
+                                                   window_table_size * sizeof(MomentAccumulator<>));
+    accumulated_vals.assign(table_size, MomentAccumulator<>());
+    if (table_size == 0) return;
+    const PairSource<double> source(input_array, window);
+    const vector<PairTile> grid_tiles = source.is_compact ? vector<PairTile>()
+                                                          : window_pair_tiles(height, width, window);
+    const vector<PairTile>& tiles = source.tiles(grid_tiles);
+    RunMonitor monitor(control, tiles.size());
+
+    #pragma omp parallel num_threads(number_of_threads)
+    {
+        // The offsets of the window, dy in [0, max_dy] and dx in [-max_dx, max_dx], are laid out row by row
+        lag_squared_accumulator_table thread_accumulated_vals(window_table_size);
+
+        #pragma omp for schedule(dynamic)
+        for (size_t t = 0; t < tiles.size(); ++t) {
+            if (monitor.stopped()) continue;
+            source.visit(tiles[t], window, evaluate, [&](size_t, size_t, ptrdiff_t dy, ptrdiff_t dx, double val) {
+                thread_accumulated_vals[dy * window_width + dx + max_dx].add(val);
+            });
+            monitor.job_done();
+        }
+
+        // Merge the thread-local results into the table of every offset
+        #pragma omp critical
+        {
+            for (size_t dy = 0; dy <= max_dy; ++dy) {
+                for (ptrdiff_t dx = -(ptrdiff_t)max_dx; dx <= (ptrdiff_t)max_dx; ++dx) {
+                    const MomentAccumulator<>& accumulator = thread_accumulated_vals[dy * window_width + dx + max_dx];
+                    if (accumulator.count == 0) continue;
+                    accumulated_vals[half_plane_offset_index(dy, dx, width)].merge(accumulator);
+                }
+            }
+        }
+    }
+    monitor.finish();
 }
 
 /**
- * \brief Computes the product between each pair of elements in the input array, along with their distances.
+ * \brief Accumulates the absolute difference between each pair of elements in the input array, raised to the given
+ * order, according to the offset (dy, dx) between the two points instead of their distance. This resolves the
+ * anisotropy of the data.
+ * \param input_array The array for which to accumulate the pairs.
+ * \param order The order to which the differences are raised.
+ * \param accumulated_vals The table in which to accumulate the values, indexed by half_plane_offset_index.
+ * \param window The range of distances of the pairs to accumulate.
  */
-vector<array<double, 2>> multiply_pairs(const vector_2d& input_array) {
-    return apply_vector_map(input_array, [](double a, double b) {return a * b;});
+void accumulate_subtracted_offsets(
+    const Array2D& input_array,
+    const int order,
+    lag_squared_accumulator_table& accumulated_vals,
+    const LagWindow& window
+) {
+    if (order == 1) {
+        accumulate_offsets(input_array, [](double a, double b) {return abs(a - b);}, accumulated_vals, window);
+    } else if (order == 2) {
+        accumulate_offsets(input_array, [](double a, double b) {return (a - b) * (a - b);}, accumulated_vals, window);
+    } else {
+        accumulate_offsets(input_array, [order](double a, double b) {return pow(abs(a - b), order);},
+                           accumulated_vals, window);
+    }
 }
 
 /**
- * \brief Computes the absolute difference between each pair of elements in the input array, along with their distances.
+ * \brief Raises a value to a non-negative integer exponent by repeated squaring.
  */
-vector<array<double, 2>> subtract_pairs(const vector_2d& input_array) {
-    return apply_vector_map(input_array, [](double a, double b) {return abs(a - b);});
+static double integer_power(double val, int exponent) {
+    double result = 1;
+    while (exponent > 0) {
+        if (exponent & 1) result *= val;
+        val *= val;
+        exponent >>= 1;
+    }
+    return result;
+}
+
+/**
+ * \brief Accumulates the absolute difference between each pair of elements of each of several arrays, raised to each
+ * of the given orders, according to their squared distances. The pairs are only enumerated once and the powers of each
+ * difference are obtained from one another in increasing order, instead of calling pow for every order.
+ * \param plan The pair geometry of the arrays, along with the window and the binning of the pairs. Unless the binning
+ * is exact, the tables are indexed by bin.
+ * \param input_arrays The arrays for which to accumulate the pairs. They must have the shape of the plan.
+ * \param orders The non-negative orders to which the differences are raised.
+ * \param accumulated_vals The tables in which to accumulate the values, one for each array. The accumulator of the kth
+ * order of the squared distance r^2 is at the index r^2 * orders.size() + k.
+ * \param lag_sums The vectors that receive the sum of the distances of the pairs of each bin of each array, if they
+ * are given and the binning is not exact.
+ */
+void accumulate_subtracted_pairs(
+    const StructureFunctionPlan& plan,
+    const vector<Array2D>& input_arrays,
+    const vector<int>& orders,
+    vector<lag_squared_accumulator_table>& accumulated_vals,
+    vector<vector<double>>* lag_sums
+) {
+    for (int order : orders) {
+        if (order < 0) {
+            throw invalid_argument("The orders must be non-negative, got order=" + to_string(order) + ".");
+        }
+    }
+    // Visit the orders in increasing order so each power is the previous one times the difference raised to the gap
+    // between the two orders
+    vector<size_t> sorted_indices(orders.size());
+    iota(sorted_indices.begin(), sorted_indices.end(), 0);
+    stable_sort(sorted_indices.begin(), sorted_indices.end(), [&orders](size_t a, size_t b) {
+        return orders[a] < orders[b];
+    });
+    vector<int> gaps(orders.size());
+    int previous_order = 0;
+    for (size_t k = 0; k < orders.size(); ++k) {
+        gaps[k] = orders[sorted_indices[k]] - previous_order;
+        previous_order = orders[sorted_indices[k]];
+    }
+
+    auto subtract = [](double a, double b) {return abs(a - b);};
+    accumulate_pairs_of_arrays(plan, input_arrays, orders.size(), subtract,
+                               [&](double difference, MomentAccumulator<>* accumulators) {
+        double power = 1;
+        for (size_t k = 0; k < gaps.size(); ++k) {
+            power *= (gaps[k] == 1) ? difference : integer_power(difference, gaps[k]);
+            accumulators[sorted_indices[k]].add(power);
+        }
+    }, accumulated_vals, lag_sums);
+}
+
+/**
+ * \brief Accumulates the absolute difference between each pair of elements in the input array, raised to each of the
+ * given orders, according to their squared distances.
+ * \param input_array The array for which to accumulate the pairs.
+ * \param orders The non-negative orders to which the differences are raised.
+ * \param accumulated_vals The table in which to accumulate the values. The accumulator of the kth order of the squared
+ * distance r^2 is at the index r^2 * orders.size() + k. It is resized to fit every possible squared distance of the
+ * input_array.
+ * \param window The range of distances of the pairs to accumulate.
+ * \param binning The bins in which to regroup the pairs. Unless the binning is exact, the table is indexed by bin.
+ * \param lag_sums The vector that receives the sum of the distances of the pairs of each bin, if it is given and the
+ * binning is not exact.
+ */
+void accumulate_subtracted_pairs(
+    const Array2D& input_array,
+    const vector<int>& orders,
+    lag_squared_accumulator_table& accumulated_vals,
+    const LagWindow& window,
+    const LagBinning& binning,
+    vector<double>* lag_sums
+) {
+    vector<lag_squared_accumulator_table> tables;
+    vector<vector<double>> sums;
+    accumulate_subtracted_pairs(StructureFunctionPlan(input_array.height, input_array.width, window, binning),
+                                {input_array}, orders, tables, &sums);
+    keep_single_array(tables, sums, accumulated_vals, lag_sums);
 }
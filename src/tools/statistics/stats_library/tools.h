@@ -1,8 +1,16 @@
+#pragma once
+
+#include <algorithm>
 #include <array>
 #include <vector>
 #include <unordered_map>
 #include <functional>
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "array_2d.h"
+#include "moments.h"
 
 /**
  * \struct DoubleArrayHash
@@ -21,9 +29,212 @@ struct DoubleArrayHash
     }
 };
 
-typedef std::vector<std::vector<double>> vector_2d;
+/**
+ * \struct FlatBins
+ * \brief Contiguous representation of regrouped values, allowing random access to every bin. The values of the ith bin,
+ * whose key is keys[i], are stored in values between the indices offsets[i] and offsets[i + 1]. The keys are sorted.
+ */
+struct FlatBins
+{
+    std::vector<double> keys;
+    std::vector<size_t> offsets = {0};
+    std::vector<double> values;
+
+    size_t size() const {return keys.size();}
+    size_t bin_size(size_t i) const {return offsets[i + 1] - offsets[i];}
+    std::vector<double>::const_iterator bin_begin(size_t i) const {return values.begin() + offsets[i];}
+    std::vector<double>::const_iterator bin_end(size_t i) const {return values.begin() + offsets[i + 1];}
+};
+
+/**
+ * \struct PairTile
+ * \brief Set of pairs (p, q) of points with q >= p, where p and q are row-major indices in [first_begin, first_end) and
+ * [second_begin, second_end) respectively.
+ */
+struct PairTile
+{
+    size_t first_begin;
+    size_t first_end;
+    size_t second_begin;
+    size_t second_end;
+};
+
+/**
+ * \struct LagWindow
+ * \brief Range [min_lag, max_lag] of the distances of the pairs of points that are considered. The pairs farther than
+ * max_lag are never enumerated, which reduces the cost from O(N^2) to O(N L^2) for an array of N points and
+ * L = max_lag. The bounds are kept as the squared distances they allow, as the squared distances on a pixel grid are
+ * integers.
+ */
+struct LagWindow
+{
+    size_t lower_lag_squared = 0;
+    size_t upper_lag_squared = SIZE_MAX;
+
+    LagWindow() = default;
+    LagWindow(const double min_lag, const double max_lag);
+
+    bool contains(size_t lag_squared) const
+    {
+        return lower_lag_squared <= lag_squared && lag_squared <= upper_lag_squared;
+    }
+    bool is_bounded() const {return upper_lag_squared != SIZE_MAX;}
+    size_t max_offset(const size_t size) const;
+};
+
+/**
+ * \struct LagBinning
+ * \brief Specification of the bins in which the pairs of points are regrouped according to their distance. By default,
+ * each exact distance has its own bin. The other bins are half-open intervals [low, high) of distances, whose value is
+ * the mean distance of the pairs they contain.
+ */
+struct LagBinning
+{
+    enum class Kind {exact, linear, logarithmic, edges};
+
+    Kind kind = Kind::exact;
+    double width = 0;
+    int bins_per_decade = 0;
+    std::vector<double> bin_edges;
+
+    static LagBinning linear(const double width);
+    static LagBinning logarithmic(const int bins_per_decade);
+    static LagBinning from_edges(const std::vector<double>& bin_edges);
+
+    bool is_exact() const {return kind == Kind::exact;}
+    std::vector<double> edges(const double max_lag) const;
+};
+
+/**
+ * \struct LagBinLookup
+ * \brief Precomputed bin and distance of each squared distance, so the pairs are binned without searching the edges.
+ * The squared distances that fall outside of every bin, as well as the zero distance, are given NO_BIN.
+ */
+struct LagBinLookup
+{
+    static constexpr uint32_t NO_BIN = UINT32_MAX;
+
+    std::vector<uint32_t> bins;
+    std::vector<double> lags;
+    size_t number_of_bins = 0;
+
+    LagBinLookup(const LagBinning& binning, const size_t max_lag_squared);
+};
+
+/**
+ * \struct ActivePixels
+ * \brief Valid points of an array, compacted in row-major order into separate coordinate and value arrays. The points
+ * of row y are the ones from row_starts[y] to row_starts[y + 1].
+ * \tparam T The type of the values of the array.
+ */
+template <typename T>
+struct ActivePixels
+{
+    size_t height = 0;
+    size_t width = 0;
+    std::vector<int32_t> ys;
+    std::vector<int32_t> xs;
+    std::vector<T> vals;
+    std::vector<size_t> row_starts;
+
+    ActivePixels() = default;
+    explicit ActivePixels(const BasicArray2D<T>& input_array);
+    size_t size() const { return vals.size(); }
+};
+
+/**
+ * \struct StructureFunctionPlan
+ * \brief Pair geometry of the arrays of a given shape, which only depends on the shape, the window and the binning and
+ * not on the data. The bin of each squared distance and the pair tiles are computed once, and the plan can then be
+ * executed on any number of arrays of that shape and for any order. The tiles are made for the number of threads
+ * available when the plan is created.
+ */
+struct StructureFunctionPlan
+{
+    size_t height;
+    size_t width;
+    LagWindow window;
+    LagBinning binning;
+    LagBinLookup lookup;
+    std::vector<PairTile> tiles;
+    size_t number_of_bins;  // the number of squared distances if the binning is exact
+
+    StructureFunctionPlan(const size_t height, const size_t width, const LagWindow& window = LagWindow(),
+                          const LagBinning& binning = LagBinning());
+
+    std::vector<double> bin_edges() const;
+};
+
+/**
+ * \struct RegionLabels
+ * \brief Regions of the arrays of a given shape defined by an integer label image, in which each non-negative label
+ * is a region and the points of negative label belong to none. The pairs of points of the same region are accumulated
+ * in the table of that region and, if cross_regions is set, the pairs of points of two different regions in the table
+ * of that couple of regions. The tables of the regions come first in the order of their labels, followed by those of
+ * the couples (a, b) with a < b in lexicographic order.
+ */
+struct RegionLabels
+{
+    static constexpr uint32_t NO_REGION = UINT32_MAX;
+    static constexpr size_t NO_TABLE = SIZE_MAX;
+
+    size_t height;
+    size_t width;
+    bool cross_regions;
+    std::vector<int64_t> labels;  // the distinct labels, sorted
+    std::vector<uint32_t> regions;  // the index in labels of the region of each point, in row-major order
+
+    RegionLabels(const size_t height, const size_t width, const std::vector<int64_t>& label_image,
+                 const bool cross_regions = false);
+
+    size_t number_of_tables() const;
+    size_t table_index(const uint32_t first_region, const uint32_t second_region) const
+    {
+        if (first_region == NO_REGION || second_region == NO_REGION) return NO_TABLE;
+        if (first_region == second_region) return first_region;
+        if (!cross_regions) return NO_TABLE;
+        const size_t low = std::min(first_region, second_region);
+        const size_t high = std::max(first_region, second_region);
+        return labels.size() + low * (2 * labels.size() - low - 1) / 2 + (high - low - 1);
+    }
+    std::vector<std::array<int64_t, 2>> table_labels() const;
+};
+
+/**
+ * \struct RegionPairSums
+ * \brief Number of pairs and sum of their values at each bin of several tables of pairs, laid out one table after the
+ * other, along with the sum of the distances of the pairs of each bin over every table if the binning is not exact.
+ * The resampled structure functions only need these sums, which take two doubles per bin instead of an accumulator.
+ */
+struct RegionPairSums
+{
+    size_t number_of_tables = 0;
+    size_t number_of_bins = 0;
+    std::vector<double> counts;
+    std::vector<double> sums;
+    std::vector<double> lag_sums;
+};
+
 typedef std::unordered_map<double, std::vector<double>> double_unordered_map;
 typedef std::unordered_map<std::array<double, 2>, std::vector<double>, DoubleArrayHash> array_unordered_map;
+typedef std::vector<MomentAccumulator<>> lag_squared_accumulator_table;
+
+/**
+ * \brief Gives the index of the offset (dy, dx), with dy >= 0 and |dx| < width, in a row-major table of the half-plane
+ * of offsets with 2 * width - 1 columns. The column of dx = 0 is width - 1.
+ */
+inline size_t half_plane_offset_index(const ptrdiff_t dy, const ptrdiff_t dx, const size_t width)
+{
+    return dy * (2 * width - 1) + dx + (width - 1);
+}
+
+size_t max_lag_squared(const size_t height, const size_t width);
+std::vector<PairTile> triangular_pair_tiles(const size_t number_of_points, const size_t number_of_threads);
+std::vector<PairTile> banded_pair_tiles(
+    const size_t number_of_points,
+    const size_t max_index_offset,
+    const size_t number_of_threads
+);
 
 void regroup_distance_thread_local(
     const std::vector<std::array<double, 2>>& single_dists_and_vals_1d,
@@ -33,10 +244,117 @@ void regroup_distance_thread_local(
     const std::vector<std::array<double, 3>>& dist_and_val,
     array_unordered_map& regrouped_vals
 );
+void regroup_lag_squared_thread_local(
+    const std::vector<std::array<double, 2>>& lags_squared_and_vals,
+    const size_t max_lag_squared,
+    FlatBins& regrouped_vals
+);
+FlatBins flatten_bins(const double_unordered_map& regrouped_vals);
 void combine_vectors(std::vector<std::array<double,2>>& dest, const std::vector<std::array<double,2>>& src);
 void combine_vectors(std::vector<std::array<double,3>>& dest, const std::vector<std::array<double,3>>& src);
 
+size_t max_number_of_pairs(const Array2D& input_array, const LagWindow& window = LagWindow());
 template <typename T>
-std::vector<std::array<double, 2>> apply_vector_map(const vector_2d& input_array, const T& function);
-std::vector<std::array<double, 2>> multiply_pairs(const vector_2d& input_array);
-std::vector<std::array<double, 2>> subtract_pairs(const vector_2d& input_array);
+std::vector<std::array<double, 2>> apply_vector_map(
+    const Array2D& input_array,
+    const T& function,
+    const LagWindow& window = LagWindow()
+);
+std::vector<std::array<double, 2>> multiply_pairs(const Array2D& input_array, const LagWindow& window = LagWindow());
+std::vector<std::array<double, 2>> subtract_pairs(const Array2D& input_array, const LagWindow& window = LagWindow());
+
+template <typename T>
+void accumulate_vector_map(
+    const Array2D& input_array,
+    const T& function,
+    lag_squared_accumulator_table& accumulated_vals,
+    const LagWindow& window = LagWindow(),
+    const LagBinning& binning = LagBinning(),
+    std::vector<double>* lag_sums = nullptr
+);
+void accumulate_subtracted_pairs(
+    const Array2D& input_array,
+    const int order,
+    lag_squared_accumulator_table& accumulated_vals,
+    const LagWindow& window = LagWindow(),
+    const LagBinning& binning = LagBinning(),
+    std::vector<double>* lag_sums = nullptr
+);
+void accumulate_subtracted_pairs(
+    const Array2D& input_array,
+    const std::vector<int>& orders,
+    lag_squared_accumulator_table& accumulated_vals,
+    const LagWindow& window = LagWindow(),
+    const LagBinning& binning = LagBinning(),
+    std::vector<double>* lag_sums = nullptr
+);
+void accumulate_subtracted_pairs(
+    const StructureFunctionPlan& plan,
+    const std::vector<Array2D>& input_arrays,
+    const int order,
+    std::vector<lag_squared_accumulator_table>& accumulated_vals,
+    std::vector<std::vector<double>>* lag_sums = nullptr
+);
+void accumulate_subtracted_pairs(
+    const StructureFunctionPlan& plan,
+    const std::vector<Array2D>& input_arrays,
+    const std::vector<int>& orders,
+    std::vector<lag_squared_accumulator_table>& accumulated_vals,
+    std::vector<std::vector<double>>* lag_sums = nullptr
+);
+void accumulate_subtracted_pairs(
+    const StructureFunctionPlan& plan,
+    const std::vector<FloatArray2D>& input_arrays,
+    const int order,
+    std::vector<lag_squared_accumulator_table>& accumulated_vals,
+    std::vector<std::vector<double>>* lag_sums = nullptr
+);
+void accumulate_multiplied_pairs(
+    const StructureFunctionPlan& plan,
+    const std::vector<Array2D>& input_arrays,
+    std::vector<lag_squared_accumulator_table>& accumulated_vals,
+    std::vector<std::vector<double>>* lag_sums = nullptr
+);
+void accumulate_subtracted_region_pairs(
+    const StructureFunctionPlan& plan,
+    const Array2D& input_array,
+    const RegionLabels& regions,
+    const int order,
+    std::vector<lag_squared_accumulator_table>& accumulated_vals,
+    std::vector<std::vector<double>>* lag_sums = nullptr
+);
+size_t region_sums_bytes(const StructureFunctionPlan& plan, const RegionLabels& regions, const bool per_region);
+void accumulate_subtracted_region_sums(
+    const StructureFunctionPlan& plan,
+    const Array2D& input_array,
+    const RegionLabels& regions,
+    const int order,
+    const bool per_region,
+    RegionPairSums& pair_sums,
+    const size_t max_memory_bytes = 0
+);
+void accumulate_subtracted_changed_pairs(
+    const StructureFunctionPlan& plan,
+    const Array2D& input_array,
+    const std::vector<uint8_t>& is_active,
+    const std::vector<size_t>& changed_points,
+    const int order,
+    lag_squared_accumulator_table& accumulated_vals,
+    std::vector<double>* lag_sums = nullptr
+);
+void accumulate_subtracted_block_pairs(
+    const StructureFunctionPlan& plan,
+    const Array2D& first_block,
+    const size_t first_row,
+    const Array2D& second_block,
+    const size_t second_row,
+    const int order,
+    lag_squared_accumulator_table& accumulated_vals,
+    std::vector<double>* lag_sums = nullptr
+);
+void accumulate_subtracted_offsets(
+    const Array2D& input_array,
+    const int order,
+    lag_squared_accumulator_table& accumulated_vals,
+    const LagWindow& window = LagWindow()
+);
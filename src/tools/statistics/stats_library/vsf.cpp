@@ -1,60 +1,681 @@
 #include <omp.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
 
 #include "vsf.h"
+#include "fft.h"
+#include "sampling.h"
+#include "profiling.h"
+#include "run_control.h"
 
 using namespace std;
 
 /**
- * \brief Calculates the nth order structure function of two-dimensional data.
- * \param input_array The input as a two-dimensional vector.
- * \param order The order of the structure function to compute. For example, order=1 will only output the average
- * difference between pairs of points (normalized by the variance) as a function of their distance.
+ * \brief Checks whether a squared distance, or a bin, of a table of accumulated pair values gives an output row.
+ * \param accumulated_vals The table containing the accumulated pair values.
+ * \param values_per_lag The number of structure functions accumulated in the table.
+ * \param window The range of distances to output.
+ * \param is_binned Whether the table is indexed by bin instead of squared distance.
+ * \param index The squared distance or the bin.
+ */
+static bool is_valid_lag(const lag_squared_accumulator_table& accumulated_vals, const size_t values_per_lag,
+                         const LagWindow& window, const bool is_binned, const size_t index) {
+    // Every accumulator of a squared distance received the same pairs, so the first one gives the count
+    if (accumulated_vals[index * values_per_lag].count <= 1) return false;  // skip single values
+    return is_binned || (index != 0 && window.contains(index));  // reject zero distances
+}
+
+/**
+ * \brief Writes the output rows of the given squared distances, or bins, of a table of accumulated pair values.
+ * \param accumulated_vals The table containing the accumulated pair values. Each squared distance, or each bin, has
+ * values_per_lag consecutive accumulators, one for each structure function.
+ * \param values_per_lag The number of structure functions accumulated in the table.
+ * \param indices The squared distances, or the bins, to output in order. The structure functions and uncertainties of
+ * those with at most one pair are NaN, as is the distance of a bin without pairs.
+ * \param lag_sums The sum of the distances of the pairs of each bin, when the table is indexed by bin. The table is
+ * indexed by squared distance otherwise.
+ */
+static Array2D reduce_accumulators_at(const lag_squared_accumulator_table& accumulated_vals,
+                                      const size_t values_per_lag, const vector<size_t>& indices,
+                                      const vector<double>* lag_sums) {
+    Array2D output_array(indices.size(), 1 + 2 * values_per_lag);
+    for (size_t row = 0; row < indices.size(); ++row) {
+        const size_t index = indices[row];
+        size_t N = accumulated_vals[index * values_per_lag].count;
+
+        // The square root is only computed once per bin
+        output_array(row, 0) = (lag_sums == nullptr) ? sqrt(index) : (N > 0) ? (*lag_sums)[index] / N : NAN;
+        for (size_t k = 0; k < values_per_lag; ++k) {
+            const MomentAccumulator<>& accumulator = accumulated_vals[index * values_per_lag + k];
+            double structure = (N > 1) ? accumulator.mean : NAN;
+            double structure_uncertainty = (N > 1) ? accumulator.standard_error() : NAN;
+
+            output_array(row, 1 + 2 * k) = structure;
+            output_array(row, 2 + 2 * k) = structure_uncertainty;
+        }
+    }
+    return output_array;
+}
+
+/**
+ * \brief Computes the structure functions from the accumulated pair values of each squared distance or of each bin.
+ * \param accumulated_vals The table containing the accumulated pair values. Each squared distance, or each bin, has
+ * values_per_lag consecutive accumulators, one for each structure function.
+ * \param values_per_lag The number of structure functions accumulated in the table.
+ * \param window The range of distances to output.
+ * \param lag_sums The sum of the distances of the pairs of each bin, when the table is indexed by bin. The table is
+ * indexed by squared distance otherwise.
+ * \return The (distance, structure function, uncertainty, ...) rows, sorted by distance, with one pair of structure
+ * function and uncertainty columns for each accumulator of a squared distance. The distance of a bin is the mean
+ * distance of its pairs.
+ */
+static Array2D reduce_accumulators(const lag_squared_accumulator_table& accumulated_vals, const size_t values_per_lag,
+                                   const LagWindow& window, const vector<double>* lag_sums = nullptr) {
+    const size_t table_size = accumulated_vals.size() / values_per_lag;
+    vector<size_t> indices;
+    for (size_t index = 0; index < table_size; ++index) {
+        if (is_valid_lag(accumulated_vals, values_per_lag, window, lag_sums != nullptr, index)) {
+            indices.push_back(index);
+        }
+    }
+    return reduce_accumulators_at(accumulated_vals, values_per_lag, indices, lag_sums);
+}
+
+/**
+ * \brief Computes the structure function from the pair values accumulated with a plan, e.g. by the pairs of the row
+ * blocks of an array computed apart and merged afterwards.
+ * \param plan The plan with which the pairs were accumulated.
+ * \param accumulated_vals The table of the accumulated pair values, indexed by bin unless the binning is exact.
+ * \param lag_sums The sum of the distances of the pairs of each bin. It is ignored if the binning is exact.
+ * \return Array of shape (n_lags, 3) whose rows are the lag, the structure function and its uncertainty, sorted by lag.
+ */
+Array2D structure_function_from_table(const StructureFunctionPlan& plan,
+                                      const lag_squared_accumulator_table& accumulated_vals,
+                                      const vector<double>& lag_sums) {
+    return reduce_accumulators(accumulated_vals, 1, plan.window, plan.binning.is_exact() ? nullptr : &lag_sums);
+}
+
+/**
+ * \brief Computes the structure functions from the accumulated pair values of each squared distance, after regrouping
+ * them in the given bins. This is used by the methods that compute the accumulators of every squared distance anyway.
+ * \param accumulated_vals The table indexed by squared distance containing the accumulated pair values.
+ * \param values_per_lag The number of structure functions accumulated in the table.
+ * \param window The range of distances to output.
+ * \param binning The bins in which to regroup the squared distances.
+ */
+static Array2D reduce_binned_accumulators(const lag_squared_accumulator_table& accumulated_vals,
+                                          const size_t values_per_lag, const LagWindow& window,
+                                          const LagBinning& binning) {
+    if (binning.is_exact()) {
+        return reduce_accumulators(accumulated_vals, values_per_lag, window);
+    }
+    const size_t max_lag_squared_val = accumulated_vals.size() / values_per_lag - 1;
+    const LagBinLookup lookup(binning, max_lag_squared_val);
+    lag_squared_accumulator_table binned_vals(lookup.number_of_bins * values_per_lag);
+    vector<double> lag_sums(lookup.number_of_bins, 0);
+    for (size_t lag_squared = 0; lag_squared <= max_lag_squared_val; ++lag_squared) {
+        uint32_t bin = lookup.bins[lag_squared];
+        if (bin == LagBinLookup::NO_BIN || !window.contains(lag_squared)) continue;
+        lag_sums[bin] += accumulated_vals[lag_squared * values_per_lag].count * lookup.lags[lag_squared];
+        for (size_t k = 0; k < values_per_lag; ++k) {
+            binned_vals[bin * values_per_lag + k].merge(accumulated_vals[lag_squared * values_per_lag + k]);
+        }
+    }
+    return reduce_accumulators(binned_vals, values_per_lag, window, &lag_sums);
+}
+
+/**
+ * \brief Calculates the nth order structure function of two-dimensional data by first storing the value of every pair
+ * of points. This requires O(N^2) memory and should only be used on small arrays.
+ * \param input_array The input as a two-dimensional array.
+ * \param order The order of the structure function to compute.
+ * \param window The range of distances of the pairs to consider.
+ * \param binning The bins in which to regroup the pairs.
+ */
+Array2D structure_function_materialized(const Array2D& input_array, const int order, const LagWindow& window,
+                                        const LagBinning& binning) {
+    // Compute the differences between each pair of elements along with their squared distances
+    vector<array<double, 2>> single_dists_and_vals_1d = subtract_pairs(input_array, window);
+    PROFILE_ALLOCATION(single_dists_and_vals_1d.capacity() * sizeof(array<double, 2>));
+
+    // Regroup the values by their pair separation squared distances
+    FlatBins regrouped_vals;
+    size_t max_lag_squared_val = min(max_lag_squared(input_array.height, input_array.width), window.upper_lag_squared);
+    regroup_lag_squared_thread_local(single_dists_and_vals_1d, max_lag_squared_val, regrouped_vals);
+    PROFILE_ALLOCATION(regrouped_vals.values.capacity() * sizeof(double));
+
+    // Compute the moments of each pair separation in parallel
+    lag_squared_accumulator_table accumulated_vals(max_lag_squared_val + 1);
+    {
+        PROFILE_PHASE("moments");
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < regrouped_vals.size(); ++i) {
+            MomentAccumulator<>& accumulator = accumulated_vals[(size_t)regrouped_vals.keys[i]];
+            for (auto val = regrouped_vals.bin_begin(i); val != regrouped_vals.bin_end(i); ++val) {
+                accumulator.add(pow(*val, order));
+            }
+        }
+    }
+
+    Array2D output_array;
+    {
+        PROFILE_PHASE("reduction");
+        output_array = reduce_binned_accumulators(accumulated_vals, 1, window, binning);
+    }
+    return output_array;
+}
+
+/**
+ * \brief Calculates the nth order structure function of two-dimensional data by accumulating the values of each pair of
+ * points directly in running sums. The memory usage therefore only scales with the number of unique distances.
+ * \param input_array The input as a two-dimensional array.
+ * \param order The order of the structure function to compute.
+ * \param window The range of distances of the pairs to consider.
+ * \param binning The bins in which to regroup the pairs. The pairs are binned directly with a lookup table, so only the
+ * accumulators of the bins are kept.
  */
-vector_2d structure_function(const vector_2d& input_array, const int order) {
-    // Compute the differences between each pair of elements along with their distances
-    vector<array<double, 2>> single_dists_and_vals_1d = subtract_pairs(input_array);
+Array2D structure_function_streaming(const Array2D& input_array, const int order, const LagWindow& window,
+                                     const LagBinning& binning) {
+    return structure_function(StructureFunctionPlan(input_array.height, input_array.width, window, binning),
+                              input_array, order);
+}
 
-    // Regroup the values by their pair separation distances
-    double_unordered_map regrouped_vals;
-    regroup_distance_thread_local(single_dists_and_vals_1d, regrouped_vals);
+/**
+ * \brief Calculates the second order structure function of two-dimensional data using Fourier transforms. The pair sums
+ * are obtained from cross-correlations of the data and of its validity mask, so the cost is O(N log N) instead of
+ * O(N^2). This gives the same result as structure_function with order=2, up to floating-point rounding.
+ * \param input_array The input as a two-dimensional array. NaN values are ignored.
+ * \param order The order of the structure function to compute. Only order=2 is supported.
+ * \param window The range of distances to output. Every pair is still correlated, so this does not reduce the cost.
+ * \param binning The bins in which to regroup the pairs.
+ */
+Array2D structure_function_fft(const Array2D& input_array, const int order, const LagWindow& window,
+                               const LagBinning& binning) {
+    if (order != 2) {
+        throw invalid_argument("The FFT structure function only supports order=2, got order=" + to_string(order) + ".");
+    }
+    lag_squared_accumulator_table accumulated_vals;
+    accumulate_subtracted_pairs_fft(input_array, accumulated_vals);
+    return reduce_binned_accumulators(accumulated_vals, 1, window, binning);
+}
 
-    vector_2d output_array;
-    output_array.reserve(regrouped_vals.size());
-    double variance_val = variance(input_array);
+/**
+ * \brief Estimates the nth order structure function of two-dimensional data from randomly drawn pairs of points, which
+ * bounds the computation time of large arrays when the exact result is not needed. The uncertainty of each bin is the
+ * standard error of its sampled pairs.
+ * \param input_array The input as a two-dimensional array.
+ * \param order The order of the structure function to compute.
+ * \param options The number of draws, the stopping criterion and the seed of the sampling.
+ * \param window The range of distances of the pairs to sample.
+ * \param binning The bins in which to regroup the pairs.
+ */
+Array2D structure_function_sampled(const Array2D& input_array, const int order, const SamplingOptions& options,
+                                   const LagWindow& window, const LagBinning& binning) {
+    lag_squared_accumulator_table accumulated_vals;
+    vector<double> lag_sums;
+    accumulate_sampled_pairs(input_array, order, options, accumulated_vals, window, binning, &lag_sums);
+    return reduce_accumulators(accumulated_vals, 1, window, binning.is_exact() ? nullptr : &lag_sums);
+}
+
+/**
+ * \brief Computes the structure functions of several arrays from their accumulated pair values, keeping for every array
+ * the lags that are valid in at least one of them so the outputs can be stacked.
+ * \param accumulated_vals The tables containing the accumulated pair values of each array.
+ * \param values_per_lag The number of structure functions accumulated in the tables.
+ * \param window The range of distances to output.
+ * \param lag_sums The sums of the distances of the pairs of each bin of each array, when the tables are indexed by bin.
+ * The tables are indexed by squared distance otherwise.
+ */
+static vector<Array2D> reduce_stacked_accumulators(const vector<lag_squared_accumulator_table>& accumulated_vals,
+                                                   const size_t values_per_lag, const LagWindow& window,
+                                                   const vector<vector<double>>* lag_sums) {
+    vector<size_t> indices;
+    const size_t table_size = accumulated_vals.empty() ? 0 : accumulated_vals[0].size() / values_per_lag;
+    for (size_t index = 0; index < table_size; ++index) {
+        for (const auto& array_accumulated_vals : accumulated_vals) {
+            if (is_valid_lag(array_accumulated_vals, values_per_lag, window, lag_sums != nullptr, index)) {
+                indices.push_back(index);
+                break;
+            }
+        }
+    }
 
-    // Thread-local storage for results
-    vector<vector_2d> thread_local_results(omp_get_max_threads());
+    vector<Array2D> output_arrays;
+    for (size_t array = 0; array < accumulated_vals.size(); ++array) {
+        output_arrays.push_back(reduce_accumulators_at(accumulated_vals[array], values_per_lag, indices,
+                                                       (lag_sums != nullptr) ? &(*lag_sums)[array] : nullptr));
+    }
+    return output_arrays;
+}
 
-    // Compute the structure function for each pair separation in parallel
-    #pragma omp parallel
+/**
+ * \brief Calculates the nth order structure function of each slice of a cube, i.e. of several two-dimensional arrays
+ * of the same shape, in a single call. The pair geometry of the plan is shared by the slices, and the threads share
+ * the pairs of every slice at once, which avoids starting the computation over for each slice.
+ * \param plan The pair geometry of the slices, along with the range of distances and the bins of the pairs.
+ * \param input_slices The slices as two-dimensional arrays of the shape of the plan.
+ * \param order The order of the structure function to compute.
+ * \return One array of shape (n_lags, 3) for each slice, whose rows are the lag, the structure function and its
+ * uncertainty. Every slice has the same rows, which are the lags reached by at least one slice, sorted by lag. The
+ * structure function and uncertainty of a lag that a slice does not reach are NaN.
+ */
+vector<Array2D> structure_function_cube(const StructureFunctionPlan& plan, const vector<Array2D>& input_slices,
+                                        const int order) {
+    vector<lag_squared_accumulator_table> accumulated_vals;
+    vector<vector<double>> lag_sums;
+    accumulate_subtracted_pairs(plan, input_slices, order, accumulated_vals, &lag_sums);
+    vector<Array2D> output_arrays;
     {
-        int thread_id = omp_get_thread_num();
-        vector_2d& local_output = thread_local_results[thread_id];
+        PROFILE_PHASE("reduction");
+        output_arrays = reduce_stacked_accumulators(accumulated_vals, 1, plan.window,
+                                                    plan.binning.is_exact() ? nullptr : &lag_sums);
+    }
+    return output_arrays;
+}
+
+/**
+ * \brief Calculates the nth order structure function of each slice of a single precision cube, half the size of a
+ * double precision one. The differences and their moments are computed in double precision, so the results only differ
+ * from those of the converted slices by the rounding of the values to single precision.
+ * \param plan The pair geometry of the slices, along with the range of distances and the bins of the pairs.
+ * \param input_slices The slices as two-dimensional arrays of the shape of the plan.
+ * \param order The order of the structure function to compute.
+ */
+vector<Array2D> structure_function_cube(const StructureFunctionPlan& plan, const vector<FloatArray2D>& input_slices,
+                                        const int order) {
+    vector<lag_squared_accumulator_table> accumulated_vals;
+    vector<vector<double>> lag_sums;
+    accumulate_subtracted_pairs(plan, input_slices, order, accumulated_vals, &lag_sums);
+    vector<Array2D> output_arrays;
+    {
+        PROFILE_PHASE("reduction");
+        output_arrays = reduce_stacked_accumulators(accumulated_vals, 1, plan.window,
+                                                    plan.binning.is_exact() ? nullptr : &lag_sums);
+    }
+    return output_arrays;
+}
+
+/**
+ * \brief Calculates the nth order structure function of each slice of a cube with a plan made for its slices.
+ * \param input_slices The slices as two-dimensional arrays of the same shape.
+ * \param order The order of the structure function to compute.
+ * \param window The range of distances of the pairs to consider.
+ * \param binning The bins in which to regroup the pairs.
+ */
+vector<Array2D> structure_function_cube(const vector<Array2D>& input_slices, const int order,
+                                        const LagWindow& window, const LagBinning& binning) {
+    if (input_slices.empty()) return {};
+    StructureFunctionPlan plan(input_slices[0].height, input_slices[0].width, window, binning);
+    return structure_function_cube(plan, input_slices, order);
+}
+
+/**
+ * \brief Calculates the nth order structure function of two-dimensional data with a precomputed plan, which avoids
+ * computing the pair geometry again for every array of the same shape.
+ * \param plan The pair geometry of the array, along with the range of distances and the bins of the pairs.
+ * \param input_array The input as a two-dimensional array of the shape of the plan.
+ * \param order The order of the structure function to compute.
+ * \return Array of shape (n_lags, 3) whose rows are the lag, the structure function and its uncertainty, sorted by lag.
+ */
+Array2D structure_function(const StructureFunctionPlan& plan, const Array2D& input_array, const int order) {
+    return structure_function_cube(plan, {input_array}, order)[0];
+}
+
+/**
+ * \brief Calculates the nth order structure function of single precision two-dimensional data with a precomputed plan.
+ */
+Array2D structure_function(const StructureFunctionPlan& plan, const FloatArray2D& input_array, const int order) {
+    return structure_function_cube(plan, {input_array}, order)[0];
+}
 
-        #pragma omp for
-        for (int i = 0; i < regrouped_vals.size(); ++i) {
-            auto it = next(regrouped_vals.begin(), i);  // access ith element
-            const auto& [dist, vals] = *it;
-            if (dist == 0) continue;  // reject zero distances
+/**
+ * \brief Calculates the nth order structure function of single precision two-dimensional data by accumulating the
+ * pairs in double precision, with a plan made for the array.
+ * \param input_array The input as a two-dimensional array.
+ * \param order The order of the structure function to compute.
+ * \param window The range of distances of the pairs to consider.
+ * \param binning The bins in which to regroup the pairs.
+ */
+Array2D structure_function(const FloatArray2D& input_array, const int order, const LagWindow& window,
+                           const LagBinning& binning) {
+    return structure_function(StructureFunctionPlan(input_array.height, input_array.width, window, binning),
+                              input_array, order);
+}
+
+/**
+ * \brief Calculates the nth order structure function of every region of two-dimensional data, and optionally of every
+ * couple of regions, in a single pass over the pairs of points. This is much faster than computing the structure
+ * function of each region separately when there are many regions, as the pairs are only enumerated once.
+ * \param plan The pair geometry of the array, along with the range of distances and the bins of the pairs.
+ * \param input_array The input as a two-dimensional array of the shape of the plan.
+ * \param regions The regions of the points of the input_array. The pairs of points of the same region give the
+ * structure function of the region, and the pairs of points of two regions give the one of the couple, if asked.
+ * \param order The order of the structure function to compute.
+ * \return The labels of each structure function and the arrays of shape (n_lags, 3) whose rows are the lag, the
+ * structure function and its uncertainty. Every structure function has the same rows, which are the lags reached by
+ * at least one of them, sorted by lag, and the lags that a structure function does not reach are NaN.
+ * \throws invalid_argument If the tables of the regions do not fit in the memory budget of the installed RunControl.
+ */
+RegionStructureFunctions region_structure_functions(const StructureFunctionPlan& plan, const Array2D& input_array,
+                                                    const RegionLabels& regions, const int order) {
+    vector<lag_squared_accumulator_table> accumulated_vals;
+    vector<vector<double>> lag_sums;
+    accumulate_subtracted_region_pairs(plan, input_array, regions, order, accumulated_vals, &lag_sums);
+    return {regions.table_labels(), reduce_stacked_accumulators(accumulated_vals, 1, plan.window,
+                                                                plan.binning.is_exact() ? nullptr : &lag_sums)};
+}
+
+/**
+ * \brief Calculates the nth order structure function of every region of two-dimensional data given by a label image,
+ * with a plan made for the array.
+ * \param input_array The input as a two-dimensional array.
+ * \param label_image The label of each point of the input_array in row-major order. Each non-negative label is a
+ * region, and the points of negative label belong to none.
+ * \param order The order of the structure function to compute.
+ * \param cross_regions Whether to also compute the structure function of the pairs of points of two different regions.
+ * \param window The range of distances of the pairs to consider.
+ * \param binning The bins in which to regroup the pairs.
+ */
+RegionStructureFunctions region_structure_functions(const Array2D& input_array, const vector<int64_t>& label_image,
+                                                    const int order, const bool cross_regions,
+                                                    const LagWindow& window, const LagBinning& binning) {
+    RegionLabels regions(input_array.height, input_array.width, label_image, cross_regions);
+    StructureFunctionPlan plan(input_array.height, input_array.width, window, binning);
+    return region_structure_functions(plan, input_array, regions, order);
+}
+
+/**
+ * \brief Copies the array and accumulates the pairs of all of its valid pixels.
+ * \param input_array The input as a two-dimensional array.
+ * \param order The order of the structure function to compute.
+ * \param window The range of distances of the pairs to consider.
+ * \param binning The bins in which to regroup the pairs.
+ */
+StructureFunctionAccumulator::StructureFunctionAccumulator(const Array2D& input_array, const int order,
+                                                           const LagWindow& window, const LagBinning& binning)
+    : plan(input_array.height, input_array.width, window, binning), order(order),
+      input_array(input_array.height, input_array.width), is_active(input_array.size(), 0) {
+    for (size_t y = 0; y < input_array.height; ++y) {
+        for (size_t x = 0; x < input_array.width; ++x) {
+            this->input_array(y, x) = input_array(y, x);
+            is_active[y * input_array.width + x] = !isnan(input_array(y, x));
+        }
+    }
+    vector<lag_squared_accumulator_table> tables;
+    vector<vector<double>> sums;
+    accumulate_subtracted_pairs(plan, {this->input_array}, order, tables, &sums);
+    accumulated_vals = move(tables[0]);
+    if (!sums.empty()) lag_sums = move(sums[0]);
+}
+
+/**
+ * \brief Gives the sorted row-major indices of the given pixels whose state changes, which are the valid inactive
+ * pixels when activating and the active pixels otherwise. The pixels given more than once are only changed once.
+ * \param accumulator The accumulator whose pixels change.
+ * \param pixels The (y, x) coordinates of the pixels, which must be in the array.
+ * \param activate Whether the pixels are added to the pairs or removed from them.
+ */
+static vector<size_t> changed_points(const StructureFunctionAccumulator& accumulator,
+                                     const vector<array<size_t, 2>>& pixels, const bool activate) {
+    const Array2D& input_array = accumulator.input_array;
+    vector<size_t> points;
+    for (const auto& pixel : pixels) {
+        if (pixel[0] >= input_array.height || pixel[1] >= input_array.width) {
+            throw invalid_argument("The pixel (" + to_string(pixel[0]) + ", " + to_string(pixel[1]) + ") is outside of "
+                                   "the array of shape (" + to_string(input_array.height) + ", "
+                                   + to_string(input_array.width) + ").");
+        }
+        const size_t point = pixel[0] * input_array.width + pixel[1];
+        if (accumulator.is_active[point] == activate || isnan(input_array(pixel[0], pixel[1]))) continue;
+        points.push_back(point);
+    }
+    sort(points.begin(), points.end());
+    points.erase(unique(points.begin(), points.end()), points.end());
+    return points;
+}
+
+/**
+ * \brief Adds pixels to the pairs, merging the pairs that they make with the active pixels and with each other.
+ * \param pixels The (y, x) coordinates of the pixels to add. The pixels that are already active or whose value is NaN
+ * are ignored.
+ * \return The number of pixels that were added.
+ */
+size_t StructureFunctionAccumulator::add_pixels(const vector<array<size_t, 2>>& pixels) {
+    const vector<size_t> points = changed_points(*this, pixels, true);
+    lag_squared_accumulator_table changed_vals;
+    vector<double> changed_lag_sums;
+    accumulate_subtracted_changed_pairs(plan, input_array, is_active, points, order, changed_vals, &changed_lag_sums);
+    for (size_t index = 0; index < accumulated_vals.size(); ++index) {
+        accumulated_vals[index].merge(changed_vals[index]);
+    }
+    for (size_t bin = 0; bin < lag_sums.size(); ++bin) {
+        lag_sums[bin] += changed_lag_sums[bin];
+    }
+    for (const size_t point : points) {
+        is_active[point] = 1;
+    }
+    return points.size();
+}
+
+/**
+ * \brief Removes pixels from the pairs, removing the pairs that they make with the other active pixels and with each
+ * other.
+ * \param pixels The (y, x) coordinates of the pixels to remove. The pixels that are not active are ignored.
+ * \return The number of pixels that were removed.
+ */
+size_t StructureFunctionAccumulator::remove_pixels(const vector<array<size_t, 2>>& pixels) {
+    const vector<size_t> points = changed_points(*this, pixels, false);
+    lag_squared_accumulator_table changed_vals;
+    vector<double> changed_lag_sums;
+    accumulate_subtracted_changed_pairs(plan, input_array, is_active, points, order, changed_vals, &changed_lag_sums);
+    for (size_t index = 0; index < accumulated_vals.size(); ++index) {
+        accumulated_vals[index].remove(changed_vals[index]);
+    }
+    for (size_t bin = 0; bin < lag_sums.size(); ++bin) {
+        // A bin without pairs has no distance, which also discards the rounding errors of the removals
+        lag_sums[bin] = (accumulated_vals[bin].count == 0) ? 0 : lag_sums[bin] - changed_lag_sums[bin];
+    }
+    for (const size_t point : points) {
+        is_active[point] = 0;
+    }
+    return points.size();
+}
+
+size_t StructureFunctionAccumulator::number_of_active_pixels() const {
+    return count(is_active.begin(), is_active.end(), 1);
+}
+
+/**
+ * \brief Gives the structure function of the pairs of the active pixels.
+ * \return Array of shape (n_lags, 3) whose rows are the lag, the structure function and its uncertainty, sorted by lag.
+ */
+Array2D StructureFunctionAccumulator::structure_function() const {
+    return structure_function_from_table(plan, accumulated_vals, lag_sums);
+}
 
-            vector<double> pow_values = pow(vals, (double)order);
-            int N = pow_values.size();
-            if (N == 1) continue;  // skip if there is only one value
+/**
+ * \brief Calculates the nth order structure function of two-dimensional data as a function of the offset (dx, dy)
+ * between the points of each pair instead of their distance, which resolves the anisotropy of the data (e.g. sheared
+ * flows). The pairs are accumulated in a flat table indexed by offset.
+ * \param input_array The input as a two-dimensional array of shape (H, W).
+ * \param order The order of the structure function to compute.
+ * \param fft Whether to compute the pair sums with Fourier transforms, whose cost is O(N log N) instead of O(N^2). Only
+ * order=2 is supported in this case.
+ * \param window The range of distances of the pairs to consider. With fft=true, this only limits the output.
+ * \return The maps of shape (2H - 1, 2W - 1) of the structure function, of its uncertainty and of the number of pairs.
+ * The offset (dy, dx) is at the row H - 1 + dy and the column W - 1 + dx, and the map is symmetric as the offsets
+ * (dy, dx) and (-dy, -dx) have the same pairs. The structure function of the offsets without pairs, as well as the
+ * uncertainty of the offsets with a single pair, are NaN. The zero offset is not computed.
+ */
+StructureFunctionMap structure_function_2d(const Array2D& input_array, const int order, const bool fft,
+                                           const LagWindow& window) {
+    const size_t height = input_array.height;
+    const size_t width = input_array.width;
+    if (fft && order != 2) {
+        throw invalid_argument("The FFT structure function only supports order=2, got order=" + to_string(order) + ".");
+    }
+    if (height * width == 0) return StructureFunctionMap();
 
-            double mean_val = mean(pow_values);
-            double std_val = standard_deviation(pow_values);
-            double structure = mean_val;
-            double structure_uncertainty = std_val / (sqrt(N - 1));  // sample standard error
+    lag_squared_accumulator_table accumulated_vals;
+    if (fft) {
+        accumulate_subtracted_offsets_fft(input_array, accumulated_vals);
+    } else {
+        accumulate_subtracted_offsets(input_array, order, accumulated_vals, window);
+    }
 
-            // Store result in thread-local buffer
-            local_output.push_back({dist, structure, structure_uncertainty});
+    StructureFunctionMap output_maps;
+    output_maps.structure = Array2D(2 * height - 1, 2 * width - 1, NAN);
+    output_maps.uncertainty = Array2D(2 * height - 1, 2 * width - 1, NAN);
+    output_maps.counts = Array2D(2 * height - 1, 2 * width - 1, 0);
+    for (ptrdiff_t dy = 0; dy < (ptrdiff_t)height; ++dy) {
+        for (ptrdiff_t dx = 1 - (ptrdiff_t)width; dx < (ptrdiff_t)width; ++dx) {
+            size_t lag_squared = dy * dy + dx * dx;
+            if (lag_squared == 0 || !window.contains(lag_squared)) continue;  // reject zero distances
+            const MomentAccumulator<>& accumulator = accumulated_vals[half_plane_offset_index(dy, dx, width)];
+            if (accumulator.count == 0) continue;
+
+            // Both offsets of the pair are written, so the map is symmetric
+            for (ptrdiff_t sign : {1, -1}) {
+                size_t row = height - 1 + sign * dy;
+                size_t column = width - 1 + sign * dx;
+                output_maps.structure(row, column) = accumulator.mean;
+                output_maps.counts(row, column) = accumulator.count;
+                if (accumulator.count > 1) output_maps.uncertainty(row, column) = accumulator.standard_error();
+            }
         }
     }
+    return output_maps;
+}
 
-    // Combine results from all threads
-    for (const auto& local_result : thread_local_results) {
-        output_array.insert(output_array.end(), local_result.begin(), local_result.end());
+/**
+ * \brief Calculates the nth order structure function of two-dimensional data.
+ * \param input_array The input as a two-dimensional array. Its buffer is read directly, so a vector_2d given here is
+ * copied once in a contiguous array.
+ * \param order The order of the structure function to compute. For example, order=1 will only output the average
+ * difference between pairs of points as a function of their distance.
+ * \param streaming Whether to accumulate the pair values on the fly instead of storing each one of them. Both modes
+ * give the same result, but the streaming mode has a memory usage that only scales with the number of unique distances.
+ * \param window The range of distances of the pairs to consider. The pairs farther than its max_lag are never
+ * enumerated, so a small max_lag makes the cost scale as O(N max_lag^2) instead of O(N^2).
+ * \param binning The bins in which to regroup the pairs. By default, each exact distance has its own bin. Linear,
+ * logarithmic or explicit bins give fewer and better populated bins, whose lag is the mean distance of their pairs.
+ * \return Array of shape (n_lags, 3) whose rows are the lag, the structure function and its uncertainty, sorted by lag.
+ * \note With a memory budget in the RunControl of the calling thread, the pairs are streamed when storing them would
+ * exceed it, even if streaming is false.
+ */
+Array2D structure_function(const Array2D& input_array, const int order, const bool streaming,
+                           const LagWindow& window, const LagBinning& binning) {
+    const RunControl* control = current_run_control();
+    const bool fits_in_budget = control == nullptr || !control->has_budget()
+        || 2 * max_number_of_pairs(input_array, window) * sizeof(array<double, 2>) <= control->max_memory_bytes;
+    if (streaming || !fits_in_budget) {
+        return structure_function_streaming(input_array, order, window, binning);
     }
+    return structure_function_materialized(input_array, order, window, binning);
+}
+
+/**
+ * \brief Calculates the structure functions of several orders of two-dimensional data in a single pass over the pairs
+ * of points. This is faster than calling structure_function for each order, as the pairs are only enumerated once and
+ * the powers of each difference are computed incrementally.
+ * \param input_array The input as a two-dimensional array.
+ * \param orders The non-negative orders of the structure functions to compute.
+ * \param window The range of distances of the pairs to consider.
+ * \param binning The bins in which to regroup the pairs.
+ * \return Array of shape (n_lags, 1 + 2 * n_orders) whose rows are the lag followed by the structure function and its
+ * uncertainty for each order, in the given order, sorted by lag.
+ */
+Array2D structure_functions(const Array2D& input_array, const vector<int>& orders, const LagWindow& window,
+                            const LagBinning& binning) {
+    return structure_functions(StructureFunctionPlan(input_array.height, input_array.width, window, binning),
+                               input_array, orders);
+}
 
+/**
+ * \brief Calculates the structure functions of several orders of two-dimensional data in a single pass over the pairs
+ * of points, with a precomputed plan.
+ * \param plan The pair geometry of the array, along with the range of distances and the bins of the pairs.
+ * \param input_array The input as a two-dimensional array of the shape of the plan.
+ * \param orders The non-negative orders of the structure functions to compute.
+ * \return Array of shape (n_lags, 1 + 2 * n_orders) whose rows are the lag followed by the structure function and its
+ * uncertainty for each order, in the given order, sorted by lag.
+ */
+Array2D structure_functions(const StructureFunctionPlan& plan, const Array2D& input_array, const vector<int>& orders) {
+    if (orders.empty()) {
+        throw invalid_argument("At least one order must be given.");
+    }
+    vector<lag_squared_accumulator_table> accumulated_vals;
+    vector<vector<double>> lag_sums;
+    accumulate_subtracted_pairs(plan, {input_array}, orders, accumulated_vals, &lag_sums);
+    return reduce_stacked_accumulators(accumulated_vals, orders.size(), plan.window,
+                                       plan.binning.is_exact() ? nullptr : &lag_sums)[0];
+}
+
+/**
+ * \brief Gives a contiguous copy of an array from which its mean is subtracted, along with the variance of the array.
+ */
+static pair<Array2D, double> centered_copy(const Array2D& input_array) {
+    Array2D centered_array(input_array.height, input_array.width);
+    for (size_t y = 0; y < input_array.height; ++y) {
+        for (size_t x = 0; x < input_array.width; ++x) {
+            centered_array(y, x) = input_array(y, x);
+        }
+    }
+    subtract_mean(centered_array);
+    double variance_val = variance(centered_array);
+    if (!(variance_val > 0)) {
+        throw invalid_argument("The autocorrelation requires an array with a non-zero variance.");
+    }
+    return {centered_array, variance_val};
+}
+
+/**
+ * \brief Divides the values and uncertainties of (lag, value, uncertainty) rows by the given variance.
+ */
+static Array2D normalize_by_variance(Array2D output_array, const double variance_val) {
+    for (size_t row = 0; row < output_array.height; ++row) {
+        output_array(row, 1) /= variance_val;
+        output_array(row, 2) /= variance_val;
+    }
     return output_array;
 }
+
+/**
+ * \brief Calculates the spatial autocorrelation function of two-dimensional data with a precomputed plan, i.e. the mean
+ * product of the pairs of points of the centered data as a function of their distance, normalized by the variance. The
+ * pairs are enumerated by the same engine as structure_function.
+ * \param plan The pair geometry of the array, along with the range of distances and the bins of the pairs.
+ * \param input_array The input as a two-dimensional array of the shape of the plan. NaN values are ignored.
+ * \return Array of shape (n_lags, 3) whose rows are the lag, the autocorrelation and its uncertainty, sorted by lag.
+ * The zero lag, whose autocorrelation is 1 by definition, is not given.
+ */
+Array2D autocorrelation(const StructureFunctionPlan& plan, const Array2D& input_array) {
+    auto [centered_array, variance_val] = centered_copy(input_array);
+    vector<lag_squared_accumulator_table> accumulated_vals;
+    vector<vector<double>> lag_sums;
+    accumulate_multiplied_pairs(plan, {centered_array}, accumulated_vals, &lag_sums);
+    Array2D output_array = reduce_stacked_accumulators(accumulated_vals, 1, plan.window,
+                                                       plan.binning.is_exact() ? nullptr : &lag_sums)[0];
+    return normalize_by_variance(output_array, variance_val);
+}
+
+/**
+ * \brief Calculates the spatial autocorrelation function of two-dimensional data, normalized by the variance.
+ * \param input_array The input as a two-dimensional array. NaN values are ignored.
+ * \param fft Whether to compute the pair sums with Fourier transforms, whose cost is O(N log N) instead of O(N^2).
+ * \param window The range of distances of the pairs to consider. With fft=true, this only limits the output.
+ * \param binning The bins in which to regroup the pairs.
+ * \return Array of shape (n_lags, 3) whose rows are the lag, the autocorrelation and its uncertainty, sorted by lag.
+ */
+Array2D autocorrelation(const Array2D& input_array, const bool fft, const LagWindow& window,
+                        const LagBinning& binning) {
+    if (!fft) {
+        return autocorrelation(StructureFunctionPlan(input_array.height, input_array.width, window, binning),
+                               input_array);
+    }
+    auto [centered_array, variance_val] = centered_copy(input_array);
+    lag_squared_accumulator_table accumulated_vals;
+    accumulate_multiplied_pairs_fft(centered_array, accumulated_vals);
+    return normalize_by_variance(reduce_binned_accumulators(accumulated_vals, 1, window, binning), variance_val);
+}
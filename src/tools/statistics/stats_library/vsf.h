@@ -1,3 +1,160 @@
+#pragma once
+
 #include "stats.h"
+#include "sampling.h"
+
+/**
+ * \struct StructureFunctionMap
+ * \brief Maps of a structure function computed as a function of the offset (dx, dy) between the points of each pair,
+ * with the uncertainty and the number of pairs of each offset.
+ */
+struct StructureFunctionMap
+{
+    Array2D structure;
+    Array2D uncertainty;
+    Array2D counts;
+};
+
+/**
+ * \struct RegionStructureFunctions
+ * \brief Structure functions of the regions of an array, and of the couples of regions if asked. The structure function
+ * of each table of the regions comes with the labels of its two regions, which are the same for a single region.
+ */
+struct RegionStructureFunctions
+{
+    std::vector<std::array<int64_t, 2>> labels;
+    std::vector<Array2D> structures;
+};
+
+/**
+ * \struct StructureFunctionAccumulator
+ * \brief Structure function of an array whose pixels can be added to or removed from the pairs after it is computed,
+ * as when a mask is edited. The accumulators of every lag are kept, and each change only accumulates the pairs of the
+ * changed pixels, in O(k N) for k changed pixels instead of O(N^2) to compute everything again. Only the valid pixels
+ * of the array can be added, and they are all in the pairs at first.
+ */
+struct StructureFunctionAccumulator
+{
+    StructureFunctionPlan plan;
+    int order;
+    Array2D input_array;  // owned copy of the array
+    std::vector<uint8_t> is_active;  // whether each pixel is in the pairs, in row-major order
+    lag_squared_accumulator_table accumulated_vals;
+    std::vector<double> lag_sums;  // only used if the binning is not exact
+
+    StructureFunctionAccumulator(const Array2D& input_array, const int order, const LagWindow& window = LagWindow(),
+                                 const LagBinning& binning = LagBinning());
+
+    size_t add_pixels(const std::vector<std::array<size_t, 2>>& pixels);
+    size_t remove_pixels(const std::vector<std::array<size_t, 2>>& pixels);
+    size_t number_of_active_pixels() const;
+    Array2D structure_function() const;
+};
 
-vector_2d structure_function(const vector_2d& input_array, const int order);
+Array2D structure_function_from_table(
+    const StructureFunctionPlan& plan,
+    const lag_squared_accumulator_table& accumulated_vals,
+    const std::vector<double>& lag_sums
+);
+Array2D structure_function_materialized(
+    const Array2D& input_array,
+    const int order,
+    const LagWindow& window = LagWindow(),
+    const LagBinning& binning = LagBinning()
+);
+Array2D structure_function_streaming(
+    const Array2D& input_array,
+    const int order,
+    const LagWindow& window = LagWindow(),
+    const LagBinning& binning = LagBinning()
+);
+Array2D structure_function_fft(
+    const Array2D& input_array,
+    const int order = 2,
+    const LagWindow& window = LagWindow(),
+    const LagBinning& binning = LagBinning()
+);
+Array2D structure_function_sampled(
+    const Array2D& input_array,
+    const int order,
+    const SamplingOptions& options,
+    const LagWindow& window = LagWindow(),
+    const LagBinning& binning = LagBinning()
+);
+std::vector<Array2D> structure_function_cube(
+    const StructureFunctionPlan& plan,
+    const std::vector<Array2D>& input_slices,
+    const int order
+);
+std::vector<Array2D> structure_function_cube(
+    const StructureFunctionPlan& plan,
+    const std::vector<FloatArray2D>& input_slices,
+    const int order
+);
+std::vector<Array2D> structure_function_cube(
+    const std::vector<Array2D>& input_slices,
+    const int order,
+    const LagWindow& window = LagWindow(),
+    const LagBinning& binning = LagBinning()
+);
+StructureFunctionMap structure_function_2d(
+    const Array2D& input_array,
+    const int order,
+    const bool fft = false,
+    const LagWindow& window = LagWindow()
+);
+Array2D structure_function(
+    const StructureFunctionPlan& plan,
+    const Array2D& input_array,
+    const int order
+);
+Array2D structure_function(
+    const Array2D& input_array,
+    const int order,
+    const bool streaming = true,
+    const LagWindow& window = LagWindow(),
+    const LagBinning& binning = LagBinning()
+);
+Array2D structure_function(
+    const StructureFunctionPlan& plan,
+    const FloatArray2D& input_array,
+    const int order
+);
+Array2D structure_function(
+    const FloatArray2D& input_array,
+    const int order,
+    const LagWindow& window = LagWindow(),
+    const LagBinning& binning = LagBinning()
+);
+Array2D structure_functions(
+    const Array2D& input_array,
+    const std::vector<int>& orders,
+    const LagWindow& window = LagWindow(),
+    const LagBinning& binning = LagBinning()
+);
+Array2D structure_functions(
+    const StructureFunctionPlan& plan,
+    const Array2D& input_array,
+    const std::vector<int>& orders
+);
+RegionStructureFunctions region_structure_functions(
+    const StructureFunctionPlan& plan,
+    const Array2D& input_array,
+    const RegionLabels& regions,
+    const int order
+);
+RegionStructureFunctions region_structure_functions(
+    const Array2D& input_array,
+    const std::vector<int64_t>& label_image,
+    const int order,
+    const bool cross_regions = false,
+    const LagWindow& window = LagWindow(),
+    const LagBinning& binning = LagBinning()
+);
+Array2D autocorrelation(const StructureFunctionPlan& plan, const Array2D& input_array);
+Array2D autocorrelation(
+    const Array2D& input_array,
+    const bool fft = false,
+    const LagWindow& window = LagWindow(),
+    const LagBinning& binning = LagBinning()
+);